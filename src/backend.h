@@ -5,6 +5,43 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include "ts.h"
+#include "byteops.h"
+
+/* Largest packet size handled by the backends (188, 204 or 208 bytes) */
+#define TS_MAX_PACKET_SIZE 208
+
+/**
+ * A transport stream packet as delivered by the backend's read_batch() method.
+ * @header: decoded transport stream header
+ * @payload: pointer to the first byte after the 4-byte TS header. It usually
+ *  points to @data, but backends are free to point it elsewhere as long as
+ *  the memory remains valid until the next call to read_batch(), or until
+ *  destroy() for backends flagged with BACKEND_STABLE_PAYLOADS.
+ * @data: raw packet contents
+ */
+struct ts_packet {
+	struct ts_header header;
+	const char *payload;
+	char data[TS_MAX_PACKET_SIZE];
+};
+
+/**
+ * backend_decode_header: fills @header from the first 4 bytes of @packet.
+ */
+static inline void backend_decode_header(struct ts_header *header, const char *packet)
+{
+	header->sync_byte                    =  packet[0];
+	header->transport_error_indicator    = (packet[1] >> 7) & 0x01;
+	header->payload_unit_start_indicator = (packet[1] >> 6) & 0x01;
+	header->transport_priority           = (packet[1] >> 5) & 0x01;
+	header->pid                          = CONVERT_TO_16(packet[1], packet[2]) & 0x1fff;
+	header->transport_scrambling_control = (packet[3] >> 6) & 0x03;
+	header->adaptation_field             = (packet[3] >> 4) & 0x03;
+	header->continuity_counter           = (packet[3]) & 0x0f;
+}
+
+/* Payloads which don't point to ts_packet->data remain valid until destroy() */
+#define BACKEND_STABLE_PAYLOADS (1 << 0)
 
 /* Backend operations */
 struct backend_ops {
@@ -13,8 +50,10 @@ struct backend_ops {
 	int (*set_frequency)(uint32_t, struct demuxfs_data *);
     int (*read)(struct demuxfs_data *);
 	int (*process)(struct ts_header *, void **, struct demuxfs_data *);
+	int (*read_batch)(struct ts_packet *, int, struct demuxfs_data *);
     bool (*keep_alive)(struct demuxfs_data *);
 	void (*usage)(void);
+	unsigned int flags;
 };
 
 struct backend_ops *backend_load(const char *backend_name, void **backend_handle);
@@ -32,6 +32,7 @@
 #include "byteops.h"
 #include "backend.h"
 #include "ts.h"
+#include "tssync.h"
 
 struct input_parser {
 	char *filesrc;				/**< File source (cmdline option) */
@@ -40,6 +41,13 @@ struct input_parser {
 	bool packet_valid;			/**< True if TS packet is valid, False if it's not */
 	uint8_t packet_size;		/**< Packet size (188, 204, 208 bytes) */
 	int fileloop;				/**< How many times to loop the file on EOF (cmdline option) */
+	int filemmap;				/**< Map the input file in memory (cmdline option) */
+	const char *map;			/**< Memory mapped file source, or NULL when using stdio */
+	size_t map_size;			/**< Size of the mapping */
+	size_t map_start;			/**< Offset of the first packet in the mapping */
+	size_t map_offset;			/**< Offset of the next packet to be read from the mapping */
+	const char *current;		/**< Packet returned by the last read(), in p->packet or in the mapping */
+	struct ts_resync resync;	/**< Bytes read ahead while resynchronizing and statistics */
 };
 
 /**
@@ -49,7 +57,8 @@ void filesrc_usage(void)
 {
 	fprintf(stderr, "\nFILESRC options:\n"
 			"    -o filesrc=FILE          transport stream input file\n"
-			"    -o fileloop=<count>      how many times to loop on EOF, -1 means infinite (default: 0)\n");
+			"    -o fileloop=<count>      how many times to loop on EOF, -1 means infinite (default: 0)\n"
+			"    -o filemmap=<0|1>        map regular files in memory instead of reading them (default: 0)\n");
 }
 
 #define FILESRC_OPT(templ,offset,value) { templ, offsetof(struct input_parser, offset), value }
@@ -57,6 +66,7 @@ void filesrc_usage(void)
 static struct fuse_opt filesrc_opts[] = {
 	FILESRC_OPT("filesrc=%s",   filesrc, 0),
 	FILESRC_OPT("fileloop=%d",  fileloop, 0),
+	FILESRC_OPT("filemmap=%d",  filemmap, 0),
 	FUSE_OPT_END
 };
 
@@ -104,6 +114,115 @@ static bool search_sync_byte(struct input_parser *p, uint8_t packet_size)
 	}
 }
 
+/**
+ * filesrc_map_file: maps the file source in memory so that packets can be
+ * handed to the parser without being copied. FIFOs and files which cannot be
+ * mapped are left to the stdio code path.
+ */
+static void filesrc_map_file(struct input_parser *p)
+{
+	struct stat statbuf;
+	void *map;
+
+	if (fstat(fileno(p->fp), &statbuf) < 0 || ! S_ISREG(statbuf.st_mode) || statbuf.st_size == 0)
+		return;
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fileno(p->fp), 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+	if (madvise(map, statbuf.st_size, MADV_SEQUENTIAL) < 0)
+		perror("madvise");
+
+	p->map = (const char *) map;
+	p->map_size = statbuf.st_size;
+	p->map_start = ftell(p->fp);
+	p->map_offset = p->map_start;
+}
+
+/**
+ * filesrc_loop_again: tells whether the fileloop option allows for one more
+ * pass over the file, and accounts for it.
+ */
+static bool filesrc_loop_again(struct input_parser *p)
+{
+	if (p->fileloop == 0)
+		return false;
+	if (p->fileloop > 0)
+		p->fileloop--;
+	return true;
+}
+
+/**
+ * filesrc_map_next: returns the next packet from the mapping, rewinding it
+ * as requested by the fileloop option. Returns NULL on EOF.
+ */
+static const char *filesrc_map_next(struct input_parser *p)
+{
+	const char *packet;
+	ssize_t offset;
+
+	while (p->map_offset + p->packet_size <= p->map_size) {
+		packet = &p->map[p->map_offset];
+		if (packet[0] == TS_SYNC_BYTE) {
+			p->map_offset += p->packet_size;
+			return packet;
+		}
+		/* Lost sync: skip to the next run of aligned packets, or to the end of the file */
+		offset = ts_sync_scan(packet, p->map_size - p->map_offset, p->packet_size, TS_RESYNC_PACKETS);
+		if (offset < 0)
+			/* Too few bytes are left for a full run: keep the last packets if they line up */
+			offset = ts_sync_scan_tail(packet, p->map_size - p->map_offset, p->packet_size);
+		if (offset < 0)
+			offset = p->map_size - p->map_offset;
+		TS_WARNING("lost sync, discarded %zd bytes", offset);
+		p->resync.discarded += offset;
+		p->map_offset += offset;
+	}
+
+	if (filesrc_loop_again(p)) {
+		dprintf("Rewinding TS file");
+		p->map_offset = p->map_start;
+	}
+	return NULL;
+}
+
+/**
+ * filesrc_resync_read: input callback for ts_resync_stream().
+ */
+static ssize_t filesrc_resync_read(void *handle, char *buf, size_t len)
+{
+	FILE *fp = (FILE *) handle;
+	size_t n = fread_unlocked(buf, 1, len, fp);
+	if (n == 0 && ferror_unlocked(fp))
+		return -EIO;
+	return n;
+}
+
+/**
+ * filesrc_fread_packet: reads the next packet into @packet, realigning the
+ * input if it doesn't start with the sync byte. Must be called with the
+ * stdio lock held.
+ * @return 1 if a packet was read, 0 on EOF and -1 on error.
+ */
+static int filesrc_fread_packet(struct input_parser *p, char *packet)
+{
+	size_t n;
+	int ret;
+
+	while (true) {
+		n = ts_resync_drain(&p->resync, packet, p->packet_size);
+		if (n < p->packet_size && fread_unlocked(&packet[n], p->packet_size - n, 1, p->fp) != 1)
+			return ferror_unlocked(p->fp) ? -1 : 0;
+		if (packet[0] == TS_SYNC_BYTE)
+			return 1;
+		ts_resync_unread(&p->resync, packet, p->packet_size);
+		ret = ts_resync_stream(&p->resync, p->packet_size, filesrc_resync_read, p->fp);
+		if (ret < 0)
+			return ret == -ENODATA ? 0 : -1;
+	}
+}
+
 /**
  * filesrc_create_parser: backend's create() method.
  */
@@ -146,6 +265,8 @@ int filesrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
 		return -1;
 	}
 	p->packet = (char *) malloc(p->packet_size * sizeof(char));
+	if (p->filemmap)
+		filesrc_map_file(p);
 
 	/* Configure packet size */
 	priv->options.packet_size = p->packet_size;
@@ -160,6 +281,11 @@ int filesrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
  */
 int filesrc_destroy_parser(struct demuxfs_data *priv)
 {
+	if (priv->parser->resync.discarded)
+		fprintf(stderr, "filesrc: discarded %llu bytes while resynchronizing\n",
+			(unsigned long long) priv->parser->resync.discarded);
+	if (priv->parser->map)
+		munmap((void *) priv->parser->map, priv->parser->map_size);
 	free(priv->parser->packet);
 	fclose(priv->parser->fp);
     free(priv->parser);
@@ -184,20 +310,31 @@ int filesrc_set_frequency(uint32_t frequency, struct demuxfs_data *priv)
 int filesrc_read_packet(struct demuxfs_data *priv)
 {
 	struct input_parser *p = priv->parser;
-	size_t n = fread(p->packet, p->packet_size, 1, p->fp);
-	if (n <= 0 && feof(p->fp)) {
+	if (p->map) {
+		p->current = filesrc_map_next(p);
+		p->packet_valid = p->current != NULL;
+		if (! p->current && p->map_offset != p->map_start)
+			return -ENODATA;
+		return 0;
+	}
+
+	flockfile(p->fp);
+	int ret = filesrc_fread_packet(p, p->packet);
+	funlockfile(p->fp);
+	if (ret == 0) {
 		p->packet_valid = false;
-		if (p->fileloop == -1 || p->fileloop--) {
+		if (filesrc_loop_again(p)) {
 			dprintf("Rewinding TS file");
 			rewind(p->fp);
 			return 0;
 		}
 		return -ENODATA;
-	} else if (n < 1) {
+	} else if (ret < 0) {
 		p->packet_valid = false;
 		perror("fread");
 		return -1;
 	}
+	p->current = p->packet;
 	p->packet_valid = true;
 	return 0;
 }
@@ -214,26 +351,72 @@ int filesrc_process_packet(struct ts_header *header, void **payload, struct demu
 	else if (! header || ! payload)
 		return -EINVAL;
 
-	*payload = (void *) &p->packet[4];
-
-	header->sync_byte                    =  p->packet[0];
-	header->transport_error_indicator    = (p->packet[1] >> 7) & 0x01;
-	header->payload_unit_start_indicator = (p->packet[1] >> 6) & 0x01;
-	header->transport_priority           = (p->packet[1] >> 5) & 0x01;
-	header->pid                          = CONVERT_TO_16(p->packet[1], p->packet[2]) & 0x1fff;
-	header->transport_scrambling_control = (p->packet[3] >> 6) & 0x03;
-	header->adaptation_field             = (p->packet[3] >> 4) & 0x03;
-	header->continuity_counter           = (p->packet[3]) & 0x0f;
+	*payload = (void *) &p->current[4];
+	backend_decode_header(header, p->current);
 
 	return 0;
 }
 
+/**
+ * filesrc_read_batch: backend's read_batch() method.
+ * @return the number of packets stored in @packets, -1 on error and -ENODATA
+ *  if there's no more data to be read.
+ */
+int filesrc_read_batch(struct ts_packet *packets, int count, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	int n = 0;
+
+	if (p->map) {
+		/* Hand out pointers into the mapping, no copies involved */
+		const char *data;
+		while (n < count && (data = filesrc_map_next(p)) != NULL) {
+			backend_decode_header(&packets[n].header, data);
+			packets[n].payload = &data[4];
+			n++;
+		}
+		if (n == 0 && p->map_offset != p->map_start)
+			return -ENODATA;
+		return n;
+	}
+
+	/* Take the stdio lock once for the whole batch */
+	flockfile(p->fp);
+	while (n < count) {
+		struct ts_packet *packet = &packets[n];
+		int ret = filesrc_fread_packet(p, packet->data);
+		if (ret == 1) {
+			backend_decode_header(&packet->header, packet->data);
+			packet->payload = &packet->data[4];
+			n++;
+		} else if (ret < 0) {
+			funlockfile(p->fp);
+			perror("fread");
+			return n ? n : -1;
+		} else if (filesrc_loop_again(p)) {
+			dprintf("Rewinding TS file");
+			rewind(p->fp);
+			break;
+		} else {
+			break;
+		}
+	}
+	funlockfile(p->fp);
+
+	if (n == 0 && feof(p->fp))
+		return -ENODATA;
+	return n;
+}
+
 /**
  * filesrc_keep_alive: backend's keep_alive() method.
  */
 bool filesrc_keep_alive(struct demuxfs_data *priv)
 {
-	return !feof(priv->parser->fp);
+	struct input_parser *p = priv->parser;
+	if (p->map)
+		return p->map_offset + p->packet_size <= p->map_size || p->fileloop != 0;
+	return !feof(p->fp) || ts_resync_pending(&p->resync);
 }
 
 struct backend_ops filesrc_backend_ops = {
@@ -242,8 +425,11 @@ struct backend_ops filesrc_backend_ops = {
 	.set_frequency = filesrc_set_frequency,
     .read = filesrc_read_packet,
     .process = filesrc_process_packet,
+	.read_batch = filesrc_read_batch,
     .keep_alive = filesrc_keep_alive,
 	.usage = filesrc_usage,
+	/* The mapping is only released by destroy() */
+	.flags = BACKEND_STABLE_PAYLOADS,
 };
 
 struct backend_ops *backend_get_ops(void)
@@ -9,6 +9,8 @@
 #include <stddef.h>
 #include <getopt.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #endif /* USE_FILESRC */
 
@@ -33,6 +33,7 @@
 #include "backend.h"
 #include "buffer.h"
 #include "ts.h"
+#include "tssync.h"
 
 #define LINUXDVB_DEFAULT_FRONTEND_DEVICE  "/dev/dvb/adapter0/frontend0"
 #define LINUXDVB_DEFAULT_DEMUX_DEVICE     "/dev/dvb/adapter0/demux0"
@@ -61,6 +62,7 @@ struct input_parser {
 	char *packet;
 	bool packet_valid;
 	uint8_t packet_size;
+	struct ts_resync resync;
 };
 
 static int linuxdvb_set_frequency_v3(uint32_t frequency, struct demuxfs_data *priv);
@@ -293,6 +295,10 @@ int linuxdvb_destroy_parser(struct demuxfs_data *priv)
 	if (ret < 0)
 		perror("DMX_STOP");
 
+	if (p->resync.discarded)
+		fprintf(stderr, "linuxdvb: discarded %llu bytes while resynchronizing\n",
+			(unsigned long long) p->resync.discarded);
+
 	close(p->demux_fd);
 	close(p->dvr_fd);
 	free(p->packet);
@@ -579,18 +585,52 @@ static int linuxdvb_set_frequency_v5(uint32_t frequency, struct demuxfs_data *pr
 	return -ETIMEDOUT;
 }
 
+/**
+ * linuxdvb_read_full: reads exactly @len bytes from the DVR device.
+ * @return true on success, false on errors.
+ */
+static bool linuxdvb_read_full(struct input_parser *p, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = read(p->dvr_fd, buf, len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/**
+ * linuxdvb_resync_read: input callback for ts_resync_stream().
+ */
+static ssize_t linuxdvb_resync_read(void *handle, char *buf, size_t len)
+{
+	struct input_parser *p = (struct input_parser *) handle;
+	ssize_t ret;
+
+	do {
+		ret = read(p->dvr_fd, buf, len);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
 /**
  * linuxdvb_read_parser: backend's read() method.
  */
 int linuxdvb_read_packet(struct demuxfs_data *priv)
 {
 	struct input_parser *p = priv->parser;
-	ssize_t n = read(p->dvr_fd, p->packet, p->packet_size);
-	if (n <= 0) {
+	size_t n = ts_resync_drain(&p->resync, p->packet, p->packet_size);
+	p->packet_valid = linuxdvb_read_full(p, &p->packet[n], p->packet_size - n);
+	if (p->packet_valid && p->packet[0] != TS_SYNC_BYTE) {
+		ts_resync_unread(&p->resync, p->packet, p->packet_size);
+		ts_resync_stream(&p->resync, p->packet_size, linuxdvb_resync_read, p);
 		p->packet_valid = false;
-		return 0;
 	}
-	p->packet_valid = true;
 	return 0;
 }
 
@@ -606,19 +646,67 @@ int linuxdvb_process_packet(struct ts_header *header, void **payload, struct dem
 		return -EINVAL;
 
 	*payload = (void *) &p->packet[4];
-
-	header->sync_byte                    =  p->packet[0];
-	header->transport_error_indicator    = (p->packet[1] >> 7) & 0x01;
-	header->payload_unit_start_indicator = (p->packet[1] >> 6) & 0x01;
-	header->transport_priority           = (p->packet[1] >> 5) & 0x01;
-	header->pid                          = CONVERT_TO_16(p->packet[1], p->packet[2]) & 0x1fff;
-	header->transport_scrambling_control = (p->packet[3] >> 6) & 0x03;
-	header->adaptation_field             = (p->packet[3] >> 4) & 0x03;
-	header->continuity_counter           = (p->packet[3]) & 0x0f;
+	backend_decode_header(header, p->packet);
 
 	return 0;
 }
 
+/**
+ * linuxdvb_read_batch: backend's read_batch() method.
+ * @return the number of packets stored in @packets.
+ */
+int linuxdvb_read_batch(struct ts_packet *packets, int count, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	struct iovec iov[count > 0 ? count : 1];
+	ssize_t n;
+	int i, j;
+
+	if (count <= 0)
+		return 0;
+
+	if (ts_resync_pending(&p->resync)) {
+		/* Hand out the bytes left over by the last resynchronization first */
+		for (i=0; i<count && ts_resync_pending(&p->resync); ++i) {
+			n = ts_resync_drain(&p->resync, packets[i].data, p->packet_size);
+			if (n < p->packet_size && ! linuxdvb_read_full(p, &packets[i].data[n], p->packet_size - n))
+				break;
+		}
+		count = i;
+	} else {
+		for (i=0; i<count; ++i) {
+			iov[i].iov_base = packets[i].data;
+			iov[i].iov_len = p->packet_size;
+		}
+
+		n = readv(p->dvr_fd, iov, count);
+		if (n <= 0)
+			return 0;
+
+		/* The DVR device is free to return a partial packet. Complete it before going on. */
+		if (n % p->packet_size) {
+			size_t missing = p->packet_size - (n % p->packet_size);
+			char *ptr = packets[n / p->packet_size].data + (n % p->packet_size);
+			if (linuxdvb_read_full(p, ptr, missing))
+				n += missing;
+		}
+		count = n / p->packet_size;
+	}
+
+	for (i=0; i<count; ++i) {
+		if (packets[i].data[0] != TS_SYNC_BYTE) {
+			/* Put the damaged packet and the ones after it back, then realign */
+			for (j=count-1; j>=i; --j)
+				ts_resync_unread(&p->resync, packets[j].data, p->packet_size);
+			ts_resync_stream(&p->resync, p->packet_size, linuxdvb_resync_read, p);
+			return i;
+		}
+		backend_decode_header(&packets[i].header, packets[i].data);
+		packets[i].payload = &packets[i].data[4];
+	}
+	return count;
+}
+
 /**
  * linuxdvb_keep_alive: backend's keep_alive() method.
  */
@@ -633,6 +721,7 @@ struct backend_ops linuxdvb_backend_ops = {
 	.set_frequency = linuxdvb_set_frequency,
 	.read          = linuxdvb_read_packet,
 	.process       = linuxdvb_process_packet,
+	.read_batch    = linuxdvb_read_batch,
 	.keep_alive    = linuxdvb_keep_alive,
 	.usage         = linuxdvb_usage,
 };
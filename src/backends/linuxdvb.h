@@ -11,6 +11,7 @@
 #include <getopt.h>
 #include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <linux/dvb/frontend.h>
 #include <linux/dvb/dmx.h>
@@ -0,0 +1,492 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "uringsrc.h"
+#include "byteops.h"
+#include "backend.h"
+#include "ts.h"
+#include "tssync.h"
+
+/* Defaults for the read-ahead window: 8 reads of 1 MiB each in flight */
+#define URINGSRC_DEFAULT_DEPTH   8
+#define URINGSRC_DEFAULT_BUFSIZE 1024
+#define URINGSRC_MAX_DEPTH       128
+
+struct uring_buffer {
+	char *data;					/**< Buffer memory, registered with the ring if possible */
+	off_t offset;				/**< File offset this buffer was read from */
+	size_t length;				/**< Number of bytes requested, 0 if past the end of the input */
+	size_t filled;				/**< Number of bytes read so far */
+	bool in_flight;				/**< True while a read is pending on this buffer */
+};
+
+struct input_parser {
+	char *uringsrc;				/**< File source (cmdline option) */
+	int fd;						/**< File source handle */
+	int fileloop;				/**< How many times to loop the file on EOF (cmdline option) */
+	int queue_depth;			/**< Number of reads kept in flight (cmdline option) */
+	int buffer_size;			/**< Size of each read, in KiB (cmdline option) */
+	struct io_uring ring;		/**< Submission and completion queues */
+	bool registered;			/**< True if the buffers were registered with the ring */
+	struct iovec *iovecs;		/**< Buffer descriptors handed to io_uring_register_buffers() */
+	struct uring_buffer *buffers; /**< Read-ahead buffers, consumed in ring order */
+	size_t read_size;			/**< Size of each read, rounded down to a multiple of packet_size */
+	off_t file_size;			/**< Size of the file source */
+	off_t next_offset;			/**< File offset of the next read to be submitted */
+	int head;					/**< Buffer packets are currently taken from */
+	size_t head_pos;			/**< Offset of the next packet in the head buffer */
+	int recycle;				/**< How many consumed buffers wait to be submitted again */
+	bool eof;					/**< True when there's no more data to be read */
+	uint8_t packet_size;		/**< Packet size (188, 204, 208 bytes) */
+	struct ts_packet packet;	/**< Packet returned by read() and process() */
+	bool packet_valid;			/**< True if packet is valid, False if it's not */
+	uint64_t bytes_read;		/**< Statistics: bytes completed by the kernel */
+	uint64_t discarded;			/**< Statistics: bytes skipped while resynchronizing */
+	struct timespec start_time;	/**< Statistics: when the first reads were submitted */
+};
+
+/**
+ * Command line parsing routines.
+ */
+void uringsrc_usage(void)
+{
+	fprintf(stderr, "\nURINGSRC options:\n"
+			"    -o uringsrc=FILE         transport stream input file\n"
+			"    -o uringloop=<count>     how many times to loop on EOF, -1 means infinite (default: 0)\n"
+			"    -o uringdepth=<count>    how many reads to keep in flight (default: %d)\n"
+			"    -o uringbufsize=<KiB>    size of each read (default: %d)\n",
+			URINGSRC_DEFAULT_DEPTH, URINGSRC_DEFAULT_BUFSIZE);
+}
+
+#define URINGSRC_OPT(templ,offset,value) { templ, offsetof(struct input_parser, offset), value }
+
+static struct fuse_opt uringsrc_opts[] = {
+	URINGSRC_OPT("uringsrc=%s",     uringsrc, 0),
+	URINGSRC_OPT("uringloop=%d",    fileloop, 0),
+	URINGSRC_OPT("uringdepth=%d",   queue_depth, 0),
+	URINGSRC_OPT("uringbufsize=%d", buffer_size, 0),
+	FUSE_OPT_END
+};
+
+static int uringsrc_parse_opts(void *priv, const char *arg, int key, struct fuse_args *outargs)
+{
+	return 1;
+}
+
+static bool search_sync_byte(struct input_parser *p, uint8_t packet_size)
+{
+	int i, attempts = 5;
+	char data;
+
+	for (i=0; i<attempts; ++i) {
+		if (pread(p->fd, &data, 1, (off_t) i * packet_size) != 1 || data != TS_SYNC_BYTE)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * uringsrc_prep_read: queues a read for the unfilled part of buffer @index.
+ */
+static void uringsrc_prep_read(struct input_parser *p, int index)
+{
+	struct uring_buffer *buf = &p->buffers[index];
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&p->ring);
+
+	/* At most queue_depth reads are ever pending, so the SQ can't be full */
+	assert(sqe);
+	if (p->registered)
+		io_uring_prep_read_fixed(sqe, p->fd, buf->data + buf->filled, buf->length - buf->filled,
+			buf->offset + buf->filled, index);
+	else
+		io_uring_prep_read(sqe, p->fd, buf->data + buf->filled, buf->length - buf->filled,
+			buf->offset + buf->filled);
+	io_uring_sqe_set_data(sqe, buf);
+	buf->in_flight = true;
+}
+
+/**
+ * uringsrc_fill_buffer: assigns the next chunk of the file to buffer @index
+ * and queues its read. Wraps around to the beginning of the file as requested
+ * by the uringloop option.
+ */
+static void uringsrc_fill_buffer(struct input_parser *p, int index)
+{
+	struct uring_buffer *buf = &p->buffers[index];
+
+	if (p->next_offset >= p->file_size && p->fileloop != 0) {
+		dprintf("Rewinding TS file");
+		if (p->fileloop > 0)
+			p->fileloop--;
+		p->next_offset = 0;
+	}
+
+	buf->offset = p->next_offset;
+	buf->filled = 0;
+	buf->length = 0;
+	buf->in_flight = false;
+	if (p->next_offset >= p->file_size)
+		return;
+
+	buf->length = p->file_size - p->next_offset;
+	if (buf->length > p->read_size)
+		buf->length = p->read_size;
+	p->next_offset += buf->length;
+	uringsrc_prep_read(p, index);
+}
+
+/**
+ * uringsrc_wait_buffer: reaps completions until @buf has been filled.
+ * @return 0 on success or a negative errno value on I/O errors.
+ */
+static int uringsrc_wait_buffer(struct input_parser *p, struct uring_buffer *buf)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_buffer *done;
+	int ret;
+
+	while (buf->in_flight) {
+		ret = io_uring_wait_cqe(&p->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		else if (ret < 0) {
+			fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
+			return ret;
+		}
+		done = (struct uring_buffer *) io_uring_cqe_get_data(cqe);
+		ret = cqe->res;
+		io_uring_cqe_seen(&p->ring, cqe);
+
+		if (ret == -EAGAIN || ret == -EINTR) {
+			/* Retry the very same read */
+		} else if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", p->uringsrc, strerror(-ret));
+			done->in_flight = false;
+			return ret;
+		} else if (ret == 0) {
+			/* File was truncated under our feet */
+			done->length = done->filled;
+			done->in_flight = false;
+			continue;
+		} else {
+			p->bytes_read += ret;
+			done->filled += ret;
+			if (done->filled == done->length) {
+				done->in_flight = false;
+				continue;
+			}
+		}
+		/* Short read: ask for the remainder so that buffers stay contiguous */
+		uringsrc_prep_read(p, done - p->buffers);
+		io_uring_submit(&p->ring);
+	}
+	return 0;
+}
+
+/**
+ * uringsrc_create_parser: backend's create() method.
+ */
+int uringsrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
+{
+	struct input_parser *p = calloc(1, sizeof(struct input_parser));
+	struct stat statbuf;
+	int i, ret;
+	assert(p);
+
+	p->fd = -1;
+	ret = fuse_opt_parse(args, p, uringsrc_opts, uringsrc_parse_opts);
+	if (ret < 0)
+		goto out_error;
+	if (! p->uringsrc) {
+		fprintf(stderr, "Error: missing '-o uringsrc=FILE' option\n");
+		goto out_error;
+	}
+	if (p->queue_depth <= 0)
+		p->queue_depth = URINGSRC_DEFAULT_DEPTH;
+	else if (p->queue_depth > URINGSRC_MAX_DEPTH)
+		p->queue_depth = URINGSRC_MAX_DEPTH;
+	if (p->buffer_size <= 0)
+		p->buffer_size = URINGSRC_DEFAULT_BUFSIZE;
+
+	p->fd = open(p->uringsrc, O_RDONLY);
+	if (p->fd < 0) {
+		perror(p->uringsrc);
+		goto out_error;
+	}
+	if (fstat(p->fd, &statbuf) < 0 || ! S_ISREG(statbuf.st_mode)) {
+		fprintf(stderr, "Error: %s is not a regular file, please use the filesrc backend.\n", p->uringsrc);
+		goto out_error;
+	}
+	p->file_size = statbuf.st_size;
+
+	/* Search for 188, 204 and 208-byte packets */
+	uint8_t packet_size[] = { 188, 204, 208 };
+	for (i=0; i<sizeof(packet_size)/sizeof(uint8_t); ++i) {
+		if (search_sync_byte(p, packet_size[i])) {
+			p->packet_size = packet_size[i];
+			break;
+		}
+	}
+	if (! p->packet_size) {
+		fprintf(stderr, "Error: %s doesn't seem to be a valid transport stream.\n", p->uringsrc);
+		goto out_error;
+	}
+
+	/* Reads are multiples of the packet size so that packets never straddle buffers */
+	p->read_size = ((size_t) p->buffer_size * 1024 / p->packet_size) * p->packet_size;
+	if (p->read_size == 0)
+		p->read_size = p->packet_size;
+
+	ret = io_uring_queue_init(p->queue_depth, &p->ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+		goto out_error;
+	}
+
+	p->iovecs = calloc(p->queue_depth, sizeof(struct iovec));
+	p->buffers = calloc(p->queue_depth, sizeof(struct uring_buffer));
+	assert(p->iovecs && p->buffers);
+	for (i=0; i<p->queue_depth; ++i) {
+		ret = posix_memalign((void **) &p->buffers[i].data, 4096, p->read_size);
+		assert(ret == 0);
+		p->iovecs[i].iov_base = p->buffers[i].data;
+		p->iovecs[i].iov_len = p->read_size;
+	}
+	ret = io_uring_register_buffers(&p->ring, p->iovecs, p->queue_depth);
+	if (ret < 0)
+		TS_WARNING("io_uring_register_buffers: %s, using unregistered buffers", strerror(-ret));
+	p->registered = ret == 0;
+
+	/* Configure packet size */
+	priv->options.packet_size = p->packet_size;
+	priv->options.packet_error_correction_bytes = p->packet_size - 188;
+
+	/* Fill the read-ahead window */
+	clock_gettime(CLOCK_MONOTONIC, &p->start_time);
+	for (i=0; i<p->queue_depth; ++i)
+		uringsrc_fill_buffer(p, i);
+	io_uring_submit(&p->ring);
+
+	priv->parser = p;
+	return 0;
+
+out_error:
+	if (p->fd >= 0)
+		close(p->fd);
+	free(p);
+	return -1;
+}
+
+/**
+ * uringsrc_destroy_parser: backend's destroy() method.
+ */
+int uringsrc_destroy_parser(struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	struct timespec now;
+	double elapsed, megabytes;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - p->start_time.tv_sec) + (now.tv_nsec - p->start_time.tv_nsec) / 1e9;
+	megabytes = p->bytes_read / (1024.0 * 1024.0);
+	fprintf(stderr, "uringsrc: read %.2f MB in %.2f seconds (%.2f MB/s)\n",
+		megabytes, elapsed, elapsed > 0 ? megabytes / elapsed : 0.0);
+	if (p->discarded)
+		fprintf(stderr, "uringsrc: discarded %llu bytes while resynchronizing\n",
+			(unsigned long long) p->discarded);
+
+	/* Tearing down the ring cancels reads which are still in flight */
+	io_uring_queue_exit(&p->ring);
+	for (i=0; i<p->queue_depth; ++i)
+		free(p->buffers[i].data);
+	free(p->buffers);
+	free(p->iovecs);
+	close(p->fd);
+	free(p);
+	return 0;
+}
+
+/**
+ * uringsrc_set_frequency: no-op.
+ */
+int uringsrc_set_frequency(uint32_t frequency, struct demuxfs_data *priv)
+{
+	(void) frequency;
+	(void) priv;
+	return -ENOSYS;
+}
+
+/**
+ * uringsrc_next_buffer: moves on to the next buffer, starting at @pos. The
+ * consumed one is only submitted again on the next call to read_batch().
+ */
+static void uringsrc_next_buffer(struct input_parser *p, size_t pos)
+{
+	p->head = (p->head + 1) % p->queue_depth;
+	p->head_pos = pos;
+	p->recycle++;
+}
+
+/**
+ * uringsrc_read_batch: backend's read_batch() method. Payloads point into the
+ * read-ahead buffers, which are only resubmitted on the next call.
+ * @return the number of packets stored in @packets, a negative errno value on
+ *  error and -ENODATA if there's no more data to be read.
+ */
+int uringsrc_read_batch(struct ts_packet *packets, int count, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	struct uring_buffer *buf, *next;
+	const char *data;
+	ssize_t offset;
+	size_t tail;
+	int ret, n = 0;
+
+	if (p->eof)
+		return -ENODATA;
+
+	/* The caller is done with the packets handed out last time */
+	if (p->recycle) {
+		for (; p->recycle > 0; p->recycle--)
+			uringsrc_fill_buffer(p, (p->head + p->queue_depth - p->recycle) % p->queue_depth);
+		io_uring_submit(&p->ring);
+	}
+
+	while (n < count && p->recycle < p->queue_depth) {
+		buf = &p->buffers[p->head];
+		ret = uringsrc_wait_buffer(p, buf);
+		if (ret < 0)
+			return n ? n : ret;
+		if (buf->length == 0) {
+			p->eof = true;
+			break;
+		}
+		if (p->head_pos >= buf->filled) {
+			uringsrc_next_buffer(p, 0);
+			continue;
+		}
+		data = &buf->data[p->head_pos];
+		if (data[0] != TS_SYNC_BYTE) {
+			/* Lost sync: skip to the next run of aligned packets in this buffer */
+			offset = ts_sync_scan(data, buf->filled - p->head_pos, p->packet_size, TS_RESYNC_PACKETS);
+			if (offset < 0)
+				offset = buf->filled - p->head_pos;
+			TS_WARNING("lost sync, discarded %zd bytes", offset);
+			p->discarded += offset;
+			p->head_pos += offset;
+			continue;
+		}
+		if (p->head_pos + p->packet_size > buf->filled) {
+			/* Once realigned, packets may straddle two buffers */
+			tail = buf->filled - p->head_pos;
+			if (p->queue_depth > 1 && p->recycle + 1 == p->queue_depth)
+				break;
+			next = &p->buffers[(p->head + 1) % p->queue_depth];
+			ret = p->queue_depth > 1 ? uringsrc_wait_buffer(p, next) : -1;
+			if (ret < 0 || next->offset != buf->offset + buf->filled || next->filled < p->packet_size - tail) {
+				p->discarded += tail;
+				uringsrc_next_buffer(p, 0);
+				continue;
+			}
+			/* Put it together in the caller's storage */
+			memcpy(packets[n].data, data, tail);
+			memcpy(&packets[n].data[tail], next->data, p->packet_size - tail);
+			uringsrc_next_buffer(p, p->packet_size - tail);
+			data = packets[n].data;
+		} else {
+			p->head_pos += p->packet_size;
+		}
+		backend_decode_header(&packets[n].header, data);
+		packets[n].payload = &data[4];
+		n++;
+	}
+
+	if (n == 0 && p->eof)
+		return -ENODATA;
+	return n;
+}
+
+/**
+ * uringsrc_read_packet: backend's read() method.
+ * @return 0 on success, a negative errno value on error and -ENODATA if
+ *  there's no more data to be read.
+ */
+int uringsrc_read_packet(struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	int n = uringsrc_read_batch(&p->packet, 1, priv);
+	if (n < 0) {
+		p->packet_valid = false;
+		return n;
+	}
+	p->packet_valid = n == 1;
+	return 0;
+}
+
+/**
+ * uringsrc_process_packet: backend's process() method.
+ */
+int uringsrc_process_packet(struct ts_header *header, void **payload, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+
+	if (! p->packet_valid)
+		return -EINVAL;
+	else if (! header || ! payload)
+		return -EINVAL;
+
+	*header = p->packet.header;
+	*payload = (void *) p->packet.payload;
+	return 0;
+}
+
+/**
+ * uringsrc_keep_alive: backend's keep_alive() method.
+ */
+bool uringsrc_keep_alive(struct demuxfs_data *priv)
+{
+	return ! priv->parser->eof;
+}
+
+struct backend_ops uringsrc_backend_ops = {
+	.create = uringsrc_create_parser,
+	.destroy = uringsrc_destroy_parser,
+	.set_frequency = uringsrc_set_frequency,
+	.read = uringsrc_read_packet,
+	.process = uringsrc_process_packet,
+	.read_batch = uringsrc_read_batch,
+	.keep_alive = uringsrc_keep_alive,
+	.usage = uringsrc_usage,
+};
+
+struct backend_ops *backend_get_ops(void)
+{
+	return &uringsrc_backend_ops;
+}
@@ -0,0 +1,18 @@
+#ifndef __uringsrc_h
+#define __uringsrc_h
+
+#ifdef USE_URINGSRC
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+#endif /* USE_URINGSRC */
+
+#endif /* __uringsrc_h */
@@ -27,12 +27,147 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/mman.h>
+#include <fcntl.h>
 #include "demuxfs.h"
 #include "byteops.h"
 #include "buffer.h"
 #include "ts.h"
 #include "tables/pes.h"
 
+/*
+ * Buffer contents are taken from a pool of power-of-two blocks, from
+ * MAX_SECTION_SIZE (which fits any PSI section) up to BUFFER_POOL_MAX_SIZE.
+ * Blocks go back to the pool when the buffer is reset, so once the pool has
+ * grown to the working set of the stream no further heap allocations happen.
+ * Section blocks are carved out of slabs of BUFFER_POOL_SLAB_BLOCKS blocks.
+ * Freed blocks are kept in per-size lists and only released on exit;
+ * anything bigger than BUFFER_POOL_MAX_SIZE is served by malloc() directly.
+ */
+#define BUFFER_POOL_MIN_SHIFT   12
+#define BUFFER_POOL_MAX_SHIFT   22
+#define BUFFER_POOL_MAX_SIZE    (1 << BUFFER_POOL_MAX_SHIFT)
+#define BUFFER_POOL_CLASSES     (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_SLAB_BLOCKS 16
+
+/* Memory obtained from the heap, either a slab of section blocks or a single PES block */
+struct pool_chunk {
+	struct pool_chunk *next;
+} __attribute__((aligned(16)));
+
+/* A block sitting in one of the free lists */
+struct pool_block {
+	struct pool_block *next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct pool_block *free_blocks[BUFFER_POOL_CLASSES];
+	struct pool_chunk *chunks;
+} buffer_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static int buffer_pool_class(size_t size)
+{
+	int shift = BUFFER_POOL_MIN_SHIFT;
+	while (((size_t) 1 << shift) < size)
+		shift++;
+	return shift - BUFFER_POOL_MIN_SHIFT;
+}
+
+/* Adds a new chunk with @count blocks of @block_size to the free list @class. Called with the mutex held. */
+static int buffer_pool_grow(int class, size_t block_size, int count)
+{
+	struct pool_chunk *chunk = malloc(sizeof(struct pool_chunk) + block_size * count);
+	char *blocks = (char *) (chunk + 1);
+	int i;
+
+	if (! chunk)
+		return -ENOMEM;
+	chunk->next = buffer_pool.chunks;
+	buffer_pool.chunks = chunk;
+	for (i=count-1; i>=0; --i) {
+		struct pool_block *block = (struct pool_block *) &blocks[i * block_size];
+		block->next = buffer_pool.free_blocks[class];
+		buffer_pool.free_blocks[class] = block;
+	}
+	return 0;
+}
+
+/**
+ * buffer_pool_get: takes a block with room for at least @size bytes from the pool.
+ * @block_size: returns the actual size of the block.
+ */
+static char *buffer_pool_get(size_t size, size_t *block_size)
+{
+	struct pool_block *block = NULL;
+	int class;
+
+	if (size > BUFFER_POOL_MAX_SIZE) {
+		*block_size = size;
+		return malloc(size);
+	}
+
+	class = buffer_pool_class(size);
+	*block_size = (size_t) 1 << (class + BUFFER_POOL_MIN_SHIFT);
+
+	pthread_mutex_lock(&buffer_pool.mutex);
+	if (buffer_pool.free_blocks[class] ||
+		buffer_pool_grow(class, *block_size, class ? 1 : BUFFER_POOL_SLAB_BLOCKS) == 0) {
+		block = buffer_pool.free_blocks[class];
+		buffer_pool.free_blocks[class] = block->next;
+	}
+	pthread_mutex_unlock(&buffer_pool.mutex);
+	return (char *) block;
+}
+
+/**
+ * buffer_pool_put: returns a block obtained with buffer_pool_get() to the pool.
+ */
+static void buffer_pool_put(char *data, size_t block_size)
+{
+	struct pool_block *block = (struct pool_block *) data;
+	int class;
+
+	if (block_size > BUFFER_POOL_MAX_SIZE) {
+		free(data);
+		return;
+	}
+
+	class = buffer_pool_class(block_size);
+	pthread_mutex_lock(&buffer_pool.mutex);
+	block->next = buffer_pool.free_blocks[class];
+	buffer_pool.free_blocks[class] = block;
+	pthread_mutex_unlock(&buffer_pool.mutex);
+}
+
+/**
+ * buffer_pool_destroy: releases the memory held by the pool. Must only be
+ * called once all buffers have been destroyed.
+ */
+void buffer_pool_destroy(void)
+{
+	struct pool_chunk *chunk, *next;
+
+	pthread_mutex_lock(&buffer_pool.mutex);
+	for (chunk=buffer_pool.chunks; chunk; chunk=next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	buffer_pool.chunks = NULL;
+	memset(buffer_pool.free_blocks, 0, sizeof(buffer_pool.free_blocks));
+	pthread_mutex_unlock(&buffer_pool.mutex);
+}
+
+/* Returns the contents of @buffer to the pool */
+static void buffer_release_data(struct buffer *buffer)
+{
+	if (buffer->data) {
+		buffer_pool_put(buffer->data, buffer->max_size);
+		buffer->data = NULL;
+		buffer->max_size = 0;
+	}
+}
+
 struct buffer *buffer_create(uint16_t pid, size_t size, bool pes_data)
 {
 	struct buffer *buffer;
@@ -53,17 +188,10 @@ struct buffer *buffer_create(uint16_t pid, size_t size, bool pes_data)
 		buffer->pes_unbounded_data = true;
 	}
 
-	buffer->data = (char *) calloc(size, sizeof(char));
-	if (! buffer->data) {
-		perror("malloc");
-		free(buffer);
-		return NULL;
-	}
-
+	/* The contents are taken from the pool on the first append */
 	buffer->pid = pid;
-	buffer->max_size = size;
+	buffer->size_hint = size;
 	buffer->current_size = 0;
-	buffer->continuity_counter = 0;
 	buffer->holds_pes_data = pes_data;
 	return buffer;
 }
@@ -71,9 +199,7 @@ struct buffer *buffer_create(uint16_t pid, size_t size, bool pes_data)
 void buffer_destroy(struct buffer *buffer)
 {
 	if (buffer) {
-		if (buffer->data)
-			free(buffer->data);
-		buffer->data = NULL;
+		buffer_release_data(buffer);
 		free(buffer);
 	}
 }
@@ -102,34 +228,28 @@ int buffer_append(struct buffer *buffer, const char *buf, size_t size)
 	if (! size)
 		return buffer->current_size;
 
-	if (buffer->current_size == 0) {
-		if (size > buffer->max_size) {
-			/* Reusing the slot */
-			free(buffer->data);
-			buffer->data = (char *) malloc(sizeof(char) * size);
-			if (! buffer->data) {
-				buffer->max_size = 0;
-				free(buffer->data);
-				return -ENOMEM;
-			}
-			buffer->max_size = size;
+	to_write = size;
+	if ((buffer->current_size + size > MAX_SECTION_SIZE) && ! buffer->holds_pes_data)
+		to_write = MAX_SECTION_SIZE - buffer->current_size;
+
+	if (! buffer->data) {
+		size_t want = to_write > buffer->size_hint ? to_write : buffer->size_hint;
+		buffer->data = buffer_pool_get(want, &buffer->max_size);
+		if (! buffer->data) {
+			buffer->max_size = 0;
+			return -ENOMEM;
 		}
-		to_write = size;
-	} else {
-		to_write = size;
-		if ((buffer->current_size + size > MAX_SECTION_SIZE) && ! buffer->holds_pes_data)
-			to_write = MAX_SECTION_SIZE - buffer->current_size;
-		if (buffer->current_size + to_write > buffer->max_size) {
-			int required_room = buffer->current_size + to_write;
-			int new_size = required_room > MAX_SECTION_SIZE ? required_room : MAX_SECTION_SIZE;
-			char *ptr = (char *) realloc(buffer->data, new_size);
-			if (! ptr) {
-				dprintf("Error reallocating memory");
-				return -ENOMEM;
-			}
-			buffer->data = ptr;
-			buffer->max_size = new_size;
+	} else if (buffer->current_size + to_write > buffer->max_size) {
+		size_t new_size;
+		char *ptr = buffer_pool_get(buffer->current_size + to_write, &new_size);
+		if (! ptr) {
+			dprintf("Error reallocating memory");
+			return -ENOMEM;
 		}
+		memcpy(ptr, buffer->data, buffer->current_size);
+		buffer_pool_put(buffer->data, buffer->max_size);
+		buffer->data = ptr;
+		buffer->max_size = new_size;
 	}
 
 	memcpy(&buffer->data[buffer->current_size], buf, to_write);
@@ -202,8 +322,13 @@ bool buffer_is_unbounded(struct buffer *buffer)
 
 void buffer_reset_size(struct buffer *buffer)
 {
-	if (buffer)
+	if (buffer) {
+		/* Ask for a block that fits the whole PES packet next time, instead of growing it again */
+		if (buffer->holds_pes_data && buffer->current_size > buffer->size_hint)
+			buffer->size_hint = buffer->current_size;
 		buffer->current_size = 0;
+		buffer_release_data(buffer);
+	}
 }
 
 unsigned long buffer_crc32(struct buffer *buffer)
@@ -218,3 +343,99 @@ unsigned long buffer_crc32(struct buffer *buffer)
 	i = buffer->current_size - 4;
 	return CONVERT_TO_32(data[i], data[i+1], data[i+2], data[i+3]);
 }
+
+/*
+ * Shared buffers hold whole carousel modules, which can add up to hundreds of MB.
+ * Once the heap taken by them goes over the budget, new buffers are backed by files
+ * under the spill directory instead, so that the kernel can write them back and drop
+ * their pages when memory runs low. The files are unlinked right away. Their blocks
+ * are reserved up front: touching a hole in a shared mapping on a full filesystem
+ * raises SIGBUS, so a buffer that cannot get its blocks stays in the heap.
+ */
+static struct {
+	size_t budget;
+	const char *dir;
+	size_t heap_size;
+} shared_buffer_spill = { .budget = SIZE_MAX };
+
+/**
+ * shared_buffer_set_spill: keeps buffers in the heap while they take up to @budget
+ * bytes, and maps files under @dir beyond that. @dir must outlive all buffers.
+ */
+void shared_buffer_set_spill(size_t budget, const char *dir)
+{
+	shared_buffer_spill.budget = budget;
+	shared_buffer_spill.dir = dir;
+}
+
+/* Maps a zero-filled file of @size bytes under the spill directory */
+static char *shared_buffer_map(size_t size)
+{
+	char path[PATH_MAX];
+	char *data;
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/demuxfs-XXXXXX", shared_buffer_spill.dir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		TS_WARNING("cannot create %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	unlink(path);
+	ret = posix_fallocate(fd, 0, size);
+	if (ret != 0) {
+		TS_WARNING("cannot allocate %zu bytes in %s: %s", size, path, strerror(ret));
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? NULL : data;
+}
+
+/**
+ * shared_buffer_new: allocates a zero-filled buffer of @size bytes holding one reference.
+ */
+struct shared_buffer *shared_buffer_new(size_t size)
+{
+	struct shared_buffer *shared = (struct shared_buffer *) calloc(1, sizeof(struct shared_buffer));
+	if (! shared)
+		return NULL;
+	if (size >= SHARED_BUFFER_MIN_SPILL_SIZE && shared_buffer_spill.dir &&
+		__atomic_load_n(&shared_buffer_spill.heap_size, __ATOMIC_RELAXED) + size > shared_buffer_spill.budget) {
+		shared->data = shared_buffer_map(size);
+		shared->mapped = shared->data != NULL;
+	}
+	if (! shared->data) {
+		shared->data = calloc(size ? size : 1, sizeof(char));
+		if (! shared->data) {
+			free(shared);
+			return NULL;
+		}
+		__atomic_add_fetch(&shared_buffer_spill.heap_size, size, __ATOMIC_RELAXED);
+	}
+	shared->size = size;
+	shared->capacity = size;
+	shared->refcount = 1;
+	return shared;
+}
+
+struct shared_buffer *shared_buffer_get(struct shared_buffer *shared)
+{
+	__atomic_add_fetch(&shared->refcount, 1, __ATOMIC_RELAXED);
+	return shared;
+}
+
+void shared_buffer_put(struct shared_buffer *shared)
+{
+	if (shared && __atomic_sub_fetch(&shared->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		shared_buffer_put(shared->decoded);
+		if (shared->mapped)
+			munmap(shared->data, shared->capacity);
+		else {
+			__atomic_sub_fetch(&shared_buffer_spill.heap_size, shared->capacity, __ATOMIC_RELAXED);
+			free(shared->data);
+		}
+		free(shared);
+	}
+}
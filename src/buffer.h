@@ -8,12 +8,33 @@ struct buffer {
 	char *data;
 	uint16_t pid;
 	size_t max_size;
+	size_t size_hint;
 	size_t current_size;
-	uint8_t continuity_counter;
 	bool holds_pes_data;
 	bool pes_unbounded_data;
 };
 
+/**
+ * Reference counted buffer, which lets several dentries expose the same data
+ * without copying it. Holders which outlive the caller take their own reference.
+ * @decoded: decompressed copy of @data, kept for as long as @data lives
+ * @decode_failed: @data could not be decompressed, so it's not worth trying again
+ * @capacity: bytes allocated for @data, as @size may be shrunk after the buffer is filled
+ * @mapped: @data maps an unlinked file under the spill directory rather than the heap
+ */
+struct shared_buffer {
+	uint32_t refcount;
+	size_t size;
+	size_t capacity;
+	char *data;
+	struct shared_buffer *decoded;
+	bool decode_failed;
+	bool mapped;
+};
+
+/* Buffers smaller than this are always taken from the heap */
+#define SHARED_BUFFER_MIN_SPILL_SIZE (64 * 1024)
+
 struct buffer *buffer_create(uint16_t pid, size_t max_size, bool pes_data);
 void buffer_destroy(struct buffer *buffer);
 int  buffer_append(struct buffer *buffer, const char *buf, size_t size);
@@ -24,5 +45,11 @@ bool buffer_is_unbounded(struct buffer *buffer);
 bool buffer_contains_full_psi_section(struct buffer *buffer);
 bool buffer_contains_full_pes_section(struct buffer *buffer);
 unsigned long buffer_crc32(struct buffer *buffer);
+void buffer_pool_destroy(void);
+
+void shared_buffer_set_spill(size_t budget, const char *dir);
+struct shared_buffer *shared_buffer_new(size_t size);
+struct shared_buffer *shared_buffer_get(struct shared_buffer *shared);
+void shared_buffer_put(struct shared_buffer *shared);
 
 #endif /* __buffer_h */
@@ -28,47 +28,146 @@
  */
 #include "demuxfs.h"
 #include "buffer.h"
+#include "ts.h"
 #include "crc32.h"
+#include "crc32_tables.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_USE_PCLMUL
+#endif
 
-#define WIDTH 32
-#define TOPBIT (1<<(WIDTH-1))
-#define POLYNOMIAL 0x04C11DB7
 #define INITIAL_REMAINDER 0xFFFFFFFF
 
-#define TABLE_SIZE 256
-static uint32_t crc32_table[TABLE_SIZE];
+/* Sections which fit in a single TS packet skip the dispatch altogether */
+#define CRC32_SMALL_BUFFER 184
+
+#define LOAD_BE32(p) \
+	(((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
 
-static void crc32_init_table()
+/**
+ * crc32_update_slice8: updates @remainder with @len bytes from @buf, eight
+ * bytes at a time.
+ */
+static inline uint32_t crc32_update_slice8(uint32_t remainder, const uint8_t *buf, size_t len)
 {
-	uint16_t dividend;
-	uint32_t remainder;
-
-	for (dividend=0; dividend<TABLE_SIZE; ++dividend) {
-		remainder = dividend << (WIDTH - 8);
-		for (uint8_t bit=8; bit>0; --bit) {
-			if (remainder & TOPBIT)
-				remainder = (remainder << 1) ^ POLYNOMIAL;
-			else
-				remainder = (remainder << 1);
-		}
-		crc32_table[dividend] = remainder;
+	uint32_t a, b;
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		a = remainder ^ LOAD_BE32(buf);
+		b = LOAD_BE32(buf + 4);
+		remainder =
+			crc32_tables[7][a >> 24] ^ crc32_tables[6][(a >> 16) & 0xff] ^
+			crc32_tables[5][(a >> 8) & 0xff] ^ crc32_tables[4][a & 0xff] ^
+			crc32_tables[3][b >> 24] ^ crc32_tables[2][(b >> 16) & 0xff] ^
+			crc32_tables[1][(b >> 8) & 0xff] ^ crc32_tables[0][b & 0xff];
 	}
+	for (; len; --len, ++buf)
+		remainder = crc32_tables[0][*buf ^ (remainder >> 24)] ^ (remainder << 8);
+	return remainder;
 }
 
-bool crc32_check(const char *buf, uint32_t len)
+#ifdef CRC32_USE_PCLMUL
+/**
+ * crc32_update_pclmul: folds @buf 16 bytes at a time with carry-less
+ * multiplications. The 128-bit residue and the trailing bytes are then run
+ * through the lookup tables. Requires @len >= 32.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_update_pclmul(uint32_t remainder, const uint8_t *buf, size_t len)
+{
+	/* Loads are byte-swapped so that bit 127 holds the first bit of the message */
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i fold = _mm_set_epi64x(CRC32_FOLD_X128, CRC32_FOLD_X192);
+	uint8_t residue[16];
+	__m128i acc;
+
+	/* The running remainder goes into the first 32 bits of the message */
+	acc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) buf), bswap);
+	acc = _mm_xor_si128(acc, _mm_set_epi32(remainder, 0, 0, 0));
+	buf += 16;
+	len -= 16;
+
+	/* acc * x^128 + next == acc_hi * (x^192 mod P) + acc_lo * (x^128 mod P) + next */
+	for (; len >= 16; len -= 16, buf += 16) {
+		__m128i next = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) buf), bswap);
+		acc = _mm_xor_si128(
+			_mm_xor_si128(_mm_clmulepi64_si128(acc, fold, 0x01), _mm_clmulepi64_si128(acc, fold, 0x10)),
+			next);
+	}
+
+	_mm_storeu_si128((__m128i *) residue, _mm_shuffle_epi8(acc, bswap));
+	remainder = crc32_update_slice8(0, residue, sizeof(residue));
+	return crc32_update_slice8(remainder, buf, len);
+}
+#endif /* CRC32_USE_PCLMUL */
+
+static uint32_t (*crc32_update_large)(uint32_t, const uint8_t *, size_t) = crc32_update_slice8;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/**
+ * crc32_update_bitwise: reference implementation, one bit at a time.
+ */
+static uint32_t crc32_update_bitwise(uint32_t remainder, const uint8_t *buf, size_t len)
 {
-	uint32_t i, remainder = INITIAL_REMAINDER;
-	static bool table_initialized = false;
+	int bit;
 
-	if (! table_initialized) {
-		crc32_init_table();
-		table_initialized = true;
+	for (; len; --len, ++buf) {
+		remainder ^= (uint32_t) *buf << 24;
+		for (bit=0; bit<8; ++bit)
+			remainder = (remainder << 1) ^ ((remainder & 0x80000000) ? 0x04C11DB7 : 0);
 	}
+	return remainder;
+}
+
+/**
+ * crc32_self_check: compares @update against the bitwise reference on buffers
+ * of every length up to two TS packets.
+ */
+static bool crc32_self_check(uint32_t (*update)(uint32_t, const uint8_t *, size_t), size_t min_len)
+{
+	uint8_t buf[2 * 188];
+	size_t i;
 
-	for (i=0; i<len; ++i) {
-		uint8_t table_idx = buf[i] ^ (remainder >> (WIDTH - 8));
-		remainder = crc32_table[table_idx] ^ (remainder << 8);
+	for (i=0; i<sizeof(buf); ++i)
+		buf[i] = (i * 131 + 17) ^ (i >> 3);
+	for (i=min_len; i<=sizeof(buf); ++i)
+		if (update(INITIAL_REMAINDER, buf, i) != crc32_update_bitwise(INITIAL_REMAINDER, buf, i))
+			return false;
+	return true;
+}
+
+static void crc32_select_implementation(void)
+{
+	if (! crc32_self_check(crc32_update_slice8, 0))
+		TS_WARNING("CRC32 lookup tables disagree with the reference, please regenerate crc32_tables.h");
+#ifdef CRC32_USE_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+		if (crc32_self_check(crc32_update_pclmul, 32))
+			crc32_update_large = crc32_update_pclmul;
+		else
+			TS_WARNING("PCLMUL CRC32 disagrees with the reference, not using it");
 	}
+#endif
+}
 
-	return remainder ? false : true;
+/**
+ * crc32_compute: returns the CRC-32/MPEG-2 of @len bytes from @buf.
+ */
+uint32_t crc32_compute(const char *buf, size_t len)
+{
+	if (len <= CRC32_SMALL_BUFFER)
+		return crc32_update_slice8(INITIAL_REMAINDER, (const uint8_t *) buf, len);
+	pthread_once(&crc32_once, crc32_select_implementation);
+	return crc32_update_large(INITIAL_REMAINDER, (const uint8_t *) buf, len);
+}
+
+/**
+ * crc32_check: verifies the CRC-32/MPEG-2 which terminates a section.
+ * @return true if @buf, CRC included, leaves no remainder.
+ */
+bool crc32_check(const char *buf, uint32_t len)
+{
+	return crc32_compute(buf, len) ? false : true;
 }
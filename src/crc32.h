@@ -2,5 +2,6 @@
 #define _crc32_h
 
 bool crc32_check(const char *buf, uint32_t len);
+uint32_t crc32_compute(const char *buf, size_t len);
 
 #endif /* _crc32_h */
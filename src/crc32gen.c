@@ -0,0 +1,76 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Generates crc32_tables.h at build time: the slice-by-8 lookup tables and
+ * the folding constants used by crc32.c for CRC-32/MPEG-2.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#define POLYNOMIAL 0x04C11DB7
+
+/* Returns x^n mod P(x) */
+static uint32_t xpow_mod(unsigned int n)
+{
+	uint32_t remainder = 1;
+	while (n--)
+		remainder = (remainder << 1) ^ ((remainder & 0x80000000) ? POLYNOMIAL : 0);
+	return remainder;
+}
+
+int main()
+{
+	static uint32_t table[8][256];
+	int i, j, bit;
+
+	for (i=0; i<256; ++i) {
+		uint32_t remainder = (uint32_t) i << 24;
+		for (bit=0; bit<8; ++bit)
+			remainder = (remainder << 1) ^ ((remainder & 0x80000000) ? POLYNOMIAL : 0);
+		table[0][i] = remainder;
+	}
+	for (j=1; j<8; ++j)
+		for (i=0; i<256; ++i)
+			table[j][i] = (table[j-1][i] << 8) ^ table[0][table[j-1][i] >> 24];
+
+	printf("/* Generated by crc32gen, do not edit */\n");
+	printf("#ifndef __crc32_tables_h\n#define __crc32_tables_h\n\n");
+	printf("/* Folding constants: x^128 mod P(x) and x^192 mod P(x) */\n");
+	printf("#define CRC32_FOLD_X128 0x%08x\n", xpow_mod(128));
+	printf("#define CRC32_FOLD_X192 0x%08x\n\n", xpow_mod(192));
+	printf("static const uint32_t crc32_tables[8][256] = {\n");
+	for (j=0; j<8; ++j) {
+		printf("\t{");
+		for (i=0; i<256; ++i)
+			printf("%s0x%08x,", (i % 6) ? " " : "\n\t\t", table[j][i]);
+		printf("\n\t},\n");
+	}
+	printf("};\n\n#endif /* __crc32_tables_h */\n");
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include "fifo.h"
 #include "ts.h"
 #include "snapshot.h"
+#include "tables/epg.h"
 #include "tables/descriptors/descriptors.h"
 #include "dsm-cc/descriptors/descriptors.h"
 
@@ -101,11 +102,18 @@ static int demuxfs_flush(const char *path, struct fuse_file_info *fi)
 static int demuxfs_release(const char *path, struct fuse_file_info *fi)
 {
 	struct dentry *dentry = FILEHANDLE_TO_DENTRY(fi->fh);
+	bool dispose;
 	pthread_mutex_lock(&dentry->mutex);
 	dentry->refcount--;
 	if (DEMUXFS_IS_SNAPSHOT(dentry))
 		snapshot_destroy_video_context(dentry);
+	else if (DEMUXFS_IS_EPG(dentry) && dentry->refcount == 0)
+		epg_release(dentry);
+	dispose = dentry->retired && dentry->refcount == 0;
 	pthread_mutex_unlock(&dentry->mutex);
+	/* A parser has unlinked it while it was open */
+	if (dispose)
+		fsutils_dispose_node(dentry);
 	return 0;
 }
 
@@ -138,6 +146,19 @@ static int demuxfs_read(const char *path, char *buf, size_t size, off_t offset,
 			memcpy(buf, &dentry->contents[offset], read_size);
 		}
 		pthread_mutex_unlock(&dentry->mutex);
+	} else if (DEMUXFS_IS_EPG(dentry)) {
+		pthread_mutex_lock(&dentry->mutex);
+		/* Answered once per open, from the event index of the service */
+		if (! dentry->contents)
+			ret = epg_render(dentry);
+		if (ret == 0 && (ssize_t) offset < dentry->size) {
+			read_size = ((dentry->size - (ssize_t) offset) > (ssize_t) size)
+				? size : dentry->size - (ssize_t) offset;
+			memcpy(buf, &dentry->contents[offset], read_size);
+		}
+		pthread_mutex_unlock(&dentry->mutex);
+		if (ret < 0)
+			return ret;
 	} else if (dentry->contents && dentry->size != 0xffffff) {
 		pthread_mutex_lock(&dentry->mutex);
 		if (offset < dentry->size) {
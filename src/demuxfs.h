@@ -60,6 +60,8 @@ enum {
 	OBJ_TYPE_AUDIO_FIFO  = (1 << 4) | OBJ_TYPE_FIFO,
 	OBJ_TYPE_VIDEO_FIFO  = (1 << 5) | OBJ_TYPE_FIFO,
 	OBJ_TYPE_SNAPSHOT    = (1 << 6),
+	OBJ_TYPE_SLICE       = (1 << 7),
+	OBJ_TYPE_EPG         = (1 << 8),
 };
 
 #define DEMUXFS_IS_FILE(d)       (d->obj_type == OBJ_TYPE_FILE)
@@ -68,6 +70,8 @@ enum {
 #define DEMUXFS_IS_AUDIO_FIFO(d) (d->obj_type == OBJ_TYPE_AUDIO_FIFO)
 #define DEMUXFS_IS_VIDEO_FIFO(d) (d->obj_type == OBJ_TYPE_VIDEO_FIFO)
 #define DEMUXFS_IS_SNAPSHOT(d)   (d->obj_type == OBJ_TYPE_SNAPSHOT)
+#define DEMUXFS_IS_SLICE(d)      (d->obj_type == OBJ_TYPE_SLICE)
+#define DEMUXFS_IS_EPG(d)        (d->obj_type == OBJ_TYPE_EPG)
 
 struct dentry {
 	/* The inode number, generated from the transport stream PID and the table_id */
@@ -84,6 +88,8 @@ struct dentry {
 	int obj_type;
 	/* Reference count */
 	uint32_t refcount;
+	/* Unlinked from the tree while open, to be disposed of by the last release */
+	bool retired;
 	/* File contents */
 	char *contents;
 	ssize_t size;
@@ -128,9 +134,18 @@ enum error_type {
 	ALL_ERRORS       = 0xff,
 };
 
+/* What the ingest thread does when the parser falls behind and the packet ring is full */
+enum ring_policy {
+	RING_POLICY_BLOCK    = 0, /* Wait for the parser to free a slot */
+	RING_POLICY_DROP_PES = 1, /* Keep reading, but only hold on to the packets of PSI PIDs */
+};
+
 struct descriptor;
 struct dsmcc_descriptor;
 struct backend_ops;
+struct pid_context;
+struct ts_ring;
+struct psi_worker;
 
 struct user_options {
 	bool parse_pes;
@@ -140,6 +155,11 @@ struct user_options {
 	uint32_t frequency;
 	char *tmpdir;
 	enum error_type verbose_mask;
+	uint32_t ring_size;
+	enum ring_policy ring_policy;
+	int pes_threads;
+	int psi_threads;
+	int carousel_memory;
 };
 
 struct demuxfs_data {
@@ -149,16 +169,17 @@ struct demuxfs_data {
 	char *opt_tmpdir;
 	char *opt_backend;
 	char *opt_report;
+	int opt_ring_size;
+	char *opt_ring_policy;
+	int opt_pes_threads;
+	int opt_psi_threads;
+	int opt_carousel_memory;
 	/* "psi_tables" holds PSI structures (ie: PAT, PMT, NIT..) */
 	struct hash_table *psi_tables;
-	/* "pes_tables" holds structures from PES packets that we're parsing */
-	struct hash_table *pes_tables;
-	/* "psi_parsers" holds pointers to parsers of known PSI PIDs */
-	struct hash_table *psi_parsers;
-	/* "pes_parsers" holds pointers to parsers of known PES PIDs */
-	struct hash_table *pes_parsers;
-	/* "packet_buffer" holds incomplete TS packets, which cannot be parsed yet */
-	struct hash_table *packet_buffer;
+	/* "psi_section_sets" holds the sections of the sub-tables being assembled by psi_assemble() */
+	struct hash_table *psi_section_sets;
+	/* "pid_contexts" holds the parsers, incomplete packets and FIFO dentries of each PID */
+	struct pid_context *pid_contexts;
 	/* "ts_descriptors" holds descriptor tags and the tables that they're allowed to be in */
 	struct descriptor *ts_descriptors;
 	/* "dsmcc_descriptors" holds DSM-CC descriptor tags and their parsers */
@@ -167,16 +188,26 @@ struct demuxfs_data {
 	struct dentry *root;
 	/* Backend specific data */
 	struct input_parser *parser;
-	/* General data shared amongst table parsers and descriptor parsers */
-	void *shared_data;
 	/* DemuxFS mount point */
 	char *mount_point;
 	/* TS parser thread handle */
 	pthread_t ts_parser_id;
+	/* TS ingest thread handle, which reads from the backend on behalf of the parser thread */
+	pthread_t ts_ingest_id;
+	/* Batches of packets read by the ingest thread and not yet parsed */
+	struct ts_ring *ring;
+	/* Threads which parse PSI sections, each one serving a fixed subset of the PIDs */
+	struct psi_worker *psi_workers;
+	int psi_worker_count;
+	/* Serializes the table and PES parsers, which share the dentry tree and "psi_tables" */
+	pthread_mutex_t parser_mutex;
 	/* User-defined options */
 	struct user_options options;
 	/* Backend implementation */
 	struct backend_ops *backend;
+	/* Statistics: sections looked up in and dropped by the repeated section cache */
+	uint64_t section_cache_lookups;
+	uint64_t section_cache_hits;
 };
 
 #endif /* __demuxfs_h */
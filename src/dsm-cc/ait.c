@@ -627,11 +627,15 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 }
 
 static void ait_create_directory(const struct ts_header *header, struct ait_table *ait,
-		struct dentry **version_dentry, struct demuxfs_data *priv)
+		struct ait_table *current_ait, struct dentry **version_dentry, struct demuxfs_data *priv)
 {
 	struct dentry *dentry = fsutils_get_child(priv->root, "AIT");
 
-	if (dentry) {
+	if (dentry && current_ait && current_ait->dentry == dentry) {
+		/* Take the directory over from the version this one replaces */
+		free(ait->dentry);
+		ait->dentry = dentry;
+	} else if (dentry) {
 		INITIALIZE_DENTRY_UNLINKED(ait->dentry);
 	} else {
 		/* Create a new directory named "AIT" in the root filesystem */
@@ -647,7 +651,7 @@ static void ait_create_directory(const struct ts_header *header, struct ait_tabl
 	psi_populate((void **) &ait, *version_dentry);
 }
 
-int ait_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+static int ait_parse_sections(const struct ts_header *header, const struct psi_section_set *set,
 		struct demuxfs_data *priv)
 {
 	struct ait_table *current_ait = NULL;
@@ -658,7 +662,7 @@ int ait_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	assert(ait->dentry);
 
 	/* Copy data up to the first loop entry */
-	int ret = psi_parse((struct psi_common_header *) ait, payload, payload_len);
+	int ret = psi_parse((struct psi_common_header *) ait, set->payload[0], set->payload_len[0]);
 	if (ret < 0) {
 		ait_free(ait);
 		return ret;
@@ -674,59 +678,71 @@ int ait_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		return 0;
 	}
 
-	TS_INFO("AIT parser: pid=%#x, table_id=%#x, current_ait=%p, ait->version_number=%#x, len=%d", 
-			header->pid, ait->table_id, current_ait, ait->version_number, payload_len);
+	/* Check the loops of all sections and count the applications they announce */
+	uint16_t s;
+	uint32_t i, n, end;
+	for (s=0; s<set->count; ++s) {
+		const char *payload = set->payload[s];
+		uint32_t payload_len = set->payload_len[s];
+		uint16_t common_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
+
+		i = 10 + common_descriptors_length;
+		if (i + 2 > payload_len - 4) {
+			TS_WARNING("common_descriptors_length is too big (%d)", common_descriptors_length);
+			ait_free(ait);
+			return -EINVAL;
+		}
+		end = i + 2 + (CONVERT_TO_16(payload[i], payload[i+1]) & 0x0fff);
+		if (end > payload_len - 4) {
+			TS_WARNING("bogus application loop length (%d)", end - i - 2);
+			ait_free(ait);
+			return -EINVAL;
+		}
+		for (i+=2; i+9 <= end; ait->_ait_data_entries++) {
+			// skip application_identifier() + application_control_code
+			i += 9 + (CONVERT_TO_16(payload[i+7], payload[i+8]) & 0x0fff);
+		}
+		if (i != end) {
+			TS_WARNING("going out of bounds after computing application loop length");
+			ait_free(ait);
+			return -EINVAL;
+		}
+	}
+
+	TS_INFO("AIT parser: pid=%#x, table_id=%#x, current_ait=%p, ait->version_number=%#x, sections=%d", 
+			header->pid, ait->table_id, current_ait, ait->version_number, set->count);
 
 	/* Parse AIT specific bits */
 	struct dentry *version_dentry = NULL;
-	ait_create_directory(header, ait, &version_dentry, priv);
+	ait_create_directory(header, ait, current_ait, &version_dentry, priv);
 
-	ait->reserved_4 = payload[8] >> 4;
-	ait->common_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
+	ait->reserved_4 = set->payload[0][8] >> 4;
+	ait->common_descriptors_length = CONVERT_TO_16(set->payload[0][8], set->payload[0][9]) & 0x0fff;
 	CREATE_FILE_NUMBER(version_dentry, ait, common_descriptors_length);
-
-	if (ait->common_descriptors_length > payload_len - 8) {
-		TS_WARNING("common_descriptors_length is too big (%d)", ait->common_descriptors_length);
-		return 0;
-	}
-
-	uint16_t i;
-	uint32_t len = 0;
-	for (i=10; i<10+ait->common_descriptors_length; i+=len)
-		len = dsmcc_descriptors_parse(&payload[i], 1, version_dentry, priv);
-	if (i > payload_len) {
-		TS_WARNING("going out of bounds after processing descriptors");
-		return 0;
-	}
-
-	ait->reserved_5 = payload[i] >> 4;
-	ait->application_loop_length = CONVERT_TO_16(payload[i], payload[i+1]) & 0x0fff;
-	if (ait->application_loop_length > payload_len) {
-		TS_WARNING("bogus application loop length (%d)", ait->application_loop_length);
-		return 0;
-	}
+	i = 10 + ait->common_descriptors_length;
+	ait->reserved_5 = set->payload[0][i] >> 4;
+	ait->application_loop_length = CONVERT_TO_16(set->payload[0][i], set->payload[0][i+1]) & 0x0fff;
 	CREATE_FILE_NUMBER(version_dentry, ait, application_loop_length);
-	i += 2;
-
-	/* Count how many entries are in the application loop */
-	uint16_t n = i;
-	while (n < ait->application_loop_length) {
-		uint16_t application_descriptors_loop_len;
-		n += 7; // skip application_identifier() + application_control_code
-		application_descriptors_loop_len = CONVERT_TO_16(payload[n], payload[n+1]) & 0x0fff;
-		n += 2 + application_descriptors_loop_len;
-		ait->_ait_data_entries++;
-	}
-	if (n > payload_len) {
-		TS_WARNING("going out of bounds after computing application loop length");
-		return 0;
-	}
 
 	/* Allocate and parse application entries */
-	if (ait->_ait_data_entries) {
-		uint16_t ait_index = 0;
+	uint16_t ait_index = 0;
+	if (ait->_ait_data_entries)
 		ait->ait_data = calloc(ait->_ait_data_entries, sizeof(struct ait_data));
-		while (i < ait->application_loop_length) {
+
+	for (s=0; s<set->count; ++s) {
+		const char *payload = set->payload[s];
+		uint16_t common_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
+		uint32_t len = 0;
+
+		for (i=10; i<10+common_descriptors_length; i+=len)
+			len = dsmcc_descriptors_parse(&payload[i], 1, version_dentry, priv);
+		if (i > 10 + common_descriptors_length) {
+			TS_WARNING("going out of bounds after processing descriptors");
+			continue;
+		}
+
+		end = i + 2 + (CONVERT_TO_16(payload[i], payload[i+1]) & 0x0fff);
+		for (i+=2; i<end; ) {
 			struct dentry *app_dentry;
 			struct ait_data *data = &ait->ait_data[ait_index++];
 
@@ -753,19 +769,19 @@ int ait_parse(const struct ts_header *header, const char *payload, uint32_t payl
 				ait_parse_descriptor(descriptor_tag, descriptor_len, &payload[i+n], app_dentry, priv);
 				n += 2 + descriptor_len;
 			}
-			if (n > data->application_descriptors_loop_length) {
+			if (n > data->application_descriptors_loop_length)
 				TS_WARNING("bogus descriptor length found");
-				return 0;
-			}
-			i += n;
+			i += data->application_descriptors_loop_length;
 		}
 	}
 
-	if (current_ait) {
-		fsutils_migrate_children(current_ait->dentry, ait->dentry);
-		hashtable_del(priv->psi_tables, current_ait->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, ait->dentry->inode, ait, (hashtable_free_function_t) ait_free);
+	psi_replace_table(current_ait, ait, (hashtable_free_function_t) ait_free, priv);
 
 	return 0;
 }
+
+int ait_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return psi_assemble(header, payload, payload_len, ait_parse_sections, priv);
+}
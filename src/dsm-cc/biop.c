@@ -30,10 +30,18 @@
 #include "byteops.h"
 #include "fsutils.h"
 #include "xattr.h"
+#include "hash.h"
+#include "buffer.h"
 #include "biop.h"
 #include "iop.h"
 #include "ts.h"
 #include "debug.h"
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* Initial size of the table of entries waiting for their directory object */
+#define BIOP_ORPHANS_HASH_SIZE 127
 
 static ino_t biop_get_sub_header_inode(struct biop_message_sub_header *sub_header)
 {
@@ -525,6 +533,34 @@ void biop_free_module_info(struct biop_module_info *modinfo)
 		free(modinfo->taps);
 	if (modinfo->user_info)
 		free(modinfo->user_info);
+	if (modinfo->compressed_module)
+		free(modinfo->compressed_module);
+}
+
+static void biop_parse_module_user_info(struct biop_module_info *modinfo)
+{
+	const char *buf = modinfo->user_info;
+	uint8_t len = modinfo->user_info_length;
+	int j = 0;
+
+	while (j+2 <= len) {
+		uint8_t descriptor_tag = buf[j];
+		uint8_t descriptor_length = buf[j+1];
+		if (j+2+descriptor_length > len)
+			break;
+		if (descriptor_tag == BIOP_COMPRESSED_MODULE_DESCRIPTOR && descriptor_length >= 5 &&
+				! modinfo->compressed_module) {
+			struct biop_compressed_module *cm = calloc(1, sizeof(struct biop_compressed_module));
+			cm->compression_method = buf[j+2];
+			cm->original_size = CONVERT_TO_32(buf[j+3], buf[j+4], buf[j+5], buf[j+6]);
+			modinfo->compressed_module = cm;
+		} else if (descriptor_tag == BIOP_CRC32_DESCRIPTOR && descriptor_length >= 4 &&
+				! modinfo->has_crc_32) {
+			modinfo->crc_32 = CONVERT_TO_32(buf[j+2], buf[j+3], buf[j+4], buf[j+5]);
+			modinfo->has_crc_32 = true;
+		}
+		j += 2 + descriptor_length;
+	}
 }
 
 /* Returns how many bytes were parsed */
@@ -554,6 +590,7 @@ int biop_parse_module_info(struct biop_module_info *modinfo, const char *buf, ui
 	if (modinfo->user_info_length) {
 		modinfo->user_info = calloc(modinfo->user_info_length, sizeof(char));
 		memcpy(modinfo->user_info, &buf[j+1], modinfo->user_info_length);
+		biop_parse_module_user_info(modinfo);
 	}
 	j += 1 + modinfo->user_info_length;
 
@@ -581,149 +618,276 @@ int biop_create_module_info_dentries(struct dentry *parent, struct biop_module_i
 	CREATE_FILE_NUMBER(mod_dentry, modinfo, user_info_length);
 	if (modinfo->user_info_length)
 		CREATE_FILE_BIN(mod_dentry, modinfo, user_info, modinfo->user_info_length);
+	if (modinfo->has_crc_32)
+		CREATE_FILE_NUMBER(mod_dentry, modinfo, crc_32);
+
+	if (modinfo->compressed_module) {
+		struct dentry *cm_dentry = CREATE_DIRECTORY(mod_dentry, FS_BIOP_COMPRESSED_MODULE_DIRNAME);
+		struct biop_compressed_module *cm = modinfo->compressed_module;
+		CREATE_FILE_NUMBER(cm_dentry, cm, compression_method);
+		CREATE_FILE_NUMBER(cm_dentry, cm, original_size);
+	}
 
 	return 0;
 }
 
-static int biop_update_file_dentry(struct dentry *root, 
-	struct dentry *stepfather, struct biop_file_message *msg)
+/**
+ * biop_inflate_module: decompresses the @in_len bytes of a module announced by a
+ * compressed_module_descriptor into @out, which holds @out_len bytes.
+ * Returns the number of bytes decompressed or a negative error code.
+ */
+int biop_inflate_module(struct biop_compressed_module *compressed,
+		const char *in, uint32_t in_len, char *out, uint32_t out_len)
+{
+#ifdef USE_ZLIB
+	z_stream stream;
+	int ret;
+
+	/* compression_method follows RFC 1950: the lower nibble 8 means deflate */
+	if ((compressed->compression_method & 0x0f) != Z_DEFLATED)
+		return -ENOTSUP;
+
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK)
+		return -ENOMEM;
+
+	stream.next_in = (Bytef *) in;
+	stream.avail_in = in_len;
+	stream.next_out = (Bytef *) out;
+	stream.avail_out = out_len;
+	ret = inflate(&stream, Z_FINISH);
+	inflateEnd(&stream);
+
+	if (ret != Z_STREAM_END)
+		return ret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+	return stream.total_out;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static void biop_index_dentry(struct hash_table *inodes, struct dentry *dentry)
+{
+	hashtable_add(inodes, dentry->inode, dentry, NULL);
+}
+
+/*
+ * Entries parked under the stepfather remember the object key of their real parent
+ * in a table hung from stepfather->priv, since their own private field may hold the
+ * shared buffer of a content slice.
+ */
+static void biop_set_orphan_parent(struct dentry *stepfather, ino_t inode, ino_t parent_inode)
+{
+	struct hash_table *parents = stepfather->priv;
+	ino_t *priv_data;
+
+	if (! parents)
+		parents = stepfather->priv = hashtable_new(BIOP_ORPHANS_HASH_SIZE);
+	priv_data = hashtable_get(parents, inode);
+	if (! priv_data) {
+		priv_data = malloc(sizeof(ino_t));
+		hashtable_add(parents, inode, priv_data, free);
+	}
+	*priv_data = parent_inode;
+}
+
+static ino_t *biop_get_orphan_parent(struct dentry *stepfather, ino_t inode)
+{
+	return stepfather->priv ? hashtable_get(stepfather->priv, inode) : NULL;
+}
+
+static void biop_clear_orphan_parent(struct dentry *stepfather, ino_t inode)
+{
+	if (stepfather->priv)
+		hashtable_del(stepfather->priv, inode);
+}
+
+static inline struct dentry *biop_get_dentry(struct hash_table *inodes, ino_t inode)
+{
+	return (struct dentry *) hashtable_get(inodes, inode);
+}
+
+/**
+ * biop_create_dentry: creates a file or directory named @name under @parent and adds it
+ * to the @inodes index. Files announce @size bytes, but have no contents until their
+ * file message is parsed.
+ */
+static struct dentry *biop_create_dentry(struct dentry *parent, const char *name,
+	ino_t inode, bool is_dir, size_t size, struct hash_table *inodes)
+{
+	struct dentry *dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+	dentry->name = strdup(name);
+	dentry->inode = inode;
+	if (is_dir) {
+		dentry->mode = S_IFDIR | 0555;
+		dentry->obj_type = OBJ_TYPE_DIR;
+	} else {
+		dentry->size = size;
+		dentry->mode = S_IFREG | 0444;
+		dentry->obj_type = OBJ_TYPE_FILE;
+	}
+	INITIALIZE_DENTRY_UNLINKED(dentry);
+	dentry->parent = parent;
+	parent->size += dentry->size;
+	list_add_tail(&dentry->list, &parent->children);
+	if (! is_dir)
+		xattr_add(dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false);
+	biop_index_dentry(inodes, dentry);
+	return dentry;
+}
+
+/* Tells whether @dentry is @child itself or one of its ancestors */
+static bool biop_is_ancestor(struct dentry *dentry, struct dentry *child)
+{
+	for (; child; child = child->parent)
+		if (child == dentry)
+			return true;
+	return false;
+}
+
+/**
+ * biop_update_file_dentry: points the dentry of @obj at its contents within @module,
+ * the buffer which @obj was parsed from, rather than copying them.
+ */
+static void biop_update_file_dentry(struct dentry *stepfather, struct hash_table *inodes,
+	struct biop_object *obj, struct shared_buffer *module)
 {
-	struct biop_message_sub_header *sub_header = &msg->sub_header;
 	struct dentry *dentry;
-	ino_t inode;
 	
-	inode = biop_get_sub_header_inode(sub_header);
-	dentry = fsutils_find_by_inode(root, inode);
+	dentry = biop_get_dentry(inodes, obj->inode);
 	if (! dentry) {
-		dentry = fsutils_find_by_inode(stepfather, inode);
-		if (! dentry) {
-			/* 
-			 * Create dentry with no name in the hope that it will be
-			 * updated by a directory message later on.
-			 */
-			dentry = CREATE_SIMPLE_FILE(stepfather, "", msg->message_body.content_length, inode);
-		}
-	}
-	if (dentry->size != msg->message_body.content_length) {
-		dprintf("'%s': directory object said size=%zd, file object says %d (contents=%p, inode=%#zx)",
-		dentry->name, dentry->size, msg->message_body.content_length, dentry->contents, dentry->inode);
-
-		if (! dentry->size && dentry->contents) {
-			dprintf("warning: object key repeats for more than one object!");
-			return 0;
-		}
+		/* 
+		 * Create dentry with no name in the hope that it will be
+		 * updated by a directory message later on.
+		 */
+		dentry = biop_create_dentry(stepfather, "", obj->inode, false, obj->content_length, inodes);
+	} else if (S_ISDIR(dentry->mode)) {
+		dprintf("warning: object key %#jx is used by a directory and by a file", obj->inode);
+		return;
+	} else if (DEMUXFS_IS_SLICE(dentry)) {
+		dprintf("warning: object key %#jx repeats for more than one object!", obj->inode);
+		return;
 	}
+	if (dentry->size != obj->content_length)
+		dprintf("'%s': directory object said size=%zd, file object says %d (inode=%#zx)",
+		dentry->name, dentry->size, obj->content_length, dentry->inode);
 
-	UPDATE_COMMON(dentry, msg->message_body.contents, msg->message_body.content_length);
-	return 0;
+	UPDATE_SLICE(dentry, module, obj->contents - module->data, obj->content_length);
 }
 
-static int biop_create_children_dentries(struct dentry *root, 
-	struct dentry *stepfather, struct biop_directory_message *msg)
+static void biop_create_children_dentries(struct dentry *stepfather, struct hash_table *inodes,
+	struct biop_object *obj)
 {
-	struct biop_directory_message_body *msg_body = &msg->message_body;
-	struct biop_message_sub_header *sub_header = &msg->sub_header;
-	ino_t parent_inode, *priv_data;
+	ino_t parent_inode = obj->inode;
 	bool found_parent = true;
 	struct dentry *parent;
 	uint16_t i;
 
-	parent_inode = biop_get_sub_header_inode(sub_header);
-	parent = fsutils_find_by_inode(root, parent_inode);
-	if (! parent) {
+	parent = biop_get_dentry(inodes, parent_inode);
+	if (! parent || ! S_ISDIR(parent->mode)) {
 		parent = stepfather;
 		found_parent = false;
 	}
 
-	for (i=0; i<msg_body->bindings_count; ++i) {
-		struct biop_binding *binding = &msg_body->bindings[i];
-		struct biop_name *name = &binding->name;
-		struct dentry *entry = NULL, *tmp_entry;
-
-		if (binding->name.kind_data == 0x66696c00) {
-			dprintf("--> creating file '%s' of size '%zd' and inode '%#jx' and parent '%#jx' (%s)",
-					name->id_byte, binding->content_size, binding->_inode, parent_inode,
-					found_parent ? "found" : "not found");
-			/* 
-			 * First add to stepfather then move to real parent if they differ to
-			 * make sure we don't end up with half file info in &stepfather->children
-			 * and the other in &parent->children list.
-			 */
-			entry = CREATE_SIMPLE_FILE(stepfather, name->id_byte, binding->content_size, binding->_inode);
-			if (found_parent) {
-				tmp_entry = entry;
-				entry = CREATE_SIMPLE_FILE(parent, name->id_byte, binding->content_size, binding->_inode);
-				if (tmp_entry) {
-					UPDATE_COMMON(entry, tmp_entry->contents, tmp_entry->size);
-					fsutils_dispose_node(tmp_entry);
-				}
-			}
-		} else {
-			dprintf("--> creating directory '%s' with inode '%#jx' and parent '%#jx' (%s)",
-					name->id_byte, binding->_inode, parent_inode,
-					found_parent ? "found" : "not found");
-
-			entry = fsutils_find_by_inode(parent, binding->_inode);
-			if (entry) {
-				UPDATE_NAME(entry, name->id_byte);
-				UPDATE_PARENT(entry, parent);
-			} else {
-				entry = CREATE_SIMPLE_DIRECTORY(parent, name->id_byte, binding->_inode);
+	for (i=0; i<obj->bindings_count; ++i) {
+		struct biop_object_binding *binding = &obj->bindings[i];
+		struct dentry *entry;
+
+		dprintf("--> creating %s '%s' of size '%zd' and inode '%#jx' and parent '%#jx' (%s)",
+				binding->is_dir ? "directory" : "file", binding->name, binding->content_size,
+				binding->inode, parent_inode, found_parent ? "found" : "not found");
+
+		/* 
+		 * The object may have been created already by its file message or by a
+		 * directory message which was parsed before its parent's.
+		 */
+		entry = biop_get_dentry(inodes, binding->inode);
+		if (entry) {
+			if (!! S_ISDIR(entry->mode) != binding->is_dir || biop_is_ancestor(entry, parent)) {
+				dprintf("warning: ignoring binding '%s' to object key %#jx", 
+						binding->name, binding->inode);
+				continue;
 			}
-		}
-		entry->atime = binding->_timestamp;
-		entry->ctime = binding->_timestamp;
-		entry->mtime = binding->_timestamp;
+			UPDATE_NAME(entry, binding->name);
+			UPDATE_PARENT(entry, parent);
+			biop_clear_orphan_parent(stepfather, entry->inode);
+		} else
+			entry = biop_create_dentry(parent, binding->name, binding->inode, binding->is_dir,
+					binding->content_size, inodes);
+
+		entry->atime = binding->timestamp;
+		entry->ctime = binding->timestamp;
+		entry->mtime = binding->timestamp;
 		if (! found_parent) {
 			/* 
 			 * Possibly the parent wasn't scanned yet. Save the parent inode
-			 * number in the child's dentry private field to reparent it
-			 * later on.
+			 * number to reparent the child later on.
 			 */
-			priv_data = malloc(sizeof(ino_t));
-			*priv_data = parent_inode;
-			entry->priv = priv_data;
+			biop_set_orphan_parent(stepfather, entry->inode, parent_inode);
 		}
 	}
-	return 0;
 }
 
-void biop_reparent_orphaned_dentries(struct dentry *root, struct dentry *stepfather)
+/* Disposes of @dentry and of whatever has been linked under it, dropping them from the index */
+static void biop_dispose_orphan(struct dentry *dentry, struct hash_table *inodes)
+{
+	struct dentry *child, *aux;
+
+	list_for_each_entry_safe(child, aux, &dentry->children, list)
+		biop_dispose_orphan(child, inodes);
+	if (biop_get_dentry(inodes, dentry->inode) == dentry)
+		hashtable_del(inodes, dentry->inode);
+	fsutils_dispose_node(dentry);
+}
+
+/**
+ * biop_reparent_orphaned_dentries: moves the entries created before their directory object
+ * to their real parents and disposes of those whose parent can't be found. Missing parents are
+ * only reported if @report is set, as they may still be on their way in another module.
+ */
+void biop_reparent_orphaned_dentries(struct dentry *root, struct dentry *stepfather,
+	struct hash_table *inodes, bool report)
 {
 	struct dentry *entry, *aux;
 	bool has_orphaned_entries = false;
 
 	list_for_each_entry_safe(entry, aux, &stepfather->children, list) {
 		struct dentry *real_parent;
-		ino_t real_parent_inode;
+		ino_t real_parent_inode, *priv_data;
 		
-		if (! entry->priv) {
-			dprintf("oops, orphaned entry '%s' (%#jx) doesn't contain private data",
-				entry->name, entry->inode);
-			fsutils_dispose_node(entry);
+		priv_data = biop_get_orphan_parent(stepfather, entry->inode);
+		if (! priv_data) {
+			if (report)
+				dprintf("oops, orphaned entry '%s' (%#jx) doesn't contain private data",
+					entry->name, entry->inode);
+			biop_dispose_orphan(entry, inodes);
 			continue;
 		}
 
-		real_parent_inode = *(ino_t *) entry->priv;
-		real_parent = fsutils_find_by_inode(root, real_parent_inode);
-		if (! real_parent) {
-			/* It's possible that the real parent is also in the stepfather list */
-			real_parent = fsutils_find_by_inode(stepfather, real_parent_inode);
-		}
+		/* The real parent may be in the stepfather list as well */
+		real_parent_inode = *priv_data;
+		real_parent = biop_get_dentry(inodes, real_parent_inode);
+		if (real_parent && (! S_ISDIR(real_parent->mode) || biop_is_ancestor(entry, real_parent)))
+			real_parent = NULL;
 
 		if (! real_parent) {
-			dprintf("'%s' is definitely orphaned for its parent '%#jx' is missing",
-					entry->name, real_parent_inode);
-			fsutils_dispose_node(entry);
+			if (report)
+				dprintf("'%s' is definitely orphaned for its parent '%#jx' is missing",
+						entry->name, real_parent_inode);
+			biop_dispose_orphan(entry, inodes);
 			has_orphaned_entries = true;
 		} else {
 			list_move_tail(&entry->list, &real_parent->children);
-			free(entry->priv);
-			entry->priv = NULL;
+			entry->parent = real_parent;
+			real_parent->size += entry->size;
 		}
 	}
+	if (stepfather->priv) {
+		hashtable_destroy(stepfather->priv, NULL);
+		stepfather->priv = NULL;
+	}
 
-	if (has_orphaned_entries) {
+	if (has_orphaned_entries && report) {
 		dprintf("--- stepfather list ---");
 		fsutils_dump_tree(stepfather);
 		dprintf("--- rootfs list ---");
@@ -731,15 +895,81 @@ void biop_reparent_orphaned_dentries(struct dentry *root, struct dentry *stepfat
 	}
 }
 
-int biop_create_filesystem_dentries(struct dentry *parent, struct dentry *stepfather,
-	const char *buf, uint32_t len)
+static struct biop_object *biop_new_object(struct biop_module_objects *objects, ino_t inode,
+	uint32_t kind)
+{
+	struct biop_object *obj;
+
+	if (objects->count == objects->_allocated) {
+		uint32_t allocated = objects->_allocated ? objects->_allocated * 2 : 16;
+		obj = realloc(objects->objects, allocated * sizeof(struct biop_object));
+		if (! obj)
+			return NULL;
+		objects->objects = obj;
+		objects->_allocated = allocated;
+	}
+	obj = &objects->objects[objects->count++];
+	memset(obj, 0, sizeof(struct biop_object));
+	obj->inode = inode;
+	obj->kind = kind;
+	return obj;
+}
+
+static void biop_add_directory_object(struct biop_module_objects *objects,
+	struct biop_directory_message *msg, uint32_t kind)
+{
+	struct biop_directory_message_body *msg_body = &msg->message_body;
+	struct biop_object *obj;
+
+	obj = biop_new_object(objects, biop_get_sub_header_inode(&msg->sub_header), kind);
+	if (! obj || ! msg_body->bindings_count)
+		return;
+
+	obj->bindings = calloc(msg_body->bindings_count, sizeof(struct biop_object_binding));
+	if (! obj->bindings)
+		return;
+	for (uint16_t i=0; i<msg_body->bindings_count; ++i) {
+		struct biop_binding *binding = &msg_body->bindings[i];
+		struct biop_object_binding *obj_binding = &obj->bindings[obj->bindings_count];
+		if (! binding->name.id_byte)
+			continue;
+		obj_binding->name = strdup(binding->name.id_byte);
+		obj_binding->is_dir = binding->name.kind_data != BIOP_FILE_MESSAGE;
+		obj_binding->inode = binding->_inode;
+		obj_binding->content_size = binding->content_size;
+		obj_binding->timestamp = binding->_timestamp;
+		obj->bindings_count++;
+	}
+}
+
+void biop_free_module_objects(struct biop_module_objects *objects)
+{
+	if (! objects)
+		return;
+	for (uint32_t i=0; i<objects->count; ++i) {
+		struct biop_object *obj = &objects->objects[i];
+		for (uint16_t b=0; b<obj->bindings_count; ++b)
+			free(obj->bindings[b].name);
+		free(obj->bindings);
+	}
+	free(objects->objects);
+	free(objects);
+}
+
+/**
+ * biop_parse_module: parses the BIOP messages held in the @len bytes of a module.
+ * File contents are not copied, so @buf must outlive the returned objects.
+ */
+struct biop_module_objects *biop_parse_module(const char *buf, uint32_t len)
 {
-	struct biop_directory_message gateway_msg;
+	struct biop_module_objects *objects;
 	struct biop_message_header msg_header;
 	char object_kind[4];
 	int lookahead_offset, j = 0;
 
-	memset(&gateway_msg, 0, sizeof(gateway_msg));
+	objects = (struct biop_module_objects *) calloc(1, sizeof(struct biop_module_objects));
+	if (! objects)
+		return NULL;
 
 	while (j < len-1) {
 		j += biop_parse_message_header(&msg_header, &buf[j], len-j);
@@ -750,29 +980,28 @@ int biop_create_filesystem_dentries(struct dentry *parent, struct dentry *stepfa
 		lookahead_offset = j + 1 + (buf[j+1] & 0xff) + 4 + 4;
 		memcpy(object_kind, &buf[lookahead_offset], sizeof(object_kind));
 
-		if (! strncmp(object_kind, "srg", 3)) {
-			dprintf("----------------- gateway start ----------------");
-			memcpy(&gateway_msg.header, &msg_header, sizeof(msg_header));
-			j += biop_parse_directory_message(&gateway_msg, &buf[j], len-j);
-			parent->inode = biop_get_sub_header_inode(&gateway_msg.sub_header);
-			biop_create_children_dentries(parent, stepfather, &gateway_msg);
-			biop_free_directory_message(&gateway_msg);
-
-		} else if (! strncmp(object_kind, "dir", 3)) {
-			dprintf("----------------- directory start ----------------");
+		if (! strncmp(object_kind, "srg", 3) || ! strncmp(object_kind, "dir", 3)) {
+			bool is_gateway = object_kind[0] == 's';
 			struct biop_directory_message dir_msg;
+			dprintf("----------------- %s start ----------------", is_gateway ? "gateway" : "directory");
 			memset(&dir_msg, 0, sizeof(dir_msg));
 			memcpy(&dir_msg.header, &msg_header, sizeof(msg_header));
 			j += biop_parse_directory_message(&dir_msg, &buf[j], len-j);
-			biop_create_children_dentries(parent, stepfather, &dir_msg);
+			biop_add_directory_object(objects, &dir_msg, 
+				is_gateway ? BIOP_SERVICE_GATEWAY_MESSAGE : BIOP_DIR_MESSAGE);
 			biop_free_directory_message(&dir_msg);
 
 		} else if (! strncmp(object_kind, "fil", 3)) {
 			struct biop_file_message file_msg;
+			struct biop_object *obj;
 			memset(&file_msg, 0, sizeof(file_msg));
 			memcpy(&file_msg.header, &msg_header, sizeof(msg_header));
 			j += biop_parse_file_message(&file_msg, &buf[j], len-j);
-			biop_update_file_dentry(parent, stepfather, &file_msg);
+			obj = biop_new_object(objects, biop_get_sub_header_inode(&file_msg.sub_header), BIOP_FILE_MESSAGE);
+			if (obj) {
+				obj->contents = file_msg.message_body.contents;
+				obj->content_length = file_msg.message_body.content_length;
+			}
 			biop_free_file_message(&file_msg);
 
 		} else {
@@ -782,5 +1011,26 @@ int biop_create_filesystem_dentries(struct dentry *parent, struct dentry *stepfa
 		}
 	}
 
+	return objects;
+}
+
+int biop_create_module_dentries(struct dentry *parent, struct dentry *stepfather,
+	struct hash_table *inodes, struct biop_module_objects *objects, struct shared_buffer *module)
+{
+	for (uint32_t i=0; i<objects->count; ++i) {
+		struct biop_object *obj = &objects->objects[i];
+		switch (obj->kind) {
+			case BIOP_SERVICE_GATEWAY_MESSAGE:
+				parent->inode = obj->inode;
+				biop_index_dentry(inodes, parent);
+				/* fall through */
+			case BIOP_DIR_MESSAGE:
+				biop_create_children_dentries(stepfather, inodes, obj);
+				break;
+			case BIOP_FILE_MESSAGE:
+				biop_update_file_dentry(stepfather, inodes, obj, module);
+				break;
+		}
+	}
 	return 0;
 }
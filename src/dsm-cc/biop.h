@@ -3,6 +3,7 @@
 
 struct iop_ior;
 struct iop_tagged_profile;
+struct shared_buffer;
 
 /*
  * A complete description of DSM-CC is found in the following URL:
@@ -13,12 +14,17 @@ struct iop_tagged_profile;
 #define BIOP_DIR_MESSAGE          0x64697200 /* "dir" */
 #define BIOP_STREAM_MESSAGE       0x73747200 /* "str" */
 #define BIOP_STREAM_EVENT_MESSAGE 0x73746500 /* "ste" */
+#define BIOP_SERVICE_GATEWAY_MESSAGE 0x73726700 /* "srg" */
 
 #define BIOP_DELIVERY_PARA_USE    0x0016
 #define BIOP_OBJECT_USE           0x0017
 #define BIOP_ES_USE               0x0018
 #define BIOP_PROGRAM_USE          0x0019
 
+/* Descriptors found in the moduleInfo's user_info */
+#define BIOP_CRC32_DESCRIPTOR             0x05
+#define BIOP_COMPRESSED_MODULE_DESCRIPTOR 0x09
+
 struct biop_message_header {
 	uint32_t magic; /* "BIOP" */
 	uint8_t biop_version_major;
@@ -107,6 +113,13 @@ struct biop_module_info {
 	} *taps;
 	uint8_t user_info_length;
 	char *user_info;
+	/* CRC_32 of the module contents, if the user_info carries a CRC-32 descriptor */
+	bool has_crc_32;
+	uint32_t crc_32;
+	struct biop_compressed_module {
+		uint8_t compression_method;
+		uint32_t original_size;
+	} *compressed_module;
 };
 
 struct biop_object_location {
@@ -146,17 +159,54 @@ struct biop_profile_body {
 	struct biop_connbinder connbinder;
 };
 
-int biop_create_filesystem_dentries(struct dentry *parent,
-		struct dentry *stepfather,
-		const char *buf, uint32_t len);
+/**
+ * Compact form of the BIOP messages of a module: just what is needed to build the
+ * carousel tree, so that modules which haven't changed needn't be parsed again.
+ */
+struct biop_object {
+	ino_t inode;
+	uint32_t kind;
+	/* File messages. The contents point into the module buffer */
+	const char *contents;
+	uint32_t content_length;
+	/* Directory and service gateway messages */
+	uint16_t bindings_count;
+	struct biop_object_binding {
+		char *name;
+		bool is_dir;
+		ino_t inode;
+		uint64_t content_size;
+		uint64_t timestamp;
+	} *bindings;
+};
+
+struct biop_module_objects {
+	uint32_t count;
+	uint32_t _allocated;
+	struct biop_object *objects;
+};
+
+struct biop_module_objects *biop_parse_module(const char *buf, uint32_t len);
+void biop_free_module_objects(struct biop_module_objects *objects);
+
+/**
+ * The objects of a carousel are looked up by their object key through @inodes, which
+ * maps inode numbers to dentries both under @parent/@root and under @stepfather.
+ * Files are slices of @module, the buffer which @objects were parsed from.
+ */
+int biop_create_module_dentries(struct dentry *parent,
+		struct dentry *stepfather, struct hash_table *inodes,
+		struct biop_module_objects *objects, struct shared_buffer *module);
 void biop_reparent_orphaned_dentries(struct dentry *root, 
-		struct dentry *stepfather);
+		struct dentry *stepfather, struct hash_table *inodes, bool report);
 
 void biop_free_module_info(struct biop_module_info *modinfo);
 int biop_parse_module_info(struct biop_module_info *modinfo,
 		const char *buf, uint32_t len);
 int biop_create_module_info_dentries(struct dentry *parent,
 		struct biop_module_info *modinfo);
+int biop_inflate_module(struct biop_compressed_module *compressed,
+		const char *in, uint32_t in_len, char *out, uint32_t out_len);
 
 int biop_parse_connbinder(struct biop_connbinder *cb, const char *buf, 
 		uint32_t len);
@@ -0,0 +1,254 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "buffer.h"
+#include "crc32.h"
+#include "ts.h"
+#include "debug.h"
+#include "dsm-cc/cache.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#define CAROUSEL_CACHE_MAGIC "DFSM"
+
+/**
+ * Header of a cached module file, written in host byte order and followed by
+ * @module_size bytes of module contents.
+ */
+struct carousel_cache_header {
+	char magic[4];
+	uint32_t module_size;
+	uint32_t crc32;
+};
+
+/* The file name of a module, which carries its CRC_32 if the DII announced one */
+static void carousel_cache_name(const struct carousel_cache_key *key, char *buf, size_t size)
+{
+	if (key->has_crc_32)
+		snprintf(buf, size, "%04x_%08x_%04x_%02x_%08x.mod", key->pid, key->download_id,
+			key->module_id, key->module_version, key->crc_32);
+	else
+		snprintf(buf, size, "%04x_%08x_%04x_%02x.mod", key->pid, key->download_id,
+			key->module_id, key->module_version);
+}
+
+static void carousel_cache_path(const struct carousel_cache_key *key, const char *tmpdir,
+		char *buf, size_t size)
+{
+	char name[48];
+
+	carousel_cache_name(key, name, sizeof(name));
+	snprintf(buf, size, "%s/%s/%s", tmpdir, CAROUSEL_CACHE_DIRNAME, name);
+}
+
+/**
+ * carousel_cache_open_dir: checks that the cache directory under @tmpdir is a real
+ * directory owned by us and closed to other users, optionally creating it. Anyone
+ * able to write there could plant modules which would be served as carousel contents.
+ * Returns 0 on success or a negative errno value.
+ */
+static int carousel_cache_open_dir(const char *tmpdir, bool create)
+{
+	static bool warned = false;
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", tmpdir, CAROUSEL_CACHE_DIRNAME);
+	if (lstat(path, &st) < 0) {
+		if (errno != ENOENT || ! create)
+			return -errno;
+		if (mkdir(path, 0700) < 0 && errno != EEXIST)
+			return -errno;
+		if (lstat(path, &st) < 0)
+			return -errno;
+	}
+	if (! S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 0777) != 0700) {
+		if (! warned)
+			TS_WARNING("not using %s: it must be a directory owned by uid %d with mode 0700",
+				path, (int) geteuid());
+		warned = true;
+		return -EPERM;
+	}
+	return 0;
+}
+
+static int carousel_cache_read(int fd, void *buf, size_t size)
+{
+	ssize_t n;
+	while (size) {
+		n = read(fd, buf, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		buf = (char *) buf + n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int carousel_cache_write(int fd, const void *buf, size_t size)
+{
+	ssize_t n;
+	while (size) {
+		n = write(fd, buf, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return -errno;
+		buf = (const char *) buf + n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * carousel_cache_load: returns a new buffer with the cached contents of the module
+ * identified by @key, or NULL if it isn't cached. Damaged files are removed.
+ */
+struct shared_buffer *carousel_cache_load(const struct carousel_cache_key *key, const char *tmpdir)
+{
+	struct carousel_cache_header cache_header;
+	struct shared_buffer *buffer;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	if (carousel_cache_open_dir(tmpdir, false) < 0)
+		return NULL;
+	carousel_cache_path(key, tmpdir, path, sizeof(path));
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+		st.st_size != sizeof(cache_header) + key->module_size ||
+		carousel_cache_read(fd, &cache_header, sizeof(cache_header)) < 0 ||
+		memcmp(cache_header.magic, CAROUSEL_CACHE_MAGIC, sizeof(cache_header.magic)) ||
+		cache_header.module_size != key->module_size ||
+		(key->has_crc_32 && cache_header.crc32 != key->crc_32)) {
+		TS_WARNING("discarding invalid cache file %s", path);
+		goto out_unlink;
+	}
+
+	buffer = shared_buffer_new(key->module_size);
+	if (! buffer) {
+		close(fd);
+		return NULL;
+	}
+	if (carousel_cache_read(fd, buffer->data, buffer->size) < 0 ||
+		crc32_compute(buffer->data, buffer->size) != cache_header.crc32) {
+		TS_WARNING("discarding corrupted cache file %s", path);
+		shared_buffer_put(buffer);
+		goto out_unlink;
+	}
+	close(fd);
+	return buffer;
+
+out_unlink:
+	close(fd);
+	unlink(path);
+	return NULL;
+}
+
+/* Removes the cached copies of the other versions of the module identified by @key */
+static void carousel_cache_remove_stale(const struct carousel_cache_key *key, const char *tmpdir)
+{
+	char path[PATH_MAX], prefix[32], current[48];
+	struct dirent *entry;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/%s", tmpdir, CAROUSEL_CACHE_DIRNAME);
+	dir = opendir(path);
+	if (! dir)
+		return;
+
+	snprintf(prefix, sizeof(prefix), "%04x_%08x_%04x_", key->pid, key->download_id, key->module_id);
+	carousel_cache_name(key, current, sizeof(current));
+	while ((entry = readdir(dir)) != NULL) {
+		if (! strncmp(entry->d_name, prefix, strlen(prefix)) && strcmp(entry->d_name, current)) {
+			snprintf(path, sizeof(path), "%s/%s/%s", tmpdir, CAROUSEL_CACHE_DIRNAME, entry->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * carousel_cache_store: saves the contents of a complete module, unless they are cached
+ * already. The file is written under a unique temporary name and then renamed over the
+ * final one.
+ */
+int carousel_cache_store(const struct carousel_cache_key *key, struct shared_buffer *buffer,
+		const char *tmpdir)
+{
+	struct carousel_cache_header cache_header;
+	char path[PATH_MAX], tmp_path[PATH_MAX + 16];
+	struct stat st;
+	int fd, ret;
+
+	ret = carousel_cache_open_dir(tmpdir, true);
+	if (ret < 0)
+		return ret;
+
+	carousel_cache_path(key, tmpdir, path, sizeof(path));
+	if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == sizeof(cache_header) + buffer->size)
+		return 0;
+
+	/* mkstemp() creates the file with O_EXCL and mode 0600 */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0)
+		return -errno;
+
+	memcpy(cache_header.magic, CAROUSEL_CACHE_MAGIC, sizeof(cache_header.magic));
+	cache_header.module_size = buffer->size;
+	cache_header.crc32 = crc32_compute(buffer->data, buffer->size);
+	if (key->has_crc_32 && cache_header.crc32 != key->crc_32) {
+		/* Not what the DII announced: keep it out of the cache */
+		close(fd);
+		unlink(tmp_path);
+		return -EBADMSG;
+	}
+	ret = carousel_cache_write(fd, &cache_header, sizeof(cache_header));
+	if (ret == 0)
+		ret = carousel_cache_write(fd, buffer->data, buffer->size);
+	if (close(fd) < 0 && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp_path, path) < 0)
+		ret = -errno;
+	if (ret < 0) {
+		unlink(tmp_path);
+		return ret;
+	}
+
+	carousel_cache_remove_stale(key, tmpdir);
+	return 0;
+}
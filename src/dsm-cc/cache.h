@@ -0,0 +1,63 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __cache_h
+#define __cache_h
+
+/* Directory under -o tmpdir holding the modules of the carousels seen so far */
+#define CAROUSEL_CACHE_DIRNAME "demuxfs-carousels"
+
+/**
+ * Identifies a carousel module in the on-disk cache. The CRC of the contents is
+ * kept in the cached file and checked when the module is loaded. Modules whose
+ * DII announces their CRC_32 in a CRC-32 descriptor are keyed by it as well.
+ */
+struct carousel_cache_key {
+	uint16_t pid;
+	uint32_t download_id;
+	uint16_t module_id;
+	uint8_t module_version;
+	uint32_t module_size;
+	bool has_crc_32;
+	uint32_t crc_32;
+};
+
+/* Tells if two keys identify the same contents of a module */
+static inline bool carousel_cache_same_key(const struct carousel_cache_key *a,
+		const struct carousel_cache_key *b)
+{
+	return a->pid == b->pid && a->download_id == b->download_id && a->module_id == b->module_id &&
+		a->module_version == b->module_version && a->module_size == b->module_size &&
+		a->has_crc_32 == b->has_crc_32 && (! a->has_crc_32 || a->crc_32 == b->crc_32);
+}
+
+struct shared_buffer *carousel_cache_load(const struct carousel_cache_key *key, const char *tmpdir);
+int carousel_cache_store(const struct carousel_cache_key *key, struct shared_buffer *buffer,
+		const char *tmpdir);
+
+#endif /* __cache_h */
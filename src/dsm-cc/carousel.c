@@ -0,0 +1,520 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "buffer.h"
+#include "hash.h"
+#include "list.h"
+#include "ts.h"
+#include "debug.h"
+#include "tables/psi.h"
+#include "dsm-cc/dsmcc.h"
+#include "dsm-cc/biop.h"
+#include "dsm-cc/cache.h"
+#include "dsm-cc/carousel.h"
+#include "dsm-cc/dii.h"
+
+#define CAROUSEL_INODES_HASH_SIZE 1021
+
+/**
+ * BIOP objects of the modules last assembled on a PID, along with the buffers they were
+ * parsed from, of which the files of the published tree are slices. Modules announced
+ * again with the same version are not parsed again when a new DII version brings the
+ * carousel up, nor when the tree is rebuilt because another module has been completed.
+ * @app_name: directory under /DSM-CC holding the tree published last
+ */
+struct carousel_state {
+	uint16_t pid;
+	char *app_name;
+	uint16_t number_of_modules;
+	struct carousel_parsed_module {
+		struct carousel_cache_key cache_key;
+		struct shared_buffer *buffer;
+		struct biop_module_objects *objects;
+	} *modules;
+	struct list_head list;
+};
+
+/**
+ * The carousel thread parses BIOP messages into a detached tree, so that the
+ * parser thread never walks multi-megabyte modules. The finished tree is merged
+ * into /DSM-CC while holding the parser mutex.
+ * @jobs: jobs not yet picked up by the thread
+ * @states: parsed modules, only touched by whoever runs the jobs
+ */
+struct carousel_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head jobs;
+	struct list_head states;
+	struct demuxfs_data *priv;
+	bool started;
+	bool stop;
+};
+
+static struct carousel_worker carousel_worker = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.jobs = LIST_HEAD_INIT(carousel_worker.jobs),
+	.states = LIST_HEAD_INIT(carousel_worker.states),
+};
+
+struct carousel_job *carousel_job_new(uint16_t pid, const char *app_name, uint16_t number_of_modules)
+{
+	struct carousel_job *job = (struct carousel_job *) calloc(1, sizeof(struct carousel_job));
+	if (! job)
+		return NULL;
+	job->pid = pid;
+	job->app_name = strdup(app_name);
+	job->number_of_modules = number_of_modules;
+	if (number_of_modules)
+		job->modules = (struct carousel_module *) calloc(number_of_modules, sizeof(struct carousel_module));
+	if (! job->app_name || (number_of_modules && ! job->modules)) {
+		carousel_job_free(job);
+		return NULL;
+	}
+	return job;
+}
+
+void carousel_job_free(struct carousel_job *job)
+{
+	if (job->modules) {
+		for (uint16_t i=0; i<job->number_of_modules; ++i)
+			shared_buffer_put(job->modules[i].buffer);
+		free(job->modules);
+	}
+	free(job->app_name);
+	free(job);
+}
+
+/**
+ * carousel_module_contents: returns the buffer holding the BIOP messages of @mod.
+ * Compressed modules are inflated on first use and the result is kept along with
+ * the module buffer, so later jobs carrying the same module don't inflate it again.
+ * Modules which fail to inflate are flagged as such and not retried either.
+ */
+static struct shared_buffer *carousel_module_contents(struct carousel_module *mod)
+{
+	uint32_t original_size = mod->compressed_module.original_size;
+	struct shared_buffer *inflated;
+	int ret;
+
+	if (! mod->compressed)
+		return mod->buffer;
+	if (mod->buffer->decoded)
+		return mod->buffer->decoded;
+	if (mod->buffer->decode_failed)
+		return NULL;
+
+	if (original_size == 0 || original_size > CAROUSEL_MAX_INFLATED_SIZE ||
+		original_size / CAROUSEL_MAX_INFLATE_RATIO > mod->buffer->size) {
+		TS_WARNING("module %#x: bogus original_size=%u for %zu compressed bytes",
+				mod->module_id, original_size, mod->buffer->size);
+		mod->buffer->decode_failed = true;
+		return NULL;
+	}
+
+	inflated = shared_buffer_new(original_size);
+	if (! inflated)
+		return NULL;
+	ret = biop_inflate_module(&mod->compressed_module, mod->buffer->data, mod->buffer->size,
+			inflated->data, inflated->size);
+	if (ret < 0) {
+		TS_WARNING("cannot inflate module %#x: %s", mod->module_id, strerror(-ret));
+		shared_buffer_put(inflated);
+		if (ret != -ENOMEM)
+			mod->buffer->decode_failed = true;
+		return NULL;
+	}
+	if (ret != inflated->size) {
+		TS_WARNING("module %#x inflated to %d bytes, but original_size=%zu",
+				mod->module_id, ret, inflated->size);
+		inflated->size = ret;
+	}
+	mod->buffer->decoded = inflated;
+	return inflated;
+}
+
+static struct carousel_state *carousel_get_state(uint16_t pid)
+{
+	struct carousel_state *state;
+
+	list_for_each_entry(state, &carousel_worker.states, list)
+		if (state->pid == pid)
+			return state;
+
+	state = (struct carousel_state *) calloc(1, sizeof(struct carousel_state));
+	if (! state)
+		return NULL;
+	state->pid = pid;
+	list_add_tail(&state->list, &carousel_worker.states);
+	return state;
+}
+
+static void carousel_free_parsed_modules(struct carousel_parsed_module *modules, uint16_t count)
+{
+	for (uint16_t i=0; i<count; ++i) {
+		biop_free_module_objects(modules[i].objects);
+		shared_buffer_put(modules[i].buffer);
+	}
+	free(modules);
+}
+
+static void carousel_free_state(struct carousel_state *state)
+{
+	list_del(&state->list);
+	carousel_free_parsed_modules(state->modules, state->number_of_modules);
+	free(state->app_name);
+	free(state);
+}
+
+/**
+ * carousel_take_parsed_module: hands over the objects parsed from an earlier copy of @mod,
+ * if that copy had the same version. Returns false if @mod must be parsed.
+ */
+static bool carousel_take_parsed_module(struct carousel_state *state, struct carousel_module *mod,
+		struct carousel_parsed_module *parsed)
+{
+	const struct carousel_cache_key *key = &mod->cache_key;
+
+	for (uint16_t i=0; state && i<state->number_of_modules; ++i) {
+		struct carousel_parsed_module *old = &state->modules[i];
+		if (old->objects && carousel_cache_same_key(&old->cache_key, key)) {
+			*parsed = *old;
+			memset(old, 0, sizeof(*old));
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * carousel_build_tree: parses the modules of @job into a dentry which is not linked to the filesystem.
+ */
+static struct dentry *carousel_build_tree(struct carousel_job *job, struct carousel_state *state)
+{
+	struct dentry stepfather_dentry, *app_dentry;
+	struct carousel_parsed_module *parsed;
+	struct hash_table *inodes;
+	uint16_t reused = 0;
+
+	app_dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+	parsed = (struct carousel_parsed_module *) calloc(job->number_of_modules + 1, sizeof(*parsed));
+	if (! app_dentry || ! parsed) {
+		free(app_dentry);
+		free(parsed);
+		return NULL;
+	}
+	app_dentry->name = strdup(job->app_name);
+	app_dentry->mode = S_IFDIR | 0555;
+	app_dentry->obj_type = OBJ_TYPE_DIR;
+	INITIALIZE_DENTRY_UNLINKED(app_dentry);
+	INIT_LIST_HEAD(&app_dentry->list);
+
+	memset(&stepfather_dentry, 0, sizeof(stepfather_dentry));
+	INIT_LIST_HEAD(&stepfather_dentry.children);
+
+	/* Object key index, which grows as the BIOP parser finds objects */
+	inodes = hashtable_new(CAROUSEL_INODES_HASH_SIZE);
+
+	for (uint16_t i=0; i<job->number_of_modules; ++i) {
+		struct carousel_module *mod = &job->modules[i];
+		struct shared_buffer *contents;
+		if (! mod->buffer || ! mod->buffer->size)
+			continue;
+		if (carousel_take_parsed_module(state, mod, &parsed[i]))
+			reused++;
+		else {
+			contents = carousel_module_contents(mod);
+			if (! contents || ! contents->size)
+				continue;
+			/* The objects point into the module contents, which must stay around */
+			parsed[i].cache_key = mod->cache_key;
+			parsed[i].buffer = shared_buffer_get(contents);
+			parsed[i].objects = biop_parse_module(contents->data, contents->size);
+		}
+		if (parsed[i].objects)
+			biop_create_module_dentries(app_dentry, &stepfather_dentry, inodes, parsed[i].objects,
+					parsed[i].buffer);
+	}
+	/* Objects whose directory is in a module yet to be completed are dropped until it arrives */
+	biop_reparent_orphaned_dentries(app_dentry, &stepfather_dentry, inodes, job->complete);
+	hashtable_destroy(inodes, NULL);
+
+	dprintf("%d out of %d modules were parsed already", reused, job->number_of_modules);
+	if (state) {
+		carousel_free_parsed_modules(state->modules, state->number_of_modules);
+		state->modules = parsed;
+		state->number_of_modules = job->number_of_modules;
+	} else
+		carousel_free_parsed_modules(parsed, job->number_of_modules);
+
+	return app_dentry;
+}
+
+/* Tells whether the live entry @old can stay in place of @fresh, which was built from the same objects */
+static bool carousel_same_entry(struct dentry *old, struct dentry *fresh)
+{
+	if (S_ISDIR(old->mode) || S_ISDIR(fresh->mode))
+		return S_ISDIR(old->mode) && S_ISDIR(fresh->mode);
+	/* Slices of a module which was parsed already point at the same contents */
+	return old->obj_type == fresh->obj_type && old->inode == fresh->inode &&
+		old->size == fresh->size && old->contents == fresh->contents &&
+		old->mtime == fresh->mtime;
+}
+
+/**
+ * carousel_merge_tree: updates the live directory @live to match @fresh, its counterpart
+ * in the tree just built, and disposes of @fresh. Entries which haven't changed are kept,
+ * so only new or updated objects get linked in and files held open stay valid. Entries
+ * which are gone or replaced are retired rather than freed.
+ */
+static void carousel_merge_tree(struct dentry *live, struct dentry *fresh)
+{
+	struct dentry *entry, *old, *aux;
+
+	list_for_each_entry_safe(old, aux, &live->children, list)
+		if (! fsutils_get_child(fresh, old->name))
+			fsutils_retire_tree(old);
+
+	list_for_each_entry_safe(entry, aux, &fresh->children, list) {
+		old = fsutils_get_child(live, entry->name);
+		if (old && carousel_same_entry(old, entry)) {
+			if (S_ISDIR(entry->mode))
+				carousel_merge_tree(old, entry);
+			else
+				fsutils_dispose_node(entry);
+			continue;
+		}
+		list_del(&entry->list);
+		entry->parent = live;
+		if (old) {
+			list_add_tail(&entry->list, &old->list);
+			fsutils_retire_tree(old);
+		} else
+			list_add_tail(&entry->list, &live->children);
+	}
+	live->inode = fresh->inode;
+	live->size = fresh->size;
+	live->atime = fresh->atime;
+	live->ctime = fresh->ctime;
+	live->mtime = fresh->mtime;
+	fsutils_dispose_node(fresh);
+}
+
+/**
+ * carousel_publish: links @app_dentry under /DSM-CC, or merges it into the tree published
+ * earlier under the same name. A tree published under another name, as happens when the
+ * AIT comes after it, is retired. Must be called with the parser mutex held.
+ */
+static void carousel_publish(struct dentry *app_dentry, struct carousel_state *state,
+		struct demuxfs_data *priv)
+{
+	struct dentry *dsmcc_dentry, *old_dentry;
+	char *old_name = state ? state->app_name : NULL;
+
+	dsmcc_dentry = CREATE_DIRECTORY(priv->root, FS_DSMCC_NAME);
+	if (old_name && strcmp(old_name, app_dentry->name)) {
+		old_dentry = fsutils_get_child(dsmcc_dentry, old_name);
+		if (old_dentry) {
+			dsmcc_dentry->size -= old_dentry->size;
+			fsutils_retire_tree(old_dentry);
+		}
+	}
+	if (state) {
+		free(state->app_name);
+		state->app_name = strdup(app_dentry->name);
+	}
+	old_dentry = fsutils_get_child(dsmcc_dentry, app_dentry->name);
+	dsmcc_dentry->size += app_dentry->size;
+	if (old_dentry && S_ISDIR(old_dentry->mode)) {
+		dsmcc_dentry->size -= old_dentry->size;
+		carousel_merge_tree(old_dentry, app_dentry);
+	} else {
+		if (old_dentry) {
+			dsmcc_dentry->size -= old_dentry->size;
+			fsutils_retire_tree(old_dentry);
+		}
+		app_dentry->parent = dsmcc_dentry;
+		list_add_tail(&app_dentry->list, &dsmcc_dentry->children);
+	}
+}
+
+/**
+ * carousel_store_modules: saves the modules of @job to the cache under -o tmpdir, so that
+ * the next mount can build the carousel without waiting for its DDBs.
+ */
+static void carousel_store_modules(struct carousel_job *job, struct demuxfs_data *priv)
+{
+	for (uint16_t i=0; i<job->number_of_modules; ++i) {
+		struct carousel_module *mod = &job->modules[i];
+		int ret;
+		if (! mod->buffer || ! mod->buffer->size)
+			continue;
+		ret = carousel_cache_store(&mod->cache_key, mod->buffer, priv->options.tmpdir);
+		if (ret < 0)
+			dprintf("cannot cache module %#x: %s", mod->module_id, strerror(-ret));
+	}
+}
+
+/**
+ * carousel_run_lookup: loads the modules of a cache lookup job, which may take a while
+ * for large modules, and hands them over to the current DII.
+ * @locked: whether the caller holds the parser mutex already
+ */
+static void carousel_run_lookup(struct carousel_job *job, struct demuxfs_data *priv, bool locked)
+{
+	for (uint16_t i=0; i<job->number_of_modules; ++i)
+		job->modules[i].buffer = carousel_cache_load(&job->modules[i].cache_key, priv->options.tmpdir);
+
+	if (! locked)
+		pthread_mutex_lock(&priv->parser_mutex);
+	dii_install_cached_modules(job, priv);
+	if (! locked)
+		pthread_mutex_unlock(&priv->parser_mutex);
+	carousel_job_free(job);
+}
+
+static void carousel_run_job(struct carousel_job *job, struct demuxfs_data *priv)
+{
+	struct carousel_state *state = carousel_get_state(job->pid);
+	struct dentry *app_dentry;
+
+	dprintf("*** Creating filesystem for PID %#x ***", job->pid);
+	app_dentry = carousel_build_tree(job, state);
+	if (app_dentry) {
+		pthread_mutex_lock(&priv->parser_mutex);
+		carousel_publish(app_dentry, state, priv);
+		pthread_mutex_unlock(&priv->parser_mutex);
+	}
+	carousel_store_modules(job, priv);
+	carousel_job_free(job);
+}
+
+static void *carousel_worker_thread(void *data)
+{
+	struct carousel_worker *worker = (struct carousel_worker *) data;
+	struct carousel_job *job;
+
+	pthread_mutex_lock(&worker->mutex);
+	while (! worker->stop) {
+		if (list_empty(&worker->jobs)) {
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+			continue;
+		}
+		job = list_entry(worker->jobs.next, struct carousel_job, list);
+		list_del(&job->list);
+		pthread_mutex_unlock(&worker->mutex);
+
+		if (job->cache_lookup)
+			carousel_run_lookup(job, worker->priv, false);
+		else
+			carousel_run_job(job, worker->priv);
+
+		pthread_mutex_lock(&worker->mutex);
+	}
+	pthread_mutex_unlock(&worker->mutex);
+	return NULL;
+}
+
+void carousel_submit(struct carousel_job *job, struct demuxfs_data *priv)
+{
+	struct carousel_worker *worker = &carousel_worker;
+	struct carousel_job *queued;
+
+	pthread_mutex_lock(&worker->mutex);
+	if (! worker->started) {
+		pthread_mutex_unlock(&worker->mutex);
+		/* The caller, a table parser, already holds the parser mutex */
+		if (job->cache_lookup) {
+			carousel_run_lookup(job, priv, true);
+			return;
+		}
+		struct carousel_state *state = carousel_get_state(job->pid);
+		struct dentry *app_dentry = carousel_build_tree(job, state);
+		if (app_dentry)
+			carousel_publish(app_dentry, state, priv);
+		carousel_store_modules(job, priv);
+		carousel_job_free(job);
+		return;
+	}
+
+	/* A job still waiting for the same PID has been superseded by this one */
+	list_for_each_entry(queued, &worker->jobs, list) {
+		if (queued->pid == job->pid && queued->cache_lookup == job->cache_lookup) {
+			list_replace(&queued->list, &job->list);
+			carousel_job_free(queued);
+			pthread_mutex_unlock(&worker->mutex);
+			return;
+		}
+	}
+	list_add_tail(&job->list, &worker->jobs);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+int carousel_start_worker(struct demuxfs_data *priv)
+{
+	struct carousel_worker *worker = &carousel_worker;
+	int err;
+
+	worker->priv = priv;
+	worker->stop = false;
+	err = pthread_create(&worker->thread, NULL, carousel_worker_thread, worker);
+	if (err)
+		return -err;
+	worker->started = true;
+	return 0;
+}
+
+void carousel_stop_worker(void)
+{
+	struct carousel_worker *worker = &carousel_worker;
+	struct carousel_state *state, *aux_state;
+	struct carousel_job *job, *aux;
+
+	if (worker->started) {
+		pthread_mutex_lock(&worker->mutex);
+		worker->stop = true;
+		pthread_cond_broadcast(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+		pthread_join(worker->thread, NULL);
+		worker->started = false;
+
+		/* Carousels which haven't been assembled yet are dropped along with the filesystem */
+		list_for_each_entry_safe(job, aux, &worker->jobs, list) {
+			list_del(&job->list);
+			carousel_job_free(job);
+		}
+	}
+
+	list_for_each_entry_safe(state, aux_state, &worker->states, list)
+		carousel_free_state(state);
+}
@@ -0,0 +1,84 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __carousel_h
+#define __carousel_h
+
+/* Default for -o carouselmem, in MiB */
+#define CAROUSEL_DEFAULT_MEMORY 64
+
+/* Deflate can't do better than about 1032:1, so larger original_size values are bogus */
+#define CAROUSEL_MAX_INFLATE_RATIO 1032
+
+/* Upper limit of the original_size of a compressed module */
+#define CAROUSEL_MAX_INFLATED_SIZE (256 * 1024 * 1024)
+
+/**
+ * A module whose blocks have all been received. The job holds a reference to its buffer,
+ * which is saved to the module cache by the carousel thread.
+ * Modules announced with a compressed_module_descriptor are inflated by the carousel thread.
+ */
+struct carousel_module {
+	uint16_t module_id;
+	struct shared_buffer *buffer;
+	struct carousel_cache_key cache_key;
+	bool compressed;
+	struct biop_compressed_module compressed_module;
+};
+
+/**
+ * Object carousel assembly job. The BIOP messages of @modules are parsed into a
+ * directory named @app_name, which replaces any previous one under /DSM-CC.
+ * Modules still being downloaded have no buffer; @complete is set once there are none.
+ * Jobs flagged with @cache_lookup carry no buffers at all: their modules are loaded
+ * from the module cache and handed to dii_install_cached_modules() instead.
+ */
+struct carousel_job {
+	uint16_t pid;
+	char *app_name;
+	bool complete;
+	bool cache_lookup;
+	uint16_t number_of_modules;
+	struct carousel_module *modules;
+	struct list_head list;
+};
+
+struct carousel_job *carousel_job_new(uint16_t pid, const char *app_name, uint16_t number_of_modules);
+void carousel_job_free(struct carousel_job *job);
+
+/**
+ * carousel_submit - Hands @job over to the carousel thread, which takes ownership of it.
+ *
+ * Jobs are run synchronously if the carousel thread hasn't been started.
+ */
+void carousel_submit(struct carousel_job *job, struct demuxfs_data *priv);
+
+int carousel_start_worker(struct demuxfs_data *priv);
+void carousel_stop_worker(void);
+
+#endif /* __carousel_h */
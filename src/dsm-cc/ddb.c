@@ -32,6 +32,7 @@
 #include "xattr.h"
 #include "hash.h"
 #include "fifo.h"
+#include "buffer.h"
 #include "ts.h"
 #include "tables/psi.h"
 #include "dsm-cc/dsmcc.h"
@@ -53,29 +54,6 @@ void ddb_free(struct ddb_table *ddb)
 	free(ddb);
 }
 
-static bool ddb_block_number_already_parsed(struct ddb_table *current_ddb, 
-	uint16_t module_id, uint16_t block_number)
-{
-	struct dentry *current_dentry, *module_dentry, *block_dentry;
-	char dname[64], fname[64];
-
-	if (! current_ddb)
-		return false;
-
-	current_dentry = fsutils_get_current(current_ddb->dentry);
-	if (current_dentry) {
-		sprintf(dname, "module_%02d", module_id);
-		sprintf(fname, "block_%02d.bin", block_number);
-		module_dentry = fsutils_get_child(current_dentry, dname);
-		if (module_dentry) {
-			block_dentry = fsutils_get_child(module_dentry, fname);
-			return block_dentry ? true : false;
-		}
-	}
-
-	return false;
-}
-
 static void ddb_check_header(struct ddb_table *ddb)
 {
 }
@@ -95,6 +73,44 @@ static void ddb_create_directory(const struct ts_header *header, struct ddb_tabl
 	*version_dentry = fsutils_create_version_dir(ddb->dentry, ddb->version_number);
 }
 
+static void ddb_expose_module(struct dentry *version_dentry, struct dii_module *mod)
+{
+	char fname[64];
+
+	sprintf(fname, "module_%02d.bin", mod->module_id);
+	CREATE_SLICE_FILE(version_dentry, fname, mod->_buffer, 0, mod->module_size);
+}
+
+/**
+ * ddb_create_module_file: exposes the buffer of @mod as module_NN.bin under the DDB
+ * directory of @pid. Modules loaded from the module cache may complete before any
+ * block arrives on @pid, so that directory is created if needed.
+ */
+void ddb_create_module_file(uint16_t pid, struct dii_module *mod, struct demuxfs_data *priv)
+{
+	struct ts_header header = { .pid = pid };
+	struct dentry *version_dentry = NULL;
+	struct ddb_table *ddb;
+
+	ddb = hashtable_get(priv->psi_tables, (pid << 8) | TS_DDB_TABLE_ID);
+	if (ddb)
+		version_dentry = fsutils_get_current(ddb->dentry);
+	else {
+		ddb = (struct ddb_table *) calloc(1, sizeof(struct ddb_table));
+		assert(ddb);
+		ddb->dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+		assert(ddb->dentry);
+		ddb->table_id = TS_DDB_TABLE_ID;
+		ddb->version_number = mod->module_version & 0x1f;
+		ddb->current_next_indicator = 1;
+		ddb->dentry->inode = TS_PACKET_HASH_KEY(&header, ddb);
+		ddb_create_directory(&header, ddb, &version_dentry, priv);
+		hashtable_add(priv->psi_tables, ddb->dentry->inode, ddb, (hashtable_free_function_t) ddb_free);
+	}
+	if (version_dentry)
+		ddb_expose_module(version_dentry, mod);
+}
+
 int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
@@ -153,7 +169,14 @@ int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		ddb_free(ddb);
 		return 0;
 	}
-	if (ddb_block_number_already_parsed(current_ddb, ddb->module_id, ddb->block_number)) {
+	/* 
+	 * Blocks are placed in their module according to the DII. The carousel repeats those
+	 * which arrive before it or which belong to a module_version it doesn't announce.
+	 */
+	struct dii_table *dii = dii_get_current(header->pid, priv);
+	struct dii_module *mod = dii ? dii_get_module(dii, ddb->module_id) : NULL;
+	if (! mod || mod->module_version != ddb->module_version || ddb->block_number >= mod->_block_count ||
+		dii_module_has_block(mod, ddb->block_number)) {
 		ddb_free(ddb);
 		return 0;
 	}
@@ -173,17 +196,11 @@ int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	if (this_block_size != ddb->_block_data_size)
 		TS_WARNING("ddb->block_data_size=%d != this_block_size=%d", ddb->_block_data_size, this_block_size);
 
-	/* Create individual block file */
-	struct dentry *module_dir = CREATE_DIRECTORY(version_dentry, "module_%02d", ddb->module_id);
-	struct dentry *block_dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
-	block_dentry->size = this_block_size;
-	block_dentry->mode = S_IFREG | 0444;
-	block_dentry->obj_type = OBJ_TYPE_FILE;
-	block_dentry->contents = malloc(this_block_size);
-	memcpy(block_dentry->contents, &payload[this_block_start], this_block_size);
-	asprintf(&block_dentry->name, "block_%02d.bin", ddb->block_number);
-	CREATE_COMMON(module_dir, block_dentry);
-	xattr_add(block_dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false);
+	/* Copy the block to the module buffer, which is exposed as a single file */
+	if (dii_module_store_block(dii, mod, ddb->block_number, &payload[this_block_start], this_block_size))
+		ddb_expose_module(version_dentry, mod);
+	if (dii_module_is_complete(mod))
+		dii_create_filesystem(header, dii, priv);
 	
 	if (current_ddb)
 		ddb_free(ddb);
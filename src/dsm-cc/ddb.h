@@ -24,4 +24,7 @@ int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		struct demuxfs_data *priv);
 void ddb_free(struct ddb_table *ddb);
 
+struct dii_module;
+void ddb_create_module_file(uint16_t pid, struct dii_module *mod, struct demuxfs_data *priv);
+
 #endif /* __ddb_h */
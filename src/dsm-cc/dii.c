@@ -31,6 +31,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "hash.h"
+#include "buffer.h"
 #include "fifo.h"
 #include "list.h"
 #include "ts.h"
@@ -38,7 +39,10 @@
 #include "tables/psi.h"
 #include "dsm-cc/dsmcc.h"
 #include "dsm-cc/dii.h"
+#include "dsm-cc/ddb.h"
 #include "dsm-cc/dsi.h"
+#include "dsm-cc/cache.h"
+#include "dsm-cc/carousel.h"
 #include "dsm-cc/descriptors/descriptors.h"
 
 void dii_free(struct dii_table *dii)
@@ -53,13 +57,18 @@ void dii_free(struct dii_table *dii)
 
 	/* Free the dii table structure */
 	if (dii->modules) {
-		for (i=0; i<dii->number_of_modules; ++i)
+		for (i=0; i<dii->number_of_modules; ++i) {
 			if (dii->modules[i].module_info) {
 				biop_free_module_info(dii->modules[i].module_info);
 				free(dii->modules[i].module_info);
 			}
+			free(dii->modules[i]._block_bitmap);
+			shared_buffer_put(dii->modules[i]._buffer);
+		}
 		free(dii->modules);
 	}
+	if (dii->_module_index)
+		hashtable_destroy(dii->_module_index, NULL);
 	if (dii->private_data_bytes)
 		free(dii->private_data_bytes);
 	
@@ -158,74 +167,196 @@ static uint32_t dii_expected_module_blocks(struct dii_table *dii, struct dii_mod
 	return block_count;
 }
 
-static bool dii_module_complete(struct dii_table *dii, int module, struct dentry *ddb_dentry)
+/**
+ * dii_get_current: returns the current DII announced in @pid, if any.
+ */
+struct dii_table *dii_get_current(uint16_t pid, struct demuxfs_data *priv)
+{
+	return hashtable_get(priv->psi_tables, (pid << 8) | TS_DII_TABLE_ID);
+}
+
+struct dii_module *dii_get_module(struct dii_table *dii, uint16_t module_id)
+{
+	return dii->_module_index ? hashtable_get(dii->_module_index, module_id) : NULL;
+}
+
+bool dii_module_has_block(struct dii_module *mod, uint16_t block_number)
 {
-	uint32_t i, num_blocks;
-	char mod_dir[64], block_dir[64];
-	struct dentry *mod_dentry, *block_dentry;
-	struct dii_module *mod = &dii->modules[module];
-
-	if (mod->module_size == 0)
-		return true;
-
-	sprintf(mod_dir, "/module_%02d", mod->module_id);
-	mod_dentry = fsutils_get_dentry(ddb_dentry, mod_dir);
-	if (! mod_dentry)
-		return false;
-
-	num_blocks = dii_expected_module_blocks(dii, mod);
-	for (i=0; i<num_blocks; ++i) {
-		sprintf(block_dir, "/block_%02d.bin", i);
-		block_dentry = fsutils_get_dentry(mod_dentry, block_dir);
-		if (! block_dentry)
-			return false;
+	return (mod->_block_bitmap[block_number >> 3] & (1 << (block_number & 7))) ? true : false;
+}
+
+/**
+ * dii_module_store_block: copies a DDB block to its place in the module buffer.
+ *
+ * Returns true if the block was the first one stored in a new module buffer.
+ */
+bool dii_module_store_block(struct dii_table *dii, struct dii_module *mod, uint16_t block_number,
+		const char *data, uint32_t size)
+{
+	uint32_t offset = block_number * dii->block_size;
+	bool new_buffer = false;
+
+	if (! mod->_buffer) {
+		mod->_buffer = shared_buffer_new(mod->module_size);
+		assert(mod->_buffer);
+		new_buffer = true;
+	}
+	if (offset + size > mod->module_size) {
+		TS_WARNING("block %d of module_%02d doesn't fit in the %d bytes announced by the DII", 
+			block_number, mod->module_id, mod->module_size);
+		size = offset < mod->module_size ? mod->module_size - offset : 0;
 	}
+	memcpy(&mod->_buffer->data[offset], data, size);
 
-	if (mod_dentry->size != mod->module_size)
-		TS_WARNING("%s has size %zd but it was expected to have %d", mod_dir, mod_dentry->size, mod->module_size);
+	mod->_block_bitmap[block_number >> 3] |= 1 << (block_number & 7);
+	mod->_blocks_received++;
+	if (dii_module_is_complete(mod))
+		dii->_modules_complete++;
+	return new_buffer;
+}
 
-	return true;
+bool dii_module_is_complete(struct dii_module *mod)
+{
+	return mod->_blocks_received == mod->_block_count;
 }
 
-static bool dii_download_complete(const struct ts_header *header, struct dii_table *dii, 
+static void dii_get_cache_key(uint16_t pid, struct dii_table *dii, struct dii_module *mod,
+		struct carousel_cache_key *key)
+{
+	key->pid = pid;
+	key->download_id = dii->download_id;
+	key->module_id = mod->module_id;
+	key->module_version = mod->module_version;
+	key->module_size = mod->module_size;
+	key->has_crc_32 = mod->module_info && mod->module_info->has_crc_32;
+	key->crc_32 = key->has_crc_32 ? mod->module_info->crc_32 : 0;
+}
+
+/**
+ * dii_create_modules: sizes the block bitmap of each module from the DII. Modules which
+ * @current_dii already announced with the same version keep the blocks received so far.
+ */
+static void dii_create_modules(uint16_t pid, struct dii_table *dii, struct dii_table *current_dii,
 		struct demuxfs_data *priv)
 {
-	char buf[PATH_MAX];
-	struct dentry *ddb_dentry;
-	
-	snprintf(buf, sizeof(buf), "/%s/%#04x", FS_DDB_NAME, header->pid);
-	ddb_dentry = fsutils_get_dentry(priv->root, buf);
-	if (! ddb_dentry)
-		return false;
+	unsigned int bitmap_bits;
 
-	ddb_dentry = fsutils_get_current(ddb_dentry);
-	assert(ddb_dentry);
+	dii->_module_index = hashtable_new(dii->number_of_modules * 2 + 1);
+
+	for (uint16_t i=0; i<dii->number_of_modules; ++i) {
+		struct dii_module *mod = &dii->modules[i];
+		struct dii_module *current_mod = current_dii ? dii_get_module(current_dii, mod->module_id) : NULL;
+
+		hashtable_add(dii->_module_index, mod->module_id, mod, NULL);
+		if (current_mod && current_mod->module_version == mod->module_version &&
+			current_mod->module_size == mod->module_size && current_dii->block_size == dii->block_size) {
+			mod->_block_count = current_mod->_block_count;
+			mod->_blocks_received = current_mod->_blocks_received;
+			mod->_block_bitmap = current_mod->_block_bitmap;
+			mod->_buffer = current_mod->_buffer;
+			current_mod->_block_bitmap = NULL;
+			current_mod->_buffer = NULL;
+			continue;
+		}
+
+		/* block_number is a 16-bit field, so larger modules never complete */
+		mod->_block_count = dii_expected_module_blocks(dii, mod);
+		bitmap_bits = mod->_block_count > UINT16_MAX ? UINT16_MAX + 1 : mod->_block_count;
+		mod->_block_bitmap = calloc(bitmap_bits / 8 + 1, sizeof(uint8_t));
+		assert(mod->_block_bitmap);
+	}
 
 	for (uint16_t i=0; i<dii->number_of_modules; ++i)
-		if (! dii_module_complete(dii, i, ddb_dentry))
-			return false;
+		if (dii_module_is_complete(&dii->modules[i]))
+			dii->_modules_complete++;
+}
 
-	return true;
+/* Modules which may be complete in the module cache: not carried over and small enough to complete */
+static bool dii_module_is_cacheable(struct dii_module *mod)
+{
+	return mod->module_size && mod->_blocks_received == 0 && mod->_block_count <= UINT16_MAX + 1;
 }
 
-int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii, 
-	struct demuxfs_data *priv)
+/**
+ * dii_lookup_cached_modules: asks the carousel thread to look the modules of @dii which
+ * start from scratch up in the module cache. Reading and checking them is left to that
+ * thread, as large modules would hold up the parser for a while.
+ */
+static void dii_lookup_cached_modules(uint16_t pid, struct dii_table *dii, struct demuxfs_data *priv)
 {
-	char buf[PATH_MAX], mod_dir[64], block_dir[64];
-	struct dentry *ddb_dentry, *dsmcc_dentry, *ait_dentry, *app_dentry = NULL;
+	struct carousel_job *job;
+	uint16_t count = 0, n = 0;
 
-	dprintf("*** Creating filesystem for PID %#x ***", header->pid);
-	dii->_filesystem_created = true;
-	
-	snprintf(buf, sizeof(buf), "/%s/%#04x", FS_DDB_NAME, header->pid);
-	ddb_dentry = fsutils_get_dentry(priv->root, buf);
-	assert(ddb_dentry);
+	for (uint16_t i=0; i<dii->number_of_modules; ++i)
+		if (dii_module_is_cacheable(&dii->modules[i]))
+			count++;
+	if (! count)
+		return;
+
+	job = carousel_job_new(pid, "", count);
+	if (! job)
+		return;
+	job->cache_lookup = true;
+	for (uint16_t i=0; i<dii->number_of_modules; ++i) {
+		struct dii_module *mod = &dii->modules[i];
+		if (dii_module_is_cacheable(mod)) {
+			job->modules[n].module_id = mod->module_id;
+			dii_get_cache_key(pid, dii, mod, &job->modules[n].cache_key);
+			n++;
+		}
+	}
+	carousel_submit(job, priv);
+}
+
+/**
+ * dii_install_cached_modules: completes the modules of the current DII which a cache
+ * lookup job found in the module cache, and publishes them. The DII may have changed
+ * or the modules may have completed from DDBs since the lookup was queued, in which
+ * case the cached copies are dropped. Must be called with the parser mutex held.
+ */
+void dii_install_cached_modules(struct carousel_job *job, struct demuxfs_data *priv)
+{
+	struct dii_table *dii = dii_get_current(job->pid, priv);
+	struct ts_header header = { .pid = job->pid };
+	struct carousel_cache_key key;
+	bool installed = false;
+
+	for (uint16_t i=0; dii && i<job->number_of_modules; ++i) {
+		struct carousel_module *cached = &job->modules[i];
+		struct dii_module *mod = dii_get_module(dii, cached->module_id);
+		if (! cached->buffer || ! mod || dii_module_is_complete(mod))
+			continue;
+		dii_get_cache_key(job->pid, dii, mod, &key);
+		if (! carousel_cache_same_key(&key, &cached->cache_key))
+			continue;
 
-	ddb_dentry = fsutils_get_current(ddb_dentry);
-	assert(ddb_dentry);
+		dprintf("module %#x version %d loaded from the cache", mod->module_id, mod->module_version);
+		if (mod->_buffer)
+			shared_buffer_put(mod->_buffer);
+		mod->_buffer = shared_buffer_get(cached->buffer);
+		memset(mod->_block_bitmap, 0xff, mod->_block_count / 8 + 1);
+		mod->_blocks_received = mod->_block_count;
+		dii->_modules_complete++;
+		ddb_create_module_file(job->pid, mod, priv);
+		installed = true;
+	}
+
+	if (installed)
+		dii_create_filesystem(&header, dii, priv);
+}
 
-	dsmcc_dentry = CREATE_DIRECTORY(priv->root, FS_DSMCC_NAME);
-	assert(dsmcc_dentry);
+/**
+ * dii_create_filesystem: hands the modules completed so far over to the carousel thread.
+ * It is called each time a module is completed, so that the objects it holds show up
+ * under /DSM-CC without waiting for the rest of the carousel.
+ */
+int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii, 
+	struct demuxfs_data *priv)
+{
+	char buf[PATH_MAX];
+	const char *app_name = FS_UNNAMED_APPLICATION_NAME;
+	struct dentry *ait_dentry;
+	struct carousel_job *job;
 
 	/* Try to get the application name from the AIT */
 	snprintf(buf, sizeof(buf), "/%s", FS_AIT_NAME);
@@ -242,56 +373,32 @@ int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii,
 				sprintf(buf, "/Application_Name_Descriptor/Application_Name_%02d/application_name", i);
 				ait_dentry = fsutils_get_dentry(ait_dentry, buf);
 				if (ait_dentry) {
-					app_dentry = CREATE_DIRECTORY(dsmcc_dentry, "%s", ait_dentry->contents);
+					app_name = ait_dentry->contents;
 					break;
 				}
 			}
 		}
 	}
-	if (! app_dentry)
-		app_dentry = CREATE_DIRECTORY(dsmcc_dentry, FS_UNNAMED_APPLICATION_NAME);
 
-	/* For each module, get all of its blocks and expose their virtual filesystem */
-	struct dentry stepfather_dentry;
-	memset(&stepfather_dentry, 0, sizeof(stepfather_dentry));
-	INIT_LIST_HEAD(&stepfather_dentry.children);
+	job = carousel_job_new(header->pid, app_name, dii->number_of_modules);
+	if (! job)
+		return -ENOMEM;
+	job->complete = dii->_modules_complete == dii->number_of_modules;
 
+	/* The modules have been assembled in place; BIOP parsing is left to the carousel thread */
 	for (uint16_t i=0; i<dii->number_of_modules; ++i) {
-		struct dentry *mod_dentry, *block_dentry;
 		struct dii_module *mod = &dii->modules[i];
-
-		if (mod->module_size == 0)
-			continue;
-
-		sprintf(mod_dir, "/module_%02d", mod->module_id);
-		mod_dentry = fsutils_get_dentry(ddb_dentry, mod_dir);
-		assert(mod_dentry);
-		
-		uint32_t block_count = dii_expected_module_blocks(dii, mod);
-		uint32_t blocks_parsed = 0;
-
-		char *download_data = malloc(mod->module_size);
-		char *download_ptr = download_data;
-		assert(download_data);
-
-		for (uint16_t b=0; b < UINT16_MAX && blocks_parsed < block_count; ++b) {
-			sprintf(block_dir, "/block_%02d.bin", b);
-			block_dentry = fsutils_get_dentry(mod_dentry, block_dir);
-			if (! block_dentry)
-				continue;
-			memcpy(download_ptr, block_dentry->contents, block_dentry->size);
-			download_ptr += block_dentry->size;
-			blocks_parsed++;
+		job->modules[i].module_id = mod->module_id;
+		dii_get_cache_key(header->pid, dii, mod, &job->modules[i].cache_key);
+		if (mod->_buffer && dii_module_is_complete(mod))
+			job->modules[i].buffer = shared_buffer_get(mod->_buffer);
+		if (mod->module_info && mod->module_info->compressed_module) {
+			job->modules[i].compressed = true;
+			job->modules[i].compressed_module = *mod->module_info->compressed_module;
 		}
-
-		/* Parse blocks and create filesystem entries */
-		uint32_t download_len = download_ptr-download_data+1;
-		biop_create_filesystem_dentries(app_dentry, &stepfather_dentry, 
-			download_data, download_len);
-		free(download_data);
 	}
-	biop_reparent_orphaned_dentries(app_dentry, &stepfather_dentry);
 
+	carousel_submit(job, priv);
 	return 0;
 }
 
@@ -348,8 +455,6 @@ int dii_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	current_dii = hashtable_get(priv->psi_tables, dii->dentry->inode);
 	if (! dii->current_next_indicator || (current_dii && current_dii->version_number == dii->version_number)) {
 		dii_free(dii);
-		if (current_dii && !current_dii->_filesystem_created && dii_download_complete(header, current_dii, priv))
-			dii_create_filesystem(header, current_dii, priv);
 		return 0;
 	}
 
@@ -406,16 +511,19 @@ int dii_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	}
 	j += 2 + dii->private_data_length;
 
+	dii_create_modules(header->pid, dii, current_dii, priv);
+
 	/* Create filesystem entries for this table */
 	struct dentry *version_dentry = NULL;
 	dii_create_directory(header, dii, &version_dentry, priv);
 	dii_create_dentries(version_dentry, dii, priv);
 
-	if (current_dii) {
-		fsutils_migrate_children(current_dii->dentry, dii->dentry);
-		hashtable_del(priv->psi_tables, current_dii->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, dii->dentry->inode, dii, (hashtable_free_function_t) dii_free);
+	psi_replace_table(current_dii, dii, (hashtable_free_function_t) dii_free, priv);
+
+	/* Modules carried over from the previous version are published right away */
+	if (dii->_modules_complete)
+		dii_create_filesystem(header, dii, priv);
+	dii_lookup_cached_modules(header->pid, dii, priv);
 
 	return 0;
 }
@@ -12,6 +12,12 @@ struct dii_module {
 	uint8_t module_version;
 	uint8_t module_info_length;
 	struct biop_module_info *module_info;
+	/* DDB blocks of this module_version received so far, one bit per block_number */
+	uint32_t _block_count;
+	uint32_t _blocks_received;
+	uint8_t *_block_bitmap;
+	/* Module contents, assembled in place and shared with its module_NN.bin file */
+	struct shared_buffer *_buffer;
 };
 
 struct dii_table {
@@ -32,12 +38,25 @@ struct dii_table {
 	struct dii_module *modules;
 	uint16_t private_data_length;
 	char *private_data_bytes;
-	bool _filesystem_created;
+	struct hash_table *_module_index;
+	/* Modules whose blocks have all been received */
+	uint16_t _modules_complete;
 	uint32_t crc;
 } __attribute__((__packed__));
 
 int dii_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
 void dii_free(struct dii_table *dii);
+struct dii_table *dii_get_current(uint16_t pid, struct demuxfs_data *priv);
+struct dii_module *dii_get_module(struct dii_table *dii, uint16_t module_id);
+bool dii_module_has_block(struct dii_module *mod, uint16_t block_number);
+bool dii_module_store_block(struct dii_table *dii, struct dii_module *mod, uint16_t block_number,
+		const char *data, uint32_t size);
+bool dii_module_is_complete(struct dii_module *mod);
+int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii,
+		struct demuxfs_data *priv);
+
+struct carousel_job;
+void dii_install_cached_modules(struct carousel_job *job, struct demuxfs_data *priv);
 
 #endif /* __dii_h */
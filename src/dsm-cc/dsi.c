@@ -376,11 +376,7 @@ int dsi_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		}
 		j += 2 + sgi->user_info_length;
 	}
-	if (current_dsi) {
-		fsutils_migrate_children(current_dsi->dentry, dsi->dentry);
-		hashtable_del(priv->psi_tables, current_dsi->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, dsi->dentry->inode, dsi, (hashtable_free_function_t) dsi_free);
+	psi_replace_table(current_dsi, dsi, (hashtable_free_function_t) dsi_free, priv);
 
 	return 0;
 }
@@ -29,12 +29,54 @@
 #include "demuxfs.h"
 #include "fifo.h"
 #include "ts.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/* Bytes which may be waiting for a slow FIFO reader before new data is dropped */
+#define FIFO_QUEUE_SIZE (1024 * 1024)
+
+/* How long an output thread waits for its FIFOs to become writable before checking them again */
+#define FIFO_POLL_TIMEOUT_MSEC 100
+
+/* Minimum interval between two reports of data dropped from the same FIFO */
+#define FIFO_DROP_REPORT_SEC 5
+
+/**
+ * Output threads write the data queued to the FIFOs, so that the parser thread
+ * never waits for their readers. Each FIFO is served by a single thread.
+ * @pending: FIFOs with queued data
+ * @wake_fd: eventfd which interrupts poll() when a FIFO is added to @pending
+ */
+struct fifo_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head pending;
+	int wake_fd;
+	bool stop;
+};
+
+static struct fifo_worker *fifo_workers;
+static int fifo_worker_count;
+static int fifo_next_worker;
 
 struct fifo {
 	pthread_mutex_t mutex;
 	bool flushed;
 	char *path;
 	int fd;
+	/* Circular queue of data not yet written to @fd, protected by @mutex */
+	char *queue;
+	size_t queue_head;
+	size_t queue_len;
+	/* Bytes dropped because the reader lagged behind, and when that was last reported */
+	uint64_t dropped;
+	time_t dropped_reported;
+	/* Output thread state, protected by the worker's mutex */
+	struct fifo_worker *worker;
+	struct list_head pending;
+	bool queued;
+	bool busy;
 };
 
 struct fifo *fifo_init()
@@ -45,18 +87,37 @@ struct fifo *fifo_init()
 		fifo->flushed = true;
 		fifo->path = NULL;
 		fifo->fd = -1;
+		INIT_LIST_HEAD(&fifo->pending);
+		if (fifo_worker_count)
+			fifo->worker = &fifo_workers[fifo_next_worker++ % fifo_worker_count];
 	}
 	return fifo;
 }
 
 void fifo_destroy(struct fifo *fifo)
 {
+	struct fifo_worker *worker = fifo ? fifo->worker : NULL;
+
+	if (worker) {
+		/* Wait for the output thread to let go of this FIFO */
+		pthread_mutex_lock(&worker->mutex);
+		if (fifo->queued)
+			list_del(&fifo->pending);
+		fifo->queued = false;
+		while (fifo->busy)
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+		pthread_mutex_unlock(&worker->mutex);
+	}
 	if (fifo) {
+		if (fifo->dropped)
+			TS_WARNING("%s: dropped %llu bytes which the reader didn't consume in time",
+				fifo->path, (unsigned long long) fifo->dropped);
 		pthread_mutex_destroy(&fifo->mutex);
 		if (fifo->path)
 			free(fifo->path);
 		if (fifo->fd > 0)
 			close(fifo->fd);
+		free(fifo->queue);
 		free(fifo);
 	}
 }
@@ -73,9 +134,14 @@ int fifo_get_type()
 
 bool fifo_is_open(struct fifo *fifo)
 {
+	bool is_open;
+
+	pthread_mutex_lock(&fifo->mutex);
 	if (fifo->fd < 0)
 		fifo->fd = open(fifo->path, O_WRONLY | O_NONBLOCK);
-	return fifo->fd >= 0;
+	is_open = fifo->fd >= 0;
+	pthread_mutex_unlock(&fifo->mutex);
+	return is_open;
 }
 
 int fifo_set_path(struct fifo *fifo, char *path)
@@ -89,10 +155,232 @@ const char *fifo_get_path(struct fifo *fifo)
 	return fifo->path;
 }
 
+/* Forgets about the reader. Called with the FIFO mutex held. */
+static void fifo_close(struct fifo *fifo)
+{
+	close(fifo->fd);
+	fifo->fd = -1;
+	fifo->flushed = true;
+	fifo->queue_head = fifo->queue_len = 0;
+}
+
+/**
+ * fifo_write_queue: writes as much of the queued data as the reader takes.
+ * Called by the output thread, which owns the head of the queue while @busy is set.
+ */
+static void fifo_write_queue(struct fifo *fifo)
+{
+	size_t head, len;
+	ssize_t ret = 0;
+	int fd;
+
+	pthread_mutex_lock(&fifo->mutex);
+	head = fifo->queue_head;
+	len = fifo->queue_len;
+	fd = fifo->fd;
+	pthread_mutex_unlock(&fifo->mutex);
+
+	while (len && fd >= 0) {
+		/* The parser thread only appends past the queued data, so it's safe to write it unlocked */
+		size_t chunk = head + len > FIFO_QUEUE_SIZE ? FIFO_QUEUE_SIZE - head : len;
+		ret = write(fd, &fifo->queue[head], chunk);
+		if (ret <= 0)
+			break;
+		head = (head + ret) % FIFO_QUEUE_SIZE;
+		len -= ret;
+
+		pthread_mutex_lock(&fifo->mutex);
+		fifo->queue_head = head;
+		fifo->queue_len -= ret;
+		fifo->flushed = false;
+		pthread_mutex_unlock(&fifo->mutex);
+	}
+
+	if (ret < 0 && errno != EAGAIN) {
+		pthread_mutex_lock(&fifo->mutex);
+		if (fifo->fd >= 0)
+			fifo_close(fifo);
+		pthread_mutex_unlock(&fifo->mutex);
+	}
+}
+
+static void *fifo_worker_thread(void *userdata)
+{
+	struct fifo_worker *worker = (struct fifo_worker *) userdata;
+	struct pollfd *fds = NULL;
+	struct fifo **fifos = NULL, *fifo;
+	int i, n, allocated = 0;
+	uint64_t counter;
+
+	pthread_mutex_lock(&worker->mutex);
+	while (! worker->stop) {
+		if (list_empty(&worker->pending)) {
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+			continue;
+		}
+
+		/* Claim the pending FIFOs; fifo_destroy() waits for them while they're busy */
+		n = 0;
+		list_for_each_entry(fifo, &worker->pending, pending) {
+			if (n + 1 >= allocated) {
+				allocated = allocated ? allocated * 2 : 16;
+				fds = realloc(fds, allocated * sizeof(struct pollfd));
+				fifos = realloc(fifos, allocated * sizeof(struct fifo *));
+				assert(fds && fifos);
+			}
+			pthread_mutex_lock(&fifo->mutex);
+			fds[n].fd = fifo->fd;
+			pthread_mutex_unlock(&fifo->mutex);
+			fds[n].events = POLLOUT;
+			fds[n].revents = 0;
+			fifo->busy = true;
+			fifos[n++] = fifo;
+		}
+		fds[n].fd = worker->wake_fd;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+		pthread_mutex_unlock(&worker->mutex);
+
+		poll(fds, n + 1, FIFO_POLL_TIMEOUT_MSEC);
+		if (fds[n].revents & POLLIN)
+			read(worker->wake_fd, &counter, sizeof(counter));
+
+		for (i=0; i<n; ++i) {
+			/* FIFOs whose reader went away (fd < 0) get their queue dropped */
+			if (fds[i].revents || fds[i].fd < 0)
+				fifo_write_queue(fifos[i]);
+		}
+
+		pthread_mutex_lock(&worker->mutex);
+		for (i=0; i<n; ++i) {
+			fifo = fifos[i];
+			pthread_mutex_lock(&fifo->mutex);
+			if (fifo->queued && (fifo->fd < 0 || fifo->queue_len == 0)) {
+				list_del(&fifo->pending);
+				fifo->queued = false;
+			}
+			pthread_mutex_unlock(&fifo->mutex);
+			fifo->busy = false;
+		}
+		pthread_cond_broadcast(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->mutex);
+
+	free(fds);
+	free(fifos);
+	return NULL;
+}
+
+int fifo_start_workers(int count)
+{
+	int i, err;
+
+	fifo_workers = (struct fifo_worker *) calloc(count, sizeof(struct fifo_worker));
+	if (! fifo_workers)
+		return -ENOMEM;
+
+	for (i=0; i<count; ++i) {
+		struct fifo_worker *worker = &fifo_workers[i];
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		INIT_LIST_HEAD(&worker->pending);
+		worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+		err = worker->wake_fd < 0 ? errno : pthread_create(&worker->thread, NULL, fifo_worker_thread, worker);
+		if (err) {
+			if (worker->wake_fd >= 0)
+				close(worker->wake_fd);
+			fifo_worker_count = i;
+			fifo_stop_workers();
+			return -err;
+		}
+	}
+	fifo_worker_count = count;
+	return 0;
+}
+
+void fifo_stop_workers(void)
+{
+	int i;
+
+	for (i=0; i<fifo_worker_count; ++i) {
+		struct fifo_worker *worker = &fifo_workers[i];
+		pthread_mutex_lock(&worker->mutex);
+		worker->stop = true;
+		pthread_cond_broadcast(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+		pthread_join(worker->thread, NULL);
+		close(worker->wake_fd);
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+	}
+	free(fifo_workers);
+	fifo_workers = NULL;
+	fifo_worker_count = 0;
+}
+
+/**
+ * fifo_queue: copies @data to the queue of the FIFO and hands it to its output thread.
+ */
+static int fifo_queue(struct fifo *fifo, const char *data, uint32_t size)
+{
+	struct fifo_worker *worker = fifo->worker;
+	uint64_t one = 1, dropped;
+	size_t tail, chunk;
+	bool wake = false;
+	time_t now;
+
+	pthread_mutex_lock(&fifo->mutex);
+	if (! fifo->queue)
+		fifo->queue = malloc(FIFO_QUEUE_SIZE);
+	if (! fifo->queue || fifo->fd < 0) {
+		pthread_mutex_unlock(&fifo->mutex);
+		return fifo->queue ? 0 : -ENOMEM;
+	}
+	if (fifo->queue_len + size > FIFO_QUEUE_SIZE) {
+		/* The reader is lagging behind: drop the new data rather than stalling the parser */
+		fifo->dropped += size;
+		dropped = fifo->dropped;
+		now = time(NULL);
+		if (now - fifo->dropped_reported < FIFO_DROP_REPORT_SEC) {
+			pthread_mutex_unlock(&fifo->mutex);
+			return 0;
+		}
+		fifo->dropped_reported = now;
+		pthread_mutex_unlock(&fifo->mutex);
+		TS_WARNING("%s: reader is lagging behind, %llu bytes dropped so far",
+			fifo->path, (unsigned long long) dropped);
+		return 0;
+	}
+	tail = (fifo->queue_head + fifo->queue_len) % FIFO_QUEUE_SIZE;
+	chunk = tail + size > FIFO_QUEUE_SIZE ? FIFO_QUEUE_SIZE - tail : size;
+	memcpy(&fifo->queue[tail], data, chunk);
+	memcpy(fifo->queue, &data[chunk], size - chunk);
+	fifo->queue_len += size;
+	pthread_mutex_unlock(&fifo->mutex);
+
+	pthread_mutex_lock(&worker->mutex);
+	if (! fifo->queued) {
+		list_add_tail(&fifo->pending, &worker->pending);
+		fifo->queued = true;
+		wake = true;
+	}
+	pthread_mutex_unlock(&worker->mutex);
+
+	if (wake) {
+		pthread_cond_broadcast(&worker->cond);
+		write(worker->wake_fd, &one, sizeof(one));
+	}
+	return 0;
+}
+
 int fifo_append(struct fifo *fifo, const char *data, uint32_t size)
 {
 	int err, ret;
-	
+
+	if (fifo->worker)
+		return fifo_queue(fifo, data, size);
+
+	/* No output threads: write synchronously */
 	do {
 		ret = write(fifo->fd, data, size);
 		err = ret < 0 ? errno : 0;
@@ -70,8 +70,25 @@ bool fifo_is_open(struct fifo *fifo);
  * @data: data that's being appended to the FIFO.
  * @size: @data length.
  *
+ * The data is queued to the FIFO's output thread, if any, and dropped if the
+ * reader is too far behind, which is reported every few seconds while it lasts.
  * Returns 0 on success or a negative value on error.
  */
 int fifo_append(struct fifo *fifo, const char *data, uint32_t size);
 
+/**
+ * fifo_start_workers - Starts the threads which write the data appended to the FIFOs.
+ *
+ * @count: number of threads. FIFOs created afterwards are spread amongst them.
+ *
+ * Returns 0 on success or a negative value on error. Without output threads,
+ * fifo_append() writes synchronously.
+ */
+int fifo_start_workers(int count);
+
+/**
+ * fifo_stop_workers - Stops the output threads. All FIFOs must have been destroyed.
+ */
+void fifo_stop_workers(void);
+
 #endif /* __fifo_h */
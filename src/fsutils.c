@@ -31,6 +31,7 @@
 #include "buffer.h"
 #include "xattr.h"
 #include "fifo.h"
+#include "tables/epg.h"
 
 static void _fsutils_dump_tree(struct dentry *dentry, int spaces);
 
@@ -166,6 +167,15 @@ void fsutils_dispose_node(struct dentry *dentry)
 				free(priv);
 				break;
 			}
+			case OBJ_TYPE_EPG:
+				epg_service_put((struct epg_service *) dentry->priv);
+				break;
+			case OBJ_TYPE_SLICE: {
+				/* The contents belong to the shared buffer */
+				shared_buffer_put((struct shared_buffer *) dentry->priv);
+				dentry->contents = NULL;
+				break;
+			}
 		}
 	}
 
@@ -201,6 +211,35 @@ void fsutils_dispose_tree(struct dentry *dentry)
 	fsutils_dispose_node(dentry);
 }
 
+/**
+ * Unlink a tree whose files may be held open. Nodes which aren't open are disposed
+ * of right away, the others are left for their last release to dispose of.
+ * @dentry: starting point
+ */
+void fsutils_retire_tree(struct dentry *dentry)
+{
+	struct dentry *ptr, *aux;
+
+	if (! dentry)
+		return;
+
+	if (dentry->mode & S_IFDIR)
+		list_for_each_entry_safe(ptr, aux, &dentry->children, list)
+			fsutils_retire_tree(ptr);
+
+	pthread_mutex_lock(&dentry->mutex);
+	if (dentry->refcount) {
+		if (! list_poisoned(&dentry->list))
+			list_del(&dentry->list);
+		dentry->parent = NULL;
+		dentry->retired = true;
+		pthread_mutex_unlock(&dentry->mutex);
+		return;
+	}
+	pthread_mutex_unlock(&dentry->mutex);
+	fsutils_dispose_node(dentry);
+}
+
 /**
  * Migrate children from 'source' to 'target'. Children whose dentry names
  * are already contained within 'target' are skipped. The moved dentries will
@@ -53,6 +53,7 @@
 #define FS_BIOP_OBJECT_LOCATION_DIRNAME             "biopObjectLocation"
 #define FS_BIOP_CONNBINDER_DIRNAME                  "biopConnBinder"
 #define FS_BIOP_MODULE_INFO_DIRNAME                 "biopModuleInfo"
+#define FS_BIOP_COMPRESSED_MODULE_DIRNAME           "compressedModuleDescriptor"
 
 char *fsutils_path_walk(struct dentry *dentry, char *buf, size_t size);
 char *fsutils_realpath(struct dentry *dentry, char *buf, size_t size, struct demuxfs_data *priv);
@@ -65,6 +66,7 @@ struct dentry *fsutils_create_dentry(const char *path, mode_t mode);
 struct dentry *fsutils_create_version_dir(struct dentry *parent, int version);
 void fsutils_dispose_tree(struct dentry *dentry);
 void fsutils_dispose_node(struct dentry *dentry);
+void fsutils_retire_tree(struct dentry *dentry);
 void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 
 /* Macros to ease the creation of files and directories */
@@ -179,26 +181,40 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 	 	_dentry; \
 	})
 
-#define CREATE_SIMPLE_FILE(_parent,_name,_size,_inode) \
+#define UPDATE_SLICE(_dentry,_shared,_offset,_size) \
+	do { \
+		struct shared_buffer *_old_shared = DEMUXFS_IS_SLICE(_dentry) ? (_dentry)->priv : NULL; \
+		pthread_mutex_lock(&(_dentry)->mutex); \
+		if (! _old_shared) \
+			free((_dentry)->contents); \
+		(_dentry)->priv = shared_buffer_get(_shared); \
+		(_dentry)->obj_type = OBJ_TYPE_SLICE; \
+		(_dentry)->contents = &(_shared)->data[_offset]; \
+		(_dentry)->parent->size -= (_dentry)->size; \
+		(_dentry)->parent->size += _size; \
+		(_dentry)->size = _size; \
+		pthread_mutex_unlock(&(_dentry)->mutex); \
+		shared_buffer_put(_old_shared); \
+	} while (0)
+
+/* Creates a file whose contents are a slice of a shared buffer, rather than a copy of it */
+#define CREATE_SLICE_FILE(_parent,_name,_shared,_offset,_size) \
 	({ \
-	    struct dentry *_dentry = fsutils_find_by_inode(_parent, _inode); \
-	 	if (! _dentry) _dentry = fsutils_get_child(_parent, _name); \
-	 	if (! _dentry || _dentry->inode != _inode) { \
-	 		_dentry = (struct dentry *) calloc(1, sizeof(struct dentry)); \
-	 		_dentry->contents = _size ? malloc(_size) : NULL; \
+		struct dentry *_dentry = fsutils_get_child(_parent, _name); \
+		if (_dentry) { \
+			UPDATE_SLICE(_dentry, _shared, _offset, _size); \
+		} else { \
+			_dentry = (struct dentry *) calloc(1, sizeof(struct dentry)); \
+			_dentry->contents = &(_shared)->data[_offset]; \
+			_dentry->priv = shared_buffer_get(_shared); \
 			_dentry->name = strdup(_name); \
 			_dentry->size = _size; \
-	 		_dentry->inode = _inode; \
 			_dentry->mode = S_IFREG | 0444; \
-	 		_dentry->obj_type = OBJ_TYPE_FILE; \
+			_dentry->obj_type = OBJ_TYPE_SLICE; \
 			CREATE_COMMON((_parent),_dentry); \
-			if (! xattr_exists(_dentry, XATTR_FORMAT)) \
-				xattr_add(_dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false); \
-	 	} else { \
-	 		UPDATE_NAME(_dentry,_name); \
-	 		UPDATE_PARENT(_dentry,_parent); \
-	 	} \
-	 	_dentry; \
+			xattr_add(_dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false); \
+		} \
+		_dentry; \
 	})
 
 #define CREATE_SYMLINK(parent,sname,target) \
@@ -283,26 +299,4 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 	 	_dentry; \
 	})
 
-#define CREATE_SIMPLE_DIRECTORY(_parent,_dname,_inode) \
-	({ \
-	    struct dentry *_dentry = fsutils_find_by_inode(_parent, _inode); \
-	 	if (! _dentry) _dentry = fsutils_get_child(_parent, _dname); \
-	 	if (! _dentry || _dentry->inode != _inode) { \
-			_dentry = (struct dentry *) calloc(1, sizeof(struct dentry)); \
-			_dentry->name = strdup(_dname); \
-			_dentry->mode = S_IFDIR | 0555; \
-	 		_dentry->obj_type = OBJ_TYPE_DIR; \
-	 		_dentry->inode = _inode; \
-			CREATE_COMMON((_parent),_dentry); \
-	 	} else if (_dentry->parent != _parent) { \
-	 		/* Update parent */ \
-	 		list_del(&_dentry->list); \
-	 		if ((_dentry)->obj_type != OBJ_TYPE_FIFO) \
-	 			_parent->size += (_dentry)->size; \
-	 		(_dentry)->parent = _parent; \
-	 		list_add_tail(&(_dentry)->list, &((_parent)->children)); \
-	 	} \
-	 	_dentry; \
-	})
-
 #endif /* __fsutils_h */
@@ -80,6 +80,7 @@ void hashtable_invalidate_contents(struct hash_table *table)
 			table->items[i] = NULL;
 		}
 	}
+	table->count = 0;
 }
 
 void *hashtable_get(struct hash_table *table, ino_t key)
@@ -100,11 +101,22 @@ void *hashtable_get(struct hash_table *table, ino_t key)
 	return NULL;
 }
 
+/**
+ * hashtable_add: stores @data under @key, replacing what was stored there before. The
+ * table grows to stay at most half full, so that probe sequences stay short; like with
+ * hashtable_resize, no other thread may be accessing it meanwhile.
+ */
 bool hashtable_add(struct hash_table *table, ino_t key, void *data, hashtable_free_function_t free_function)
 {
-	int index = key % table->size;
-	struct hash_item *item = table->items[index];
-	struct hash_item *start = item;
+	int index;
+	struct hash_item *item, *start;
+
+	if ((table->count + 1) * 2 > table->size)
+		hashtable_resize(table, table->size * 2 + 1);
+
+	index = key % table->size;
+	item = table->items[index];
+	start = item;
 	do {
 		if (item == NULL) {
 			item = (struct hash_item *) calloc(1, sizeof(struct hash_item));
@@ -112,6 +124,7 @@ bool hashtable_add(struct hash_table *table, ino_t key, void *data, hashtable_fr
 			item->data = data;
 			item->free_function = free_function;
 			table->items[index] = item;
+			table->count++;
 			return true;
 		} else if (item->key == key) {
 			dprintf("overwriting previous contents (key=%#jx)", key);
@@ -136,6 +149,24 @@ void _hashtable_del_item(struct hash_item *item)
 	}
 }
 
+/**
+ * Items which follow a freed slot may have been placed there by linear probing. They are
+ * moved back as close as possible to their hash index so that lookups still reach them.
+ */
+static void _hashtable_rehash_cluster(struct hash_table *table, int index)
+{
+	index = (index+1) % table->size;
+	while (table->items[index]) {
+		struct hash_item *item = table->items[index];
+		int slot = item->key % table->size;
+		table->items[index] = NULL;
+		while (table->items[slot])
+			slot = (slot+1) % table->size;
+		table->items[slot] = item;
+		index = (index+1) % table->size;
+	}
+}
+
 bool hashtable_del(struct hash_table *table, ino_t key)
 {
 	int index = key % table->size;
@@ -147,6 +178,8 @@ bool hashtable_del(struct hash_table *table, ino_t key)
 		else if (item->key == key) {
 			_hashtable_del_item(item);
 			table->items[index] = NULL;
+			table->count--;
+			_hashtable_rehash_cluster(table, index);
 			return true;
 		} else {
 			index = (index+1) % table->size;
@@ -155,3 +188,32 @@ bool hashtable_del(struct hash_table *table, ino_t key)
 	} while (item != start);
 	return false;
 }
+
+/**
+ * hashtable_resize: redistributes the items of @table over @size slots. The caller must
+ * make sure that no other thread is accessing the table meanwhile.
+ */
+bool hashtable_resize(struct hash_table *table, int size)
+{
+	struct hash_item **items, **old_items = table->items;
+	int i, old_size = table->size;
+
+	if (size <= table->count)
+		return false;
+	items = (struct hash_item **) calloc(size, sizeof(struct hash_item *));
+	if (! items)
+		return false;
+	for (i=0; i<old_size; ++i) {
+		struct hash_item *item = old_items[i];
+		if (item) {
+			int index = item->key % size;
+			while (items[index])
+				index = (index+1) % size;
+			items[index] = item;
+		}
+	}
+	table->items = items;
+	table->size = size;
+	free(old_items);
+	return true;
+}
@@ -11,6 +11,7 @@ struct hash_item {
 
 struct hash_table {
 	int size;
+	int count;
 	pthread_mutex_t mutex;
 	struct hash_item **items;
 };
@@ -21,6 +22,7 @@ void hashtable_invalidate_contents(struct hash_table *table);
 void *hashtable_get(struct hash_table *table, ino_t key);
 bool hashtable_add(struct hash_table *table, ino_t key, void *data, hashtable_free_function_t free_function);
 bool hashtable_del(struct hash_table *table, ino_t key);
+bool hashtable_resize(struct hash_table *table, int size);
 void hashtable_lock(struct hash_table *hash);
 void hashtable_unlock(struct hash_table *hash);
 
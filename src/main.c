@@ -33,10 +33,14 @@
 #include "hash.h"
 #include "fifo.h"
 #include "ts.h"
+#include "ring.h"
 #include "backend.h"
 #include "snapshot.h"
 #include "tables/descriptors/descriptors.h"
 #include "dsm-cc/descriptors/descriptors.h"
+#include "dsm-cc/biop.h"
+#include "dsm-cc/cache.h"
+#include "dsm-cc/carousel.h"
 
 /* Defined in demuxfs.c */
 extern struct fuse_operations demuxfs_ops;
@@ -44,33 +48,223 @@ extern struct fuse_operations demuxfs_ops;
 /* Globals */
 static bool main_thread_stopped;
 
+/* How many packets are requested from the backend at once */
+#define TS_PARSER_BATCH_SIZE 64
+
+/* How many batches may be waiting for the parser thread, by default */
+#define TS_RING_DEFAULT_SIZE 128
+
+/* Longest wait of the ingest and parser threads for each other, before checking if they must quit */
+#define TS_RING_WAIT_MSEC 100
+
+/* How many threads write to the PES and ES FIFOs, by default */
+#define PES_DEFAULT_THREADS 1
+
+/* Upper limit of the pesthreads and psithreads options */
+#define MAX_WORKER_THREADS 32
+
+static bool ts_threads_stopped(struct demuxfs_data *priv)
+{
+	return main_thread_stopped || ring_is_stopped(priv->ring);
+}
+
 /**
- * ts_parser_thread: consumes transport stream packets from the input and processes them.
- * @userdata: private data
+ * ts_ingest_move: copies packet @src to @dst. Payloads which point to the
+ * packet's own data are moved along with it.
  */
-void * ts_parser_thread(void *userdata)
+static void ts_ingest_move(struct ts_packet *dst, const struct ts_packet *src)
 {
-	struct demuxfs_data *priv = (struct demuxfs_data *) userdata;
-	struct ts_header header;
+	const char *data = src->data;
+
+	if (src->payload < data || src->payload >= data + sizeof(src->data)) {
+		dst->header = src->header;
+		dst->payload = src->payload;
+	} else {
+		*dst = *src;
+		dst->payload = &dst->data[src->payload - data];
+	}
+}
+
+/**
+ * ts_ingest_read: reads up to @count packets from the backend. Backends may
+ * point the payloads to their own buffers, which they reuse on the next read,
+ * so unless those are flagged as stable each packet is moved into its own
+ * @data before being queued.
+ * @return the number of packets read or a negative errno value on errors.
+ */
+static int ts_ingest_read(struct ts_packet *packets, int count, struct demuxfs_data *priv)
+{
+	uint8_t packet_size = priv->options.packet_size;
 	void *payload = NULL;
-	int ret;
-    
-	while (priv->backend->keep_alive(priv) && !main_thread_stopped) {
+	int i, n, ret;
+
+	if (priv->backend->read_batch) {
+		n = priv->backend->read_batch(packets, count, priv);
+		if (priv->backend->flags & BACKEND_STABLE_PAYLOADS)
+			return n;
+		for (i=0; i<n; ++i) {
+			const char *data = packets[i].data;
+			if (packets[i].payload < data || packets[i].payload >= data + sizeof(packets[i].data)) {
+				/* The payload starts right after the 4-byte packet header */
+				memcpy(packets[i].data, packets[i].payload - 4, packet_size);
+				packets[i].payload = &packets[i].data[4];
+			}
+		}
+		return n;
+	}
+
+	for (n=0; n<count && priv->backend->keep_alive(priv) && ! ts_threads_stopped(priv); ) {
 		ret = priv->backend->read(priv);
-		if (ret < 0) {
-			if (ret != -ENODATA)
+		if (ret < 0)
+			return n ? n : ret;
+		ret = priv->backend->process(&packets[n].header, &payload, priv);
+		if (ret < 0)
+			continue;
+		memcpy(packets[n].data, (const char *) payload - 4, packet_size);
+		packets[n].payload = &packets[n].data[4];
+		n++;
+	}
+	return n;
+}
+
+/**
+ * ts_ingest_keep_psi: drops all packets but the ones of PIDs which carry PSI sections.
+ * @return the number of packets left in @packets.
+ */
+static int ts_ingest_keep_psi(struct ts_packet *packets, int count, struct demuxfs_data *priv)
+{
+	int i, n;
+
+	for (i=0, n=0; i<count; ++i) {
+		/* The parser thread may be flagging new PIDs meanwhile, which at worst drops a few more packets */
+		uint8_t flags = __atomic_load_n(&priv->pid_contexts[packets[i].header.pid].flags, __ATOMIC_RELAXED);
+		if (! (flags & PID_CARRIES_PSI))
+			continue;
+		if (n != i)
+			ts_ingest_move(&packets[n], &packets[i]);
+		n++;
+	}
+	priv->ring->dropped_packets += count - n;
+	return n;
+}
+
+/**
+ * ts_ingest_queue_spare: queues the @count PSI packets held in @spare to @slot.
+ */
+static void ts_ingest_queue_spare(struct ts_ring *ring, struct ts_batch *slot, struct ts_packet *spare, int count)
+{
+	int i;
+
+	for (i=0; i<count; ++i)
+		ts_ingest_move(&slot->packets[i], &spare[i]);
+	slot->count = count;
+	ring_publish(ring);
+}
+
+/**
+ * ts_ingest_thread: reads transport stream packets from the input and queues
+ * them to the parser thread, so that slow parsing doesn't hold up the input.
+ * With the DROPPES policy, the input keeps being drained while the ring is
+ * full: PSI packets are set aside in a spare batch and PES packets are
+ * dropped. The input only waits once the spare batch is full of PSI packets.
+ * @userdata: private data
+ */
+void * ts_ingest_thread(void *userdata)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) userdata;
+	struct ts_ring *ring = priv->ring;
+	struct ts_packet *spare = NULL;
+	struct ts_batch *slot;
+	int n, spare_count = 0;
+
+	if (priv->options.ring_policy == RING_POLICY_DROP_PES) {
+		spare = calloc(ring->batch_size, sizeof(struct ts_packet));
+		assert(spare);
+	}
+
+	while (priv->backend->keep_alive(priv) && ! ts_threads_stopped(priv)) {
+		slot = ring_get_free_slot(ring);
+		if (slot && spare_count) {
+			/* PSI packets set aside go first, so that sections are kept in order */
+			ts_ingest_queue_spare(ring, slot, spare, spare_count);
+			spare_count = 0;
+			continue;
+		}
+		if (! slot && (! spare || spare_count == ring->batch_size)) {
+			ring_wait_free_slot(ring, TS_RING_WAIT_MSEC);
+			continue;
+		}
+
+		if (slot)
+			n = ts_ingest_read(slot->packets, ring->batch_size, priv);
+		else
+			n = ts_ingest_read(&spare[spare_count], ring->batch_size - spare_count, priv);
+		if (n < 0) {
+			if (n != -ENODATA)
 				dprintf("read error");
 			break;
 		}
-		ret = priv->backend->process(&header, &payload, priv);
-		if (ret < 0)
+
+		if (! slot) {
+			/* The parser is lagging behind: keep draining the input, but hold on to PSI packets only */
+			spare_count += ts_ingest_keep_psi(&spare[spare_count], n, priv);
+		} else if (n) {
+			slot->count = n;
+			ring_publish(ring);
+		}
+	}
+
+	while (spare_count && ! ts_threads_stopped(priv)) {
+		slot = ring_get_free_slot(ring);
+		if (! slot) {
+			ring_wait_free_slot(ring, TS_RING_WAIT_MSEC);
 			continue;
-		ret = ts_parse_packet(&header, payload, priv);
-		if (ret < 0 && ret != -ENOBUFS) {
-			dprintf("Error processing packet: %s", strerror(-ret));
-			break;
 		}
+		ts_ingest_queue_spare(ring, slot, spare, spare_count);
+		spare_count = 0;
+	}
+
+	ring_set_eof(ring);
+	free(spare);
+	pthread_exit(NULL);
+}
+
+/**
+ * ts_parser_thread: consumes transport stream packets queued by the ingest thread and processes them.
+ * @userdata: private data
+ */
+void * ts_parser_thread(void *userdata)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) userdata;
+	struct ts_ring *ring = priv->ring;
+	struct ts_batch *batch;
+	int i, ret;
+
+	if (priv->options.psi_threads && ts_start_psi_workers(priv->options.psi_threads, priv) < 0)
+		dprintf("failed to start the PSI worker threads, parsing all sections in the parser thread");
+	pthread_create(&priv->ts_ingest_id, NULL, ts_ingest_thread, priv);
+	while (! main_thread_stopped) {
+		batch = ring_get_used_slot(ring);
+		if (! batch) {
+			if (ring_is_drained(ring))
+				break;
+			ring_wait_used_slot(ring, TS_RING_WAIT_MSEC);
+			continue;
+		}
+		for (i=0; i<batch->count; ++i) {
+			ret = ts_parse_packet(&batch->packets[i].header, batch->packets[i].payload, priv);
+			if (ret < 0 && ret != -ENOBUFS) {
+				dprintf("Error processing packet: %s", strerror(-ret));
+				goto out;
+			}
+		}
+		ring_release(ring);
+		ts_flush_psi_workers(priv);
 	}
+out:
+	ring_stop(ring);
+	pthread_join(priv->ts_ingest_id, NULL);
+	ts_stop_psi_workers(priv);
 	pthread_exit(NULL);
 }
 
@@ -97,15 +291,25 @@ void demuxfs_destroy(void *data)
 
 	main_thread_stopped = true;
 	pthread_join(priv->ts_parser_id, NULL);
+	carousel_stop_worker();
 
 	descriptors_destroy(priv->ts_descriptors);
 	dsmcc_descriptors_destroy(priv->dsmcc_descriptors);
-	hashtable_destroy(priv->pes_parsers, NULL);
-	hashtable_destroy(priv->psi_parsers, NULL);
-	hashtable_destroy(priv->pes_tables, NULL);
 	hashtable_destroy(priv->psi_tables, (hashtable_free_function_t) free);
-	hashtable_destroy(priv->packet_buffer, (hashtable_free_function_t) buffer_destroy);
+	hashtable_destroy(priv->psi_section_sets, NULL);
+	if (priv->section_cache_lookups)
+		TS_INFO("%llu of %llu sections were repeats, %.1f%% hit rate", 
+			(unsigned long long) priv->section_cache_hits,
+			(unsigned long long) priv->section_cache_lookups,
+			priv->section_cache_hits * 100.0 / priv->section_cache_lookups);
+	ts_destroy_pid_contexts(priv->pid_contexts);
+	buffer_pool_destroy();
+	TS_INFO("packet ring: high-water mark %u of %u batches, %llu packets dropped",
+		priv->ring->high_water, priv->ring->size, (unsigned long long) priv->ring->dropped_packets);
+	ring_destroy(priv->ring);
 	fsutils_dispose_tree(priv->root);
+	fifo_stop_workers();
+	pthread_mutex_destroy(&priv->parser_mutex);
 }
 
 /**
@@ -119,13 +323,18 @@ void * demuxfs_init(struct fuse_conn_info *conn)
 	avcodec_register_all();
 #endif
 	priv->psi_tables = hashtable_new(DEMUXFS_MAX_PIDS);
-	priv->pes_tables = hashtable_new(DEMUXFS_MAX_PIDS);
-	priv->psi_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
-	priv->pes_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
-	priv->packet_buffer = hashtable_new(DEMUXFS_MAX_PIDS);
+	priv->psi_section_sets = hashtable_new(DEMUXFS_MAX_PIDS);
+	priv->pid_contexts = ts_create_pid_contexts();
 	priv->ts_descriptors = descriptors_init(priv);
 	priv->dsmcc_descriptors = dsmcc_descriptors_init(priv);
 	priv->root = create_rootfs("/", priv);
+	pthread_mutex_init(&priv->parser_mutex, NULL);
+	priv->ring = ring_create(priv->options.ring_size, TS_PARSER_BATCH_SIZE);
+	assert(priv->ring);
+	if (priv->options.pes_threads && fifo_start_workers(priv->options.pes_threads) < 0)
+		dprintf("failed to start the FIFO output threads, writing to FIFOs synchronously");
+	if (carousel_start_worker(priv) < 0)
+		dprintf("failed to start the carousel thread, assembling carousels synchronously");
 	pthread_create(&priv->ts_parser_id, NULL, ts_parser_thread, priv);
 
 	return priv;
@@ -144,6 +353,11 @@ static struct fuse_opt demuxfs_options[] = {
 	DEMUXFS_OPT("standard=%s",  opt_standard, 0),
 	DEMUXFS_OPT("tmpdir=%s",    opt_tmpdir, 0),
 	DEMUXFS_OPT("report=%s",    opt_report, 0),
+	DEMUXFS_OPT("ringsize=%d",  opt_ring_size, 0),
+	DEMUXFS_OPT("ringpolicy=%s", opt_ring_policy, 0),
+	DEMUXFS_OPT("pesthreads=%d", opt_pes_threads, 0),
+	DEMUXFS_OPT("psithreads=%d", opt_psi_threads, 0),
+	DEMUXFS_OPT("carouselmem=%d", opt_carousel_memory, 0),
 	FUSE_OPT_KEY("-h",          KEY_HELP),
 	FUSE_OPT_KEY("--help",      KEY_HELP),
 	FUSE_OPT_END
@@ -156,8 +370,17 @@ static void demuxfs_usage(struct demuxfs_data *priv)
 			"    -o parse_pes=1|0       parse PES packets (default: 0)\n"
 			"    -o standard=TYPE       transmission type: SBTVD, ISDB, DVB or ATSC (default: SBTVD)\n"
 			"    -o tmpdir=DIR          temporary directory in which to store DSM-CC files (default: %s)\n"
-			"    -o report=MASK         colon-separated list of errors to report: NONE,CRC,CONTINUITY or ALL (default: NONE)\n",
-			FS_DEFAULT_TMPDIR);
+			"    -o report=MASK         colon-separated list of errors to report: NONE,CRC,CONTINUITY or ALL (default: NONE)\n"
+			"    -o ringsize=NUM        batches of %d packets queued between the input and the parser (default: %d)\n"
+			"    -o ringpolicy=POLICY   what to do once the queue is full: BLOCK the input or DROPPES to discard\n"
+			"                           all but PSI packets until the parser catches up (default: BLOCK)\n"
+			"    -o pesthreads=NUM      threads which feed the PES and ES FIFOs, 0 to feed them from the parser (default: %d).\n"
+			"                           With threads, data which a reader is more than 1 MiB behind on is dropped\n"
+			"                           (and reported); without them, a slow reader stalls the parser instead\n"
+			"    -o psithreads=NUM      threads which reassemble PSI sections, sharded by PID, 0 to do it in the parser (default: 0)\n"
+			"    -o carouselmem=MB      memory taken by DSM-CC modules before new ones are mapped from tmpdir (default: %d)\n",
+			FS_DEFAULT_TMPDIR, TS_PARSER_BATCH_SIZE, TS_RING_DEFAULT_SIZE, PES_DEFAULT_THREADS,
+			CAROUSEL_DEFAULT_MEMORY);
 	backend_print_usage();
 }
 
@@ -187,6 +410,8 @@ int main(int argc, char **argv)
 
 	/* Parse command line options */
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	priv->opt_pes_threads = PES_DEFAULT_THREADS;
+	priv->opt_carousel_memory = -1;
 	int ret = fuse_opt_parse(&args, priv, demuxfs_options, demuxfs_parse_options);
 	if (ret < 0)
 		goto out_free;
@@ -243,7 +468,46 @@ int main(int argc, char **argv)
 		free(opt_copy);
 	}
 
+	if (priv->opt_ring_size < 0 || priv->opt_ring_size > 65536) {
+		fprintf(stderr, "Invalid value '%d' for '-o ringsize'\n", priv->opt_ring_size);
+		ret = 1;
+		goto out_free;
+	}
+	priv->options.ring_size = priv->opt_ring_size ? priv->opt_ring_size : TS_RING_DEFAULT_SIZE;
+
+	if (priv->opt_pes_threads < 0 || priv->opt_pes_threads > MAX_WORKER_THREADS) {
+		fprintf(stderr, "Invalid value '%d' for '-o pesthreads'\n", priv->opt_pes_threads);
+		ret = 1;
+		goto out_free;
+	}
+	priv->options.pes_threads = priv->opt_pes_threads;
+
+	if (priv->opt_psi_threads < 0 || priv->opt_psi_threads > MAX_WORKER_THREADS) {
+		fprintf(stderr, "Invalid value '%d' for '-o psithreads'\n", priv->opt_psi_threads);
+		ret = 1;
+		goto out_free;
+	}
+	priv->options.psi_threads = priv->opt_psi_threads;
+
+	if (! priv->opt_ring_policy || ! strcasecmp(priv->opt_ring_policy, "BLOCK"))
+		priv->options.ring_policy = RING_POLICY_BLOCK;
+	else if (! strcasecmp(priv->opt_ring_policy, "DROPPES"))
+		priv->options.ring_policy = RING_POLICY_DROP_PES;
+	else {
+		fprintf(stderr, "Invalid value '%s' for '-o ringpolicy'\n", priv->opt_ring_policy);
+		ret = 1;
+		goto out_free;
+	}
+
 	priv->options.tmpdir = strdup(priv->opt_tmpdir ? priv->opt_tmpdir : FS_DEFAULT_TMPDIR);
+
+	if (priv->opt_carousel_memory < -1) {
+		fprintf(stderr, "Invalid value '%d' for '-o carouselmem'\n", priv->opt_carousel_memory);
+		ret = 1;
+		goto out_free;
+	}
+	priv->options.carousel_memory = priv->opt_carousel_memory < 0 ? CAROUSEL_DEFAULT_MEMORY : priv->opt_carousel_memory;
+	shared_buffer_set_spill((size_t) priv->options.carousel_memory << 20, priv->options.tmpdir);
 	priv->options.parse_pes = priv->opt_parse_pes;
 
 	/* Load the chosen backend */
@@ -0,0 +1,201 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "ring.h"
+#include <time.h>
+
+struct ts_ring *ring_create(uint32_t size, int batch_size)
+{
+	struct ts_ring *ring;
+	uint32_t i;
+
+	if (! size || batch_size <= 0)
+		return NULL;
+
+	ring = (struct ts_ring *) calloc(1, sizeof(struct ts_ring));
+	if (! ring)
+		return NULL;
+
+	ring->slots = (struct ts_batch *) calloc(size, sizeof(struct ts_batch));
+	if (! ring->slots) {
+		free(ring);
+		return NULL;
+	}
+	for (i=0; i<size; ++i) {
+		ring->slots[i].packets = (struct ts_packet *) calloc(batch_size, sizeof(struct ts_packet));
+		if (! ring->slots[i].packets) {
+			ring->size = i;
+			ring_destroy(ring);
+			return NULL;
+		}
+	}
+	ring->size = size;
+	ring->batch_size = batch_size;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return ring;
+}
+
+void ring_destroy(struct ts_ring *ring)
+{
+	uint32_t i;
+
+	if (ring) {
+		for (i=0; i<ring->size; ++i)
+			free(ring->slots[i].packets);
+		if (ring->batch_size) {
+			/* Only initialized once all slots have been allocated */
+			pthread_cond_destroy(&ring->cond);
+			pthread_mutex_destroy(&ring->mutex);
+		}
+		free(ring->slots);
+		free(ring);
+	}
+}
+
+/**
+ * ring_wait: sleeps on the ring until @ready holds, the other side wakes
+ * this one up or @msec milliseconds have passed.
+ */
+static void ring_wait(struct ts_ring *ring, bool *waiting, bool (*ready)(struct ts_ring *), int msec)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += msec / 1000;
+	deadline.tv_nsec += (msec % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ring->mutex);
+	__atomic_store_n(waiting, true, __ATOMIC_RELAXED);
+	/* Pairs with the fence in ring_wake(): either the other side sees the flag or we see its update */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (! ready(ring))
+		pthread_cond_timedwait(&ring->cond, &ring->mutex, &deadline);
+	__atomic_store_n(waiting, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/**
+ * ring_wake: wakes the other side up if it's sleeping on the ring. Called
+ * after publishing the update it waits for.
+ */
+static void ring_wake(struct ts_ring *ring, bool *waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&ring->mutex);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->mutex);
+	}
+}
+
+static bool ring_has_free_slot(struct ts_ring *ring)
+{
+	return ring_get_free_slot(ring) || ring_is_stopped(ring);
+}
+
+static bool ring_has_used_slot(struct ts_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail ||
+		__atomic_load_n(&ring->eof, __ATOMIC_ACQUIRE);
+}
+
+struct ts_batch *ring_get_free_slot(struct ts_ring *ring)
+{
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->head - tail == ring->size)
+		return NULL;
+	return &ring->slots[ring->head % ring->size];
+}
+
+void ring_publish(struct ts_ring *ring)
+{
+	uint64_t head = ring->head + 1;
+	uint32_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	if (used > ring->high_water)
+		ring->high_water = used;
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	ring_wake(ring, &ring->consumer_waiting);
+}
+
+void ring_wait_free_slot(struct ts_ring *ring, int msec)
+{
+	ring_wait(ring, &ring->producer_waiting, ring_has_free_slot, msec);
+}
+
+struct ts_batch *ring_get_used_slot(struct ts_ring *ring)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head == ring->tail)
+		return NULL;
+	return &ring->slots[ring->tail % ring->size];
+}
+
+void ring_release(struct ts_ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	ring_wake(ring, &ring->producer_waiting);
+}
+
+void ring_wait_used_slot(struct ts_ring *ring, int msec)
+{
+	ring_wait(ring, &ring->consumer_waiting, ring_has_used_slot, msec);
+}
+
+void ring_set_eof(struct ts_ring *ring)
+{
+	__atomic_store_n(&ring->eof, true, __ATOMIC_RELEASE);
+	ring_wake(ring, &ring->consumer_waiting);
+}
+
+bool ring_is_drained(struct ts_ring *ring)
+{
+	/* Check @eof first: the head is final once it's set */
+	if (! __atomic_load_n(&ring->eof, __ATOMIC_ACQUIRE))
+		return false;
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+void ring_stop(struct ts_ring *ring)
+{
+	__atomic_store_n(&ring->stopped, true, __ATOMIC_RELEASE);
+	ring_wake(ring, &ring->producer_waiting);
+}
+
+bool ring_is_stopped(struct ts_ring *ring)
+{
+	return __atomic_load_n(&ring->stopped, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,131 @@
+#ifndef __ring_h
+#define __ring_h
+
+#include "backend.h"
+
+/**
+ * A batch of packets. The payload of each packet points into its own @data,
+ * or into memory which the backend keeps until it's destroyed.
+ */
+struct ts_batch {
+	struct ts_packet *packets;
+	int count;
+};
+
+/**
+ * Single-producer, single-consumer ring of packet batches. @head is only
+ * written by the producer and @tail only by the consumer, so no locks are
+ * needed to hand batches over. Both are free-running counters; the slot is
+ * given by @size modulo. A side which finds the ring full (or empty) sleeps
+ * on @cond, and the other side only takes @mutex to wake it up once it has
+ * flagged itself as waiting.
+ */
+struct ts_ring {
+	struct ts_batch *slots;
+	uint32_t size;
+	int batch_size;
+	uint64_t head;
+	uint64_t tail;
+	/* Set by the producer once the input has ended */
+	bool eof;
+	/* Set by the consumer to ask the producer to quit */
+	bool stopped;
+	/* Sleeping producer and consumer */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool producer_waiting;
+	bool consumer_waiting;
+	/* Statistics */
+	uint32_t high_water;
+	uint64_t dropped_packets;
+};
+
+/**
+ * ring_create - Allocates a ring of @size slots holding @batch_size packets each.
+ *
+ * Returns a pointer to the newly allocated ring or NULL on error.
+ */
+struct ts_ring *ring_create(uint32_t size, int batch_size);
+
+/**
+ * ring_destroy - Destroys a ring and the batches allocated by it.
+ *
+ * @ring: the ring.
+ */
+void ring_destroy(struct ts_ring *ring);
+
+/**
+ * ring_get_free_slot - Returns the next batch to be filled by the producer, or NULL if the ring is full.
+ *
+ * @ring: the ring.
+ */
+struct ts_batch *ring_get_free_slot(struct ts_ring *ring);
+
+/**
+ * ring_publish - Hands the batch obtained with ring_get_free_slot() over to the consumer.
+ *
+ * @ring: the ring.
+ */
+void ring_publish(struct ts_ring *ring);
+
+/**
+ * ring_wait_free_slot - Waits until the consumer releases a batch or asks the producer
+ * to stop, for up to @msec milliseconds.
+ *
+ * @ring: the ring.
+ * @msec: longest wait, after which the caller can check its own stop conditions.
+ */
+void ring_wait_free_slot(struct ts_ring *ring, int msec);
+
+/**
+ * ring_get_used_slot - Returns the oldest batch published by the producer, or NULL if the ring is empty.
+ *
+ * @ring: the ring.
+ */
+struct ts_batch *ring_get_used_slot(struct ts_ring *ring);
+
+/**
+ * ring_release - Gives the batch obtained with ring_get_used_slot() back to the producer.
+ *
+ * @ring: the ring.
+ */
+void ring_release(struct ts_ring *ring);
+
+/**
+ * ring_wait_used_slot - Waits until the producer publishes a batch or reaches the end of
+ * the input, for up to @msec milliseconds.
+ *
+ * @ring: the ring.
+ * @msec: longest wait, after which the caller can check its own stop conditions.
+ */
+void ring_wait_used_slot(struct ts_ring *ring, int msec);
+
+/**
+ * ring_set_eof - Tells the consumer that no more batches will be published.
+ *
+ * @ring: the ring.
+ */
+void ring_set_eof(struct ts_ring *ring);
+
+/**
+ * ring_is_drained - Tells if the producer is gone and all its batches have been consumed.
+ *
+ * @ring: the ring.
+ */
+bool ring_is_drained(struct ts_ring *ring);
+
+/**
+ * ring_stop - Asks the producer to stop filling the ring.
+ *
+ * @ring: the ring.
+ */
+void ring_stop(struct ts_ring *ring);
+
+/**
+ * ring_is_stopped - Tells if the consumer has asked the producer to stop.
+ *
+ * @ring: the ring.
+ */
+bool ring_is_stopped(struct ts_ring *ring);
+
+#endif /* __ring_h */
@@ -30,6 +30,22 @@
 #include "descriptors.h"
 #include "ts.h"
 
+/*
+ * Data handed by a table parser to the descriptor parsers it runs. It's kept per
+ * thread, as EIT sections have their descriptors parsed without the parser mutex.
+ */
+static __thread void *descriptors_shared_data;
+
+void descriptors_set_shared_data(void *data)
+{
+	descriptors_shared_data = data;
+}
+
+void *descriptors_get_shared_data(void)
+{
+	return descriptors_shared_data;
+}
+
 uint32_t descriptors_parse(const char *payload, uint8_t num_descriptors, 
 		struct dentry *parent, struct demuxfs_data *priv)
 {
@@ -1,7 +1,7 @@
 #ifndef __descriptors_h
 #define __descriptors_h
 
-#define DESCRIPTOR_COMES_FROM_PMT(p) (p->shared_data ? true : false)
+#define DESCRIPTOR_COMES_FROM_PMT() (descriptors_get_shared_data() ? true : false)
 
 struct descriptor {
 	uint8_t tag;
@@ -17,6 +17,8 @@ struct descriptor *descriptors_find(uint8_t tag, struct demuxfs_data *priv);
 int descriptors_count(const char *payload, uint16_t program_information_length);
 uint32_t descriptors_parse(const char *payload, uint8_t num_descriptors, 
 		struct dentry *parent, struct demuxfs_data *priv);
+void descriptors_set_shared_data(void *data);
+void *descriptors_get_shared_data(void);
 
 /* Descriptor parsers */
 int descriptor_0x02_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv);
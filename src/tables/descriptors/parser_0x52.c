@@ -56,10 +56,10 @@ int descriptor_0x52_parser(const char *payload, int len, struct dentry *parent,
 	if (! descriptor_is_parseable(parent, payload[0], 3, len))
 		return -ENODATA;
 
-	if (! DESCRIPTOR_COMES_FROM_PMT(priv))
+	if (! DESCRIPTOR_COMES_FROM_PMT())
 		TS_WARNING("Stream_Identifier_Descriptor found outside the PMT");
 	else {
-		stream = (struct pmt_stream *) priv->shared_data;
+		stream = (struct pmt_stream *) descriptors_get_shared_data();
 		stream_type = stream->stream_type_identifier;
 	}
 
@@ -53,7 +53,7 @@ int descriptor_0x7c_parser(const char *payload, int len, struct dentry *parent,
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
-	if (! DESCRIPTOR_COMES_FROM_PMT(priv))
+	if (! DESCRIPTOR_COMES_FROM_PMT())
 		TS_WARNING("AAC_Audio_Descriptor found outside the PMT");
 
 	d._profile_and_level = payload[2];
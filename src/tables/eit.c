@@ -34,57 +34,38 @@
 #include "byteops.h"
 #include "tables/psi.h"
 #include "tables/eit.h"
+#include "tables/epg.h"
 #include "descriptors.h"
 
-void eit_free(struct eit_table *eit)
+static void eit_free_events(struct eit_event *events)
 {
 	struct eit_event *event, *next_event;
 
+	for (event=events; event != NULL; event=next_event) {
+		next_event = event->next;
+		free(event);
+	}
+}
+
+void eit_free(struct eit_table *eit)
+{
 	if (eit->dentry && eit->dentry->name)
 		fsutils_dispose_tree(eit->dentry);
 	else if (eit->dentry)
 		/* Dentry has simply been calloc'ed */
 		free(eit->dentry);
 
-	for (event=eit->eit_event; event != NULL; event=next_event) {
-		next_event = event->next;
-		free(event);
-	}
+	eit_free_events(eit->eit_event);
 
 	/* Free the eit table structure */
 	free(eit);
 }
 
-/* Convert from Modified Julian Date format to UTC */
-static time_t eit_convert_from_mjd_time(uint64_t mjd_time)
-{
-	/* MJD epoch is set to Jan 01, 1970 */
-	const int mjd_epoch = 40587;
-	uint16_t  mjd       = (mjd_time >> 24) & 0xffff;
-	time_t    utc_ymd   = (mjd - mjd_epoch) * 86400.0;
-
-	/* Decode the BCD part of the time */
-	uint32_t  bcd       = mjd_time & 0xffffff;
-	uint8_t   hours     = (((bcd >> 20) & 0x0f) * 10) +
-						   ((bcd >> 16) & 0x0f);
-	uint8_t   minutes   = (((bcd >> 12) & 0xff) * 10) +
-						   ((bcd >>  8) & 0x0f);
-	uint8_t   seconds   = (((bcd >>  4) & 0x0f) * 10) +
-						   ((bcd) & 0x0f);
-	time_t    utc_hms   = (hours * 360) + (minutes * 60) + seconds;
-
-	/* Set final UTC time */
-	time_t    utc_time  = utc_ymd + utc_hms;
-
-	return utc_time;
-}
-
 static void eit_create_directory(const struct ts_header *header, struct eit_table *eit, 
-	struct dentry **version_dentry, struct demuxfs_data *priv)
+	struct demuxfs_data *priv)
 {
 	/* Create a directory named "EIT" at the root filesystem if it doesn't exist yet */
-	struct dentry *eit_dir, *eit_pid_dir;
-	char *pid_name;
+	struct dentry *eit_dir, *eit_pid_dir, *service_dir;
 
 	if (header->pid == 0x12)
 		eit_dir = CREATE_DIRECTORY(priv->root, FS_H_EIT_NAME);
@@ -97,78 +78,122 @@ static void eit_create_directory(const struct ts_header *header, struct eit_tabl
 		eit_dir = CREATE_DIRECTORY(priv->root, "EIT");
 	}
 
-	/* Create a directory named "<eit_pid>" and populate it with files */
-	asprintf(&pid_name, "%#04x", header->pid);
-	eit_pid_dir = fsutils_get_child(eit_dir, pid_name);
-	if (eit_pid_dir) {
-		free(pid_name);
-		INITIALIZE_DENTRY_UNLINKED(eit->dentry);
-	} else {
-		eit->dentry->name = pid_name;
-		eit->dentry->mode = S_IFDIR | 0555;
-		CREATE_COMMON(eit_dir, eit->dentry);
-		eit_pid_dir = eit->dentry;
-	}
-	
-	/* Create the versioned dir and update the Current symlink */
-	*version_dentry = fsutils_create_version_dir(eit_pid_dir, eit->version_number);
+	/* The sub-table lives at "<eit_pid>/<service_id>/<table_id>" */
+	eit_pid_dir = CREATE_DIRECTORY(eit_dir, "%#04x", header->pid);
+	service_dir = CREATE_DIRECTORY(eit_pid_dir, "%#06x", eit->identifier);
 
-	psi_populate((void **) &eit, eit_pid_dir);
+	asprintf(&eit->dentry->name, "%#04x", eit->table_id);
+	eit->dentry->mode = S_IFDIR | 0555;
+	eit->dentry->obj_type = OBJ_TYPE_DIR;
+	CREATE_COMMON(service_dir, eit->dentry);
 }
 
-int eit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
-		struct demuxfs_data *priv)
+/**
+ * eit_reset: forget the sections of a sub-table whose version has changed.
+ */
+static void eit_reset(struct eit_table *eit, uint8_t version_number)
 {
-	struct eit_table *current_eit = NULL;
-	struct eit_table *eit = (struct eit_table *) calloc(1, sizeof(struct eit_table));
-	assert(eit);
-	
-	eit->dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
-	assert(eit->dentry);
-
-	/* Copy data up to the first loop entry */
-	int ret = psi_parse((struct psi_common_header *) eit, payload, payload_len);
-	if (ret < 0) {
-		eit_free(eit);
-		return ret;
-	}
+	char version_dir[32];
 
-	/* Set hash key and check if there's already one version of this table in the hash. */
-	eit->dentry->inode = TS_PACKET_HASH_KEY(header, eit);
-	current_eit = hashtable_get(priv->psi_tables, eit->dentry->inode);
+	eit_free_events(eit->eit_event);
+	eit->eit_event = NULL;
+	memset(eit->_section_bitmap, 0, sizeof(eit->_section_bitmap));
+	memset(eit->_segment_last_section, 0, sizeof(eit->_segment_last_section));
+	eit->_segments_seen = 0;
+	eit->sections_received = 0;
+	eit->complete = 0;
 
-	/* Check whether we should keep processing this packet or not */
-	if (! eit->current_next_indicator || (current_eit && current_eit->version_number == eit->version_number)) {
-		eit_free(eit);
-		return 0;
+	/* The version number may have wrapped around: drop the stale copy */
+	snprintf(version_dir, sizeof(version_dir), "Version_%d", version_number);
+	fsutils_retire_tree(fsutils_get_child(eit->dentry, version_dir));
+}
+
+static bool eit_has_section(struct eit_table *eit, uint8_t section_number)
+{
+	return eit->_section_bitmap[section_number / 8] & (1 << (section_number % 8));
+}
+
+/**
+ * eit_is_complete: check that every segment up to last_section_number has
+ * been received up to its segment_last_section_number.
+ */
+static bool eit_is_complete(struct eit_table *eit)
+{
+	unsigned int segment, section;
+	unsigned int last_segment = eit->last_section_number / EIT_SECTIONS_PER_SEGMENT;
+
+	for (segment=0; segment<=last_segment; ++segment) {
+		unsigned int first = segment * EIT_SECTIONS_PER_SEGMENT;
+		if (! (eit->_segments_seen & (1U << segment)))
+			return false;
+		for (section=first; section<=eit->_segment_last_section[segment]; ++section)
+			if (! eit_has_section(eit, section))
+				return false;
 	}
+	return true;
+}
 
-	TS_INFO("EIT parser: pid=%#x, table_id=%#x, current_eit=%p, eit->version_number=%#x, len=%d", 
-			header->pid, eit->table_id, current_eit, eit->version_number, payload_len);
+/**
+ * eit_service_is_complete: check that all sub-tables of this service, up to
+ * last_table_id, have been completely received.
+ */
+static bool eit_service_is_complete(const struct ts_header *header, struct eit_table *eit,
+	struct demuxfs_data *priv)
+{
+	struct psi_common_header key = { .identifier = eit->identifier };
+	unsigned int table_id, first_table_id, last_table_id;
 
-	/* Parse EIT specific bits */
-	struct dentry *version_dentry;
-	eit_create_directory(header, eit, &version_dentry, priv);
+	/* present/following tables stand alone, schedule tables come in groups of 16 */
+	first_table_id = eit->table_id >= 0x50 ? eit->table_id & 0xf0 : eit->table_id;
+	last_table_id = eit->last_table_id >= eit->table_id ? eit->last_table_id : eit->table_id;
 
-	eit->transport_stream_id = CONVERT_TO_16(payload[8], payload[9]);
-	eit->original_network_id = CONVERT_TO_16(payload[10], payload[11]);
-	eit->segment_last_section_number = payload[12];
-	eit->last_table_id = payload[13];
-	CREATE_FILE_NUMBER(version_dentry, eit, transport_stream_id);
-	CREATE_FILE_NUMBER(version_dentry, eit, original_network_id);
-	CREATE_FILE_NUMBER(version_dentry, eit, segment_last_section_number);
-	CREATE_FILE_NUMBER(version_dentry, eit, last_table_id);
+	for (table_id=first_table_id; table_id<=last_table_id; ++table_id) {
+		struct eit_table *sub_table;
+		key.table_id = table_id;
+		sub_table = hashtable_get(priv->psi_tables, EIT_HASH_KEY(header, &key));
+		if (! sub_table || sub_table->version_number != eit->version_number || ! sub_table->complete)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * eit_store_section: mark a section as received in its segment.
+ */
+static void eit_store_section(struct eit_table *eit, uint8_t segment_last_section_number)
+{
+	uint8_t section_number = eit->section_number;
+	uint8_t segment = section_number / EIT_SECTIONS_PER_SEGMENT;
+	uint8_t segment_end = segment * EIT_SECTIONS_PER_SEGMENT + EIT_SECTIONS_PER_SEGMENT - 1;
+
+	/* Fall back to a full segment if the broadcaster got this field wrong */
+	if (segment_last_section_number < section_number || segment_last_section_number > segment_end)
+		segment_last_section_number = segment_end < eit->last_section_number ?
+			segment_end : eit->last_section_number;
 
-	struct eit_event *this_event;
-	eit->eit_event = calloc(1, sizeof(struct eit_event));
-	this_event = eit->eit_event;
+	eit->_section_bitmap[section_number / 8] |= 1 << (section_number % 8);
+	eit->_segment_last_section[segment] = segment_last_section_number;
+	eit->_segments_seen |= 1U << segment;
+	eit->sections_received++;
+}
 
+/**
+ * eit_decode_events: decodes the events of an EIT section into @section_dentry,
+ * which isn't linked to the tree yet.
+ * @return the events, in the order of the section.
+ */
+static struct eit_event *eit_decode_events(struct dentry *section_dentry, const char *payload,
+	uint32_t payload_len, struct demuxfs_data *priv)
+{
+	struct eit_event *events = NULL, **tail = &events;
+	uint32_t descriptors_length;
 	int event_nr = 1, i = 14;
+
 	/* Include extra 4 bytes needed by the CRC32 */
-	while ((i + 4) < payload_len) {
-		char event_dirname[32];
+	while ((i + 12 + 4) <= payload_len) {
 		struct dentry *event_dentry;
-		struct eit_event *next_event = NULL;
+		struct eit_event *this_event = calloc(1, sizeof(struct eit_event));
+		assert(this_event);
 		
 		this_event->event_id = CONVERT_TO_16(payload[i], payload[i+1]);
 		this_event->start_time = CONVERT_TO_40(payload[i+2], payload[i+3], payload[i+4], payload[i+5], payload[i+6]);
@@ -176,13 +201,17 @@ int eit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		this_event->running_status = (payload[i+10] >> 5) & 0x03;
 		this_event->free_ca_mode = (payload[i+10] >> 4) & 0x01;
 		this_event->descriptors_loop_length = CONVERT_TO_16(payload[i+10], payload[i+11]) & 0x0fff;
+		*tail = this_event;
+		tail = &this_event->next;
 		i += 12;
 
-		/* TODO: unused */
-		eit_convert_from_mjd_time(this_event->start_time);
+		descriptors_length = this_event->descriptors_loop_length;
+		if (descriptors_length > payload_len - 4 - i)
+			descriptors_length = payload_len - 4 - i;
+		this_event->_descriptors_offset = i;
+		this_event->_descriptors_length = descriptors_length;
 
-		sprintf(event_dirname, "Event_%02d", event_nr++);
-		event_dentry = CREATE_DIRECTORY(version_dentry, "%s", event_dirname);
+		event_dentry = CREATE_DIRECTORY(section_dentry, "Event_%02d", event_nr++);
 		CREATE_FILE_NUMBER(event_dentry, this_event, event_id);
 		CREATE_FILE_NUMBER(event_dentry, this_event, start_time);
 		CREATE_FILE_NUMBER(event_dentry, this_event, duration);
@@ -191,25 +220,151 @@ int eit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		CREATE_FILE_NUMBER(event_dentry, this_event, descriptors_loop_length);
 
 		int loop_length = this_event->descriptors_loop_length;
-		while (loop_length > 0) {
+		while (loop_length > 0 && (i + 4) < payload_len) {
 			uint32_t desc_length = descriptors_parse(&payload[i], 1, event_dentry, priv);
+			if (desc_length == 0)
+				break;
 			loop_length -= desc_length;
 			i += desc_length;
 		}
+	}
+	return events;
+}
+
+/**
+ * eit_decode_section: decodes an EIT section into a "Section_NN" directory of
+ * its own. Neither the tree nor the PSI tables are touched, so that the bulk of
+ * the work happens without the parser mutex.
+ */
+static struct dentry *eit_decode_section(struct eit_table *section, const char *payload,
+	uint32_t payload_len, struct eit_event **events, struct demuxfs_data *priv)
+{
+	struct dentry *section_dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+	assert(section_dentry);
+
+	asprintf(&section_dentry->name, "Section_%02d", section->section_number);
+	section_dentry->mode = S_IFDIR | 0555;
+	section_dentry->obj_type = OBJ_TYPE_DIR;
+	INITIALIZE_DENTRY_UNLINKED(section_dentry);
+	INIT_LIST_HEAD(&section_dentry->list);
+
+	CREATE_FILE_NUMBER(section_dentry, section, segment_last_section_number);
+	*events = eit_decode_events(section_dentry, payload, payload_len, priv);
+	return section_dentry;
+}
+
+/**
+ * eit_link_section: stores a decoded section in its sub-table, links its directory
+ * to the tree and adds its events to the EPG index of the service. Must be called
+ * with the parser mutex held.
+ */
+static void eit_link_section(const struct ts_header *header, const char *payload, uint32_t payload_len,
+	struct eit_table *section, struct dentry *section_dentry, struct eit_event *events,
+	struct demuxfs_data *priv)
+{
+	struct dentry *version_dentry;
+	struct eit_event *event, *last_event = NULL;
+	struct epg_service *epg;
+	struct eit_table *eit;
+
+	eit = hashtable_get(priv->psi_tables, EIT_HASH_KEY(header, section));
+	if (! eit) {
+		eit = (struct eit_table *) calloc(1, sizeof(struct eit_table));
+		assert(eit);
+		eit->dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+		assert(eit->dentry);
+		psi_parse((struct psi_common_header *) eit, payload, payload_len);
+		eit->dentry->inode = EIT_HASH_KEY(header, eit);
+		eit_create_directory(header, eit, priv);
+		hashtable_add(priv->psi_tables, eit->dentry->inode, eit, (hashtable_free_function_t) eit_free);
+	} else if (eit->version_number != section->version_number) {
+		eit_reset(eit, section->version_number);
+	} else if (eit_has_section(eit, section->section_number)) {
+		/* Another copy of this section made it in while this one was being decoded */
+		fsutils_dispose_tree(section_dentry);
+		eit_free_events(events);
+		return;
+	}
 
-		if (i < payload_len) {
-			next_event = calloc(1, sizeof(struct eit_event));
-			this_event->next = next_event;
-			this_event = next_event;
-		} else
-			this_event->next = NULL;
+	if (eit->sections_received == 0)
+		TS_INFO("EIT parser: pid=%#x, table_id=%#x, service_id=%#x, version_number=%#x",
+			header->pid, section->table_id, section->identifier, section->version_number);
+
+	/* Update the header with this section and parse EIT specific bits */
+	psi_parse((struct psi_common_header *) eit, payload, payload_len);
+	psi_populate((void **) &eit, eit->dentry);
+	version_dentry = fsutils_create_version_dir(eit->dentry, eit->version_number);
+
+	eit->transport_stream_id = section->transport_stream_id;
+	eit->original_network_id = section->original_network_id;
+	eit->segment_last_section_number = section->segment_last_section_number;
+	eit->last_table_id = section->last_table_id;
+	eit_store_section(eit, eit->segment_last_section_number);
+	CREATE_FILE_NUMBER(version_dentry, eit, transport_stream_id);
+	CREATE_FILE_NUMBER(version_dentry, eit, original_network_id);
+	CREATE_FILE_NUMBER(version_dentry, eit, last_table_id);
+
+	/* eit_reset() has dropped any older copy of the section, but keep the names unique */
+	fsutils_retire_tree(fsutils_get_child(version_dentry, section_dentry->name));
+	section_dentry->parent = version_dentry;
+	list_add_tail(&section_dentry->list, &version_dentry->children);
+
+	epg = epg_get_service(eit->dentry->parent, eit->identifier);
+	for (event=events; event; event=event->next) {
+		epg_add_event(epg, eit->table_id, event, &payload[event->_descriptors_offset],
+			event->_descriptors_length);
+		last_event = event;
+	}
+	if (last_event) {
+		last_event->next = eit->eit_event;
+		eit->eit_event = events;
+	}
+
+	if (! eit->complete && eit_is_complete(eit)) {
+		eit->complete = 1;
+		dprintf("EIT sub-table %#x of service %#x complete with %d sections",
+			eit->table_id, eit->identifier, eit->sections_received);
+		if (eit_service_is_complete(header, eit, priv))
+			TS_INFO("EIT schedule of service %#x complete up to table_id %#x",
+				eit->identifier, eit->last_table_id);
 	}
+	CREATE_FILE_NUMBER(version_dentry, eit, sections_received);
+	CREATE_FILE_NUMBER(version_dentry, eit, complete);
+}
+
+/**
+ * eit_parse: parses an EIT section. Unlike the other table parsers, it's invoked
+ * without the parser mutex: the section is decoded first, and the mutex is only
+ * taken to hand it over to its sub-table.
+ */
+int eit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	struct dentry *section_dentry;
+	struct eit_event *events;
+	struct eit_table section;
 
-	if (current_eit) {
-		fsutils_migrate_children(current_eit->dentry, eit->dentry);
-		hashtable_del(priv->psi_tables, current_eit->dentry->inode);
+	/* Look at the section header before decoding its events */
+	memset(&section, 0, sizeof(section));
+	int ret = psi_parse((struct psi_common_header *) &section, payload, payload_len);
+	if (ret < 0)
+		return ret;
+	if (! section.current_next_indicator)
+		return 0;
+	if (payload_len < 14 + 4) {
+		TS_WARNING("EIT section is too short (%d bytes)", payload_len);
+		return -1;
 	}
 
-	hashtable_add(priv->psi_tables, eit->dentry->inode, eit, (hashtable_free_function_t) eit_free);
+	section.transport_stream_id = CONVERT_TO_16(payload[8], payload[9]);
+	section.original_network_id = CONVERT_TO_16(payload[10], payload[11]);
+	section.segment_last_section_number = payload[12];
+	section.last_table_id = payload[13];
+	section_dentry = eit_decode_section(&section, payload, payload_len, &events, priv);
+
+	pthread_mutex_lock(&priv->parser_mutex);
+	eit_link_section(header, payload, payload_len, &section, section_dentry, events, priv);
+	pthread_mutex_unlock(&priv->parser_mutex);
+
 	return 0;
 }
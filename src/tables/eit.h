@@ -10,8 +10,19 @@ struct eit_event {
 	uint16_t free_ca_mode:1;
 	uint16_t descriptors_loop_length:12;
 	/* descriptors loop */
+	/* Where the descriptors loop lies in the section, while it's being parsed */
+	uint16_t _descriptors_offset;
+	uint16_t _descriptors_length;
 };
 
+/* EIT sections are grouped in segments of 8 sections each */
+#define EIT_SECTIONS_PER_SEGMENT 8
+#define EIT_MAX_SEGMENTS         (256 / EIT_SECTIONS_PER_SEGMENT)
+
+/* Sub-tables are keyed by service_id, PID and table_id */
+#define EIT_HASH_KEY(ts_header,eit_header) \
+	(((ino_t) (eit_header)->identifier << 24) | TS_PACKET_HASH_KEY(ts_header, eit_header))
+
 /** 
  * EIT - Event Information Table
  */
@@ -27,6 +38,12 @@ typedef struct eit_table {
 	uint8_t last_table_id;
 	struct eit_event *eit_event;
 	uint32_t crc;
+	/* Sub-table assembly */
+	uint8_t _section_bitmap[256 / 8];
+	uint8_t _segment_last_section[EIT_MAX_SEGMENTS];
+	uint32_t _segments_seen;
+	uint16_t sections_received;
+	uint8_t complete;
 } __attribute__((__packed__)) eit_table;
 
 
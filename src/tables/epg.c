@@ -0,0 +1,316 @@
+/* 
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "ts.h"
+#include "tables/psi.h"
+#include "tables/eit.h"
+#include "tables/epg.h"
+
+/* Time at which now_next and schedule are answered: that of the last TOT, if any */
+static time_t epg_stream_time;
+
+/**
+ * epg_convert_duration: converts a 24-bit BCD HHMMSS field into seconds.
+ */
+uint32_t epg_convert_duration(uint32_t bcd_time)
+{
+	uint32_t hours   = ((bcd_time >> 20) & 0x0f) * 10 + ((bcd_time >> 16) & 0x0f);
+	uint32_t minutes = ((bcd_time >> 12) & 0x0f) * 10 + ((bcd_time >>  8) & 0x0f);
+	uint32_t seconds = ((bcd_time >>  4) & 0x0f) * 10 + ((bcd_time) & 0x0f);
+
+	return hours * 3600 + minutes * 60 + seconds;
+}
+
+/**
+ * epg_convert_time: converts a 40-bit MJD + BCD time field into seconds since
+ * the epoch, in the time base used by the broadcaster.
+ */
+time_t epg_convert_time(uint64_t mjd_time)
+{
+	/* MJD epoch is set to Jan 01, 1970 */
+	const int mjd_epoch = 40587;
+	int mjd = (mjd_time >> 24) & 0xffff;
+
+	return (time_t) (mjd - mjd_epoch) * 86400 + epg_convert_duration(mjd_time & 0xffffff);
+}
+
+void epg_set_stream_time(time_t stream_time)
+{
+	__atomic_store_n(&epg_stream_time, stream_time, __ATOMIC_RELAXED);
+}
+
+static time_t epg_now(void)
+{
+	time_t now = __atomic_load_n(&epg_stream_time, __ATOMIC_RELAXED);
+	return now ? now : time(NULL);
+}
+
+static time_t epg_end_time(const struct epg_event *event)
+{
+	return event->start_time + event->duration;
+}
+
+static struct dentry *epg_create_file(struct dentry *parent, const char *name,
+		struct epg_service *service)
+{
+	struct dentry *dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+	assert(dentry);
+	dentry->name = strdup(name);
+	dentry->mode = S_IFREG | 0444;
+	dentry->size = 0xffffff;
+	dentry->obj_type = OBJ_TYPE_EPG;
+	dentry->priv = service;
+	CREATE_COMMON(parent, dentry);
+	return dentry;
+}
+
+/**
+ * epg_get_service: returns the event index of a service, creating it along
+ * with its now_next and schedule files if needed.
+ */
+struct epg_service *epg_get_service(struct dentry *service_dentry, uint16_t service_id)
+{
+	struct dentry *dentry = fsutils_get_child(service_dentry, EPG_NOW_NEXT_NAME);
+	struct epg_service *service;
+
+	if (dentry)
+		return (struct epg_service *) dentry->priv;
+
+	service = (struct epg_service *) calloc(1, sizeof(struct epg_service));
+	assert(service);
+	service->service_id = service_id;
+	pthread_mutex_init(&service->mutex, NULL);
+
+	/* One reference for each file */
+	service->refcount = 2;
+	epg_create_file(service_dentry, EPG_NOW_NEXT_NAME, service);
+	epg_create_file(service_dentry, EPG_SCHEDULE_NAME, service);
+	return service;
+}
+
+void epg_service_put(struct epg_service *service)
+{
+	uint32_t i;
+
+	if (service && __atomic_sub_fetch(&service->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (i=0; i<service->count; ++i)
+			free(service->events[i].event_name);
+		free(service->events);
+		pthread_mutex_destroy(&service->mutex);
+		free(service);
+	}
+}
+
+/**
+ * epg_event_name: looks up the event name in the short_event_descriptor, if any.
+ */
+static char *epg_event_name(const char *descriptors, uint32_t descriptors_length)
+{
+	uint32_t i = 0;
+
+	while (i + 2 <= descriptors_length) {
+		uint8_t tag = descriptors[i];
+		uint8_t len = descriptors[i+1];
+		if (i + 2 + len > descriptors_length)
+			break;
+		/* ISO_639_language_code, event_name_length, event_name */
+		if (tag == 0x4d && len >= 4 && 4 + (uint8_t) descriptors[i+5] <= len)
+			return strndup(&descriptors[i+6], (uint8_t) descriptors[i+5]);
+		i += 2 + len;
+	}
+	return NULL;
+}
+
+/**
+ * epg_lower_bound: index of the first event which starts at or after @start_time.
+ */
+static uint32_t epg_lower_bound(const struct epg_service *service, time_t start_time)
+{
+	uint32_t low = 0, high = service->count;
+
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (service->events[mid].start_time < start_time)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/**
+ * epg_prune: drops the events which were over by the time of the last TOT, so that
+ * the index of a service doesn't keep growing while the stream goes on. Nothing is
+ * dropped before a TOT comes in, as the stream may be a recording older than the clock.
+ * Must be called with the mutex of @service held.
+ */
+static void epg_prune(struct epg_service *service)
+{
+	time_t now = __atomic_load_n(&epg_stream_time, __ATOMIC_RELAXED);
+	uint32_t expired = 0, i;
+
+	if (! now)
+		return;
+	/* Events don't overlap, so those which are over come first */
+	while (expired < service->count && epg_end_time(&service->events[expired]) <= now)
+		expired++;
+	if (! expired)
+		return;
+	for (i=0; i<expired; ++i)
+		free(service->events[i].event_name);
+	memmove(&service->events[0], &service->events[expired],
+		(service->count - expired) * sizeof(struct epg_event));
+	service->count -= expired;
+}
+
+/**
+ * epg_add_event: inserts an EIT event in the index of its service. Events
+ * announced earlier which overlap with the new one are replaced by it, and
+ * those which are over already are dropped.
+ */
+void epg_add_event(struct epg_service *service, uint8_t table_id, const struct eit_event *event,
+		const char *descriptors, uint32_t descriptors_length)
+{
+	struct epg_event entry;
+	uint32_t first, last, i;
+
+	/* Events of unknown start time (all bits set) have no place in the index */
+	if (event->start_time == 0xffffffffffULL)
+		return;
+
+	entry.start_time = epg_convert_time(event->start_time);
+	entry.duration = epg_convert_duration(event->duration);
+	entry.event_id = event->event_id;
+	entry.table_id = table_id;
+	entry.running_status = event->running_status;
+	entry.event_name = epg_event_name(descriptors, descriptors_length);
+
+	pthread_mutex_lock(&service->mutex);
+	epg_prune(service);
+	first = epg_lower_bound(service, entry.start_time);
+	if (first > 0 && epg_end_time(&service->events[first-1]) > entry.start_time)
+		first--;
+	for (last=first; last<service->count; ++last) {
+		struct epg_event *old = &service->events[last];
+		if (old->start_time >= epg_end_time(&entry) && old->start_time != entry.start_time)
+			break;
+	}
+	for (i=first; i<last; ++i)
+		free(service->events[i].event_name);
+
+	if (first == last) {
+		if (service->count == service->_allocated) {
+			uint32_t allocated = service->_allocated ? service->_allocated * 2 : 16;
+			struct epg_event *events = realloc(service->events, allocated * sizeof(struct epg_event));
+			if (! events) {
+				pthread_mutex_unlock(&service->mutex);
+				free(entry.event_name);
+				return;
+			}
+			service->events = events;
+			service->_allocated = allocated;
+		}
+		memmove(&service->events[first+1], &service->events[first],
+			(service->count - first) * sizeof(struct epg_event));
+		service->count++;
+	} else if (last > first + 1) {
+		memmove(&service->events[first+1], &service->events[last],
+			(service->count - last) * sizeof(struct epg_event));
+		service->count -= last - first - 1;
+	}
+	service->events[first] = entry;
+	pthread_mutex_unlock(&service->mutex);
+}
+
+static void epg_print_event(FILE *fp, const char *label, const struct epg_event *event)
+{
+	struct tm tm;
+
+	gmtime_r(&event->start_time, &tm);
+	fprintf(fp, "%s%04d-%02d-%02d %02d:%02d:%02d %02u:%02u:%02u %#06x %s\n", label,
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		event->duration / 3600, (event->duration / 60) % 60, event->duration % 60,
+		event->event_id, event->event_name ? event->event_name : "");
+}
+
+/**
+ * epg_render: fills the contents of a now_next or schedule file with the events
+ * of its service on air at the time of the call and, respectively, the event
+ * which follows it or all events yet to come.
+ * @return 0 on success or a negative number on error.
+ */
+int epg_render(struct dentry *dentry)
+{
+	struct epg_service *service = (struct epg_service *) dentry->priv;
+	bool now_next = strcmp(dentry->name, EPG_NOW_NEXT_NAME) == 0;
+	time_t now = epg_now();
+	char *contents = NULL;
+	size_t size = 0;
+	uint32_t i;
+	FILE *fp;
+
+	fp = open_memstream(&contents, &size);
+	if (! fp)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&service->mutex);
+	/* The event on air is the last one to start up to now, unless it's over already */
+	i = epg_lower_bound(service, now + 1);
+	if (i > 0 && epg_end_time(&service->events[i-1]) > now)
+		i--;
+	if (now_next) {
+		if (i < service->count && service->events[i].start_time <= now) {
+			epg_print_event(fp, "now  ", &service->events[i]);
+			i++;
+		}
+		if (i < service->count)
+			epg_print_event(fp, "next ", &service->events[i]);
+	} else {
+		for (; i<service->count; ++i)
+			epg_print_event(fp, "", &service->events[i]);
+	}
+	pthread_mutex_unlock(&service->mutex);
+	fclose(fp);
+
+	free(dentry->contents);
+	dentry->contents = contents;
+	dentry->size = size;
+	return 0;
+}
+
+/**
+ * epg_release: drops the answer rendered for the last reader.
+ */
+void epg_release(struct dentry *dentry)
+{
+	free(dentry->contents);
+	dentry->contents = NULL;
+	dentry->size = 0xffffff;
+}
@@ -0,0 +1,44 @@
+#ifndef __epg_h
+#define __epg_h
+
+#define EPG_NOW_NEXT_NAME  "now_next"
+#define EPG_SCHEDULE_NAME  "schedule"
+
+/**
+ * Compact entry of the EPG index, decoded once from the EIT event loop
+ */
+struct epg_event {
+	time_t start_time;
+	uint32_t duration;
+	uint16_t event_id;
+	uint8_t table_id;
+	uint8_t running_status;
+	char *event_name;
+};
+
+/**
+ * Events announced for one service, sorted by start_time and free of overlaps.
+ * The index is shared by the now_next and schedule files of the service.
+ */
+struct epg_service {
+	uint32_t refcount;
+	uint16_t service_id;
+	pthread_mutex_t mutex;
+	uint32_t count;
+	uint32_t _allocated;
+	struct epg_event *events;
+};
+
+struct eit_event;
+
+time_t epg_convert_time(uint64_t mjd_time);
+uint32_t epg_convert_duration(uint32_t bcd_time);
+void epg_set_stream_time(time_t stream_time);
+struct epg_service *epg_get_service(struct dentry *service_dentry, uint16_t service_id);
+void epg_service_put(struct epg_service *service);
+void epg_add_event(struct epg_service *service, uint8_t table_id, const struct eit_event *event,
+		const char *descriptors, uint32_t descriptors_length);
+int epg_render(struct dentry *dentry);
+void epg_release(struct dentry *dentry);
+
+#endif /* __epg_h */
@@ -61,7 +61,7 @@ static void nit_create_directory(struct nit_table *nit, struct dentry **version_
 	psi_populate((void **) &nit, *version_dentry);
 }
 
-int nit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+static int nit_parse_sections(const struct ts_header *header, const struct psi_section_set *set,
 		struct demuxfs_data *priv)
 {
 	struct nit_table *current_nit = NULL;
@@ -72,7 +72,7 @@ int nit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	assert(nit->dentry);
 
 	/* Copy data up to the first loop entry */
-	int ret = psi_parse((struct psi_common_header *) nit, payload, payload_len);
+	int ret = psi_parse((struct psi_common_header *) nit, set->payload[0], set->payload_len[0]);
 	if (ret < 0) {
 		nit_free(nit);
 		return ret;
@@ -88,53 +88,64 @@ int nit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		return 0;
 	}
 	
-	TS_INFO("NIT parser: pid=%#x, table_id=%#x, current_nit=%p, nit->version_number=%#x, len=%d", 
-			header->pid, nit->table_id, current_nit, nit->version_number, payload_len);
+	TS_INFO("NIT parser: pid=%#x, table_id=%#x, current_nit=%p, nit->version_number=%#x, sections=%d", 
+			header->pid, nit->table_id, current_nit, nit->version_number, set->count);
 
 	/* TODO: check payload boundaries */
 
 	/* Parse NIT specific bits */
 	struct dentry *version_dentry;
-	nit->reserved_4 = payload[8] >> 4;
-	nit->network_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
-	nit->num_descriptors = descriptors_count(&payload[10], nit->network_descriptors_length);
+	nit->reserved_4 = set->payload[0][8] >> 4;
+	nit->network_descriptors_length = CONVERT_TO_16(set->payload[0][8], set->payload[0][9]) & 0x0fff;
+	nit->num_descriptors = descriptors_count(&set->payload[0][10], nit->network_descriptors_length);
 	nit_create_directory(nit, &version_dentry, priv);
 
-	descriptors_parse(&payload[10], nit->num_descriptors, version_dentry, priv);
-
-	uint8_t offset = 10 + nit->network_descriptors_length;
-	nit->reserved_5 = payload[offset] >> 4;
-	nit->transport_stream_loop_length = CONVERT_TO_16(payload[offset], payload[offset+1]) & 0x0fff;
-	offset += 2;
-
 	struct dentry *ts_dentry = CREATE_DIRECTORY(version_dentry, "Transport_Stream_Information");
-	uint16_t i = 0, info_index = 0;
-	while (i < nit->transport_stream_loop_length) {
-		struct dentry *info_dentry = CREATE_DIRECTORY(ts_dentry, "%02d", ++info_index);
-		struct nit_ts_data ts_data;
-		ts_data.transport_stream_id = CONVERT_TO_16(payload[offset], payload[offset+1]);
-		ts_data.original_network_id = CONVERT_TO_16(payload[offset+2], payload[offset+3]);
-		ts_data.reserved_future_use = payload[offset+4] >> 4;
-		ts_data.transport_descriptors_length = CONVERT_TO_16(payload[offset+4], payload[offset+5]) & 0x0fff;
-		ts_data.num_descriptors = descriptors_count(&payload[offset+6], ts_data.transport_descriptors_length);
-		CREATE_FILE_NUMBER(info_dentry, &ts_data, transport_stream_id);
-		CREATE_FILE_NUMBER(info_dentry, &ts_data, original_network_id);
-		CREATE_FILE_NUMBER(info_dentry, &ts_data, transport_descriptors_length);
-
-		if (ts_data.original_network_id != nit->identifier)
-			TS_WARNING("NIT: original_network_id(%#x) != network_id(%#x)", 
-					ts_data.original_network_id, nit->identifier);
-
-		descriptors_parse(&payload[offset+6], ts_data.num_descriptors, info_dentry, priv);
-		i += 6 + ts_data.transport_descriptors_length;
-		offset += 6 + ts_data.transport_descriptors_length;
+	uint16_t info_index = 0;
+
+	/* Every section carries its own network descriptors and transport stream loop */
+	for (uint16_t s=0; s<set->count; ++s) {
+		const char *payload = set->payload[s];
+		uint16_t network_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
+		int num_descriptors = descriptors_count(&payload[10], network_descriptors_length);
+
+		descriptors_parse(&payload[10], num_descriptors, version_dentry, priv);
+
+		uint32_t offset = 10 + network_descriptors_length;
+		nit->reserved_5 = payload[offset] >> 4;
+		nit->transport_stream_loop_length = CONVERT_TO_16(payload[offset], payload[offset+1]) & 0x0fff;
+		offset += 2;
+
+		uint16_t i = 0;
+		while (i < nit->transport_stream_loop_length) {
+			struct dentry *info_dentry = CREATE_DIRECTORY(ts_dentry, "%02d", ++info_index);
+			struct nit_ts_data ts_data;
+			ts_data.transport_stream_id = CONVERT_TO_16(payload[offset], payload[offset+1]);
+			ts_data.original_network_id = CONVERT_TO_16(payload[offset+2], payload[offset+3]);
+			ts_data.reserved_future_use = payload[offset+4] >> 4;
+			ts_data.transport_descriptors_length = CONVERT_TO_16(payload[offset+4], payload[offset+5]) & 0x0fff;
+			ts_data.num_descriptors = descriptors_count(&payload[offset+6], ts_data.transport_descriptors_length);
+			CREATE_FILE_NUMBER(info_dentry, &ts_data, transport_stream_id);
+			CREATE_FILE_NUMBER(info_dentry, &ts_data, original_network_id);
+			CREATE_FILE_NUMBER(info_dentry, &ts_data, transport_descriptors_length);
+
+			if (ts_data.original_network_id != nit->identifier)
+				TS_WARNING("NIT: original_network_id(%#x) != network_id(%#x)", 
+						ts_data.original_network_id, nit->identifier);
+
+			descriptors_parse(&payload[offset+6], ts_data.num_descriptors, info_dentry, priv);
+			i += 6 + ts_data.transport_descriptors_length;
+			offset += 6 + ts_data.transport_descriptors_length;
+		}
 	}
 
-	if (current_nit) {
-		fsutils_migrate_children(current_nit->dentry, nit->dentry);
-		hashtable_del(priv->psi_tables, current_nit->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, nit->dentry->inode, nit, (hashtable_free_function_t) nit_free);
+	psi_replace_table(current_nit, nit, (hashtable_free_function_t) nit_free, priv);
 
 	return 0;
 }
+
+int nit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return psi_assemble(header, payload, payload_len, nit_parse_sections, priv);
+}
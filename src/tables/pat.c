@@ -91,12 +91,12 @@ static void pat_populate(struct pat_table *pat, struct dentry *parent,
 			snprintf(target, sizeof(target), "../../../%s/%s",
 				FS_NIT_NAME, FS_CURRENT_NAME);
 			if (! existing_parser)
-				hashtable_add(priv->psi_parsers, pid, nit_parse, NULL);
+				ts_set_psi_parser(pid, nit_parse, priv);
 		} else {
 			snprintf(target, sizeof(target), "../../../%s/%#04x/%s",
 				FS_PMT_NAME, pid, FS_CURRENT_NAME);
 			if (! existing_parser)
-				hashtable_add(priv->psi_parsers, pid, pmt_parse, NULL);
+				ts_set_psi_parser(pid, pmt_parse, priv);
 		}
 		CREATE_SYMLINK(dentry, name, target);
 	}
@@ -118,7 +118,7 @@ static void pat_create_directory(struct pat_table *pat, struct demuxfs_data *pri
 	pat_populate(pat, version_dentry, priv);
 }
 
-int pat_parse(const struct ts_header *header, const char *payload, uint32_t payload_len, 
+static int pat_parse_sections(const struct ts_header *header, const struct psi_section_set *set,
 		struct demuxfs_data *priv)
 {
 	struct pat_table *current_pat = NULL;
@@ -129,7 +129,7 @@ int pat_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	assert(pat->dentry);
 
 	/* Copy data up to the first loop entry */
-	int ret = psi_parse((struct psi_common_header *) pat, payload, payload_len);
+	int ret = psi_parse((struct psi_common_header *) pat, set->payload[0], set->payload_len[0]);
 	if (ret < 0) {
 		free(pat->dentry);
 		free(pat);
@@ -146,35 +146,45 @@ int pat_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		free(pat);
 		return 0;
 	}
-	TS_INFO("PAT parser: pid=%#x, table_id=%#x, current_pat=%p, pat->version_number=%#x, len=%d", 
-			header->pid, pat->table_id, current_pat, pat->version_number, payload_len);
+	TS_INFO("PAT parser: pid=%#x, table_id=%#x, current_pat=%p, pat->version_number=%#x, sections=%d", 
+			header->pid, pat->table_id, current_pat, pat->version_number, set->count);
 
 	/* Parse PAT specific bits */
-	pat->num_programs = (pat->section_length - 
-		/* transport_stream_id */ 2 -
-		/* reserved/version_number/current_next_indicator */ 1 -
-		/* section_number */ 1 -
-		/* last_section_number */ 1 -
-		/* crc32 */ 4) / 4;
+	uint16_t num_programs[PSI_MAX_SECTIONS];
+	for (uint16_t s=0; s<set->count; ++s) {
+		const char *payload = set->payload[s];
+		uint16_t section_length = CONVERT_TO_16(payload[1], payload[2]) & 0x0fff;
+		num_programs[s] = (section_length - 
+			/* transport_stream_id */ 2 -
+			/* reserved/version_number/current_next_indicator */ 1 -
+			/* section_number */ 1 -
+			/* last_section_number */ 1 -
+			/* crc32 */ 4) / 4;
+		pat->num_programs += num_programs[s];
+	}
 
 	pat->programs = (struct pat_program *) calloc(pat->num_programs, sizeof(struct pat_program));
 	assert(pat->programs);
 
-	for (uint16_t i=0; i<pat->num_programs; ++i) {
-		uint16_t offset = 8 + (i * 4);
-		pat->programs[i].program_number = CONVERT_TO_16(payload[offset], payload[offset+1]);
-		pat->programs[i].reserved = payload[offset+2] >> 4;
-		pat->programs[i].pid = CONVERT_TO_16(payload[offset+2], payload[offset+3]) & 0x1fff;
+	for (uint16_t s=0, n=0; s<set->count; ++s) {
+		const char *payload = set->payload[s];
+		for (uint16_t i=0; i<num_programs[s]; ++i, ++n) {
+			uint16_t offset = 8 + (i * 4);
+			pat->programs[n].program_number = CONVERT_TO_16(payload[offset], payload[offset+1]);
+			pat->programs[n].reserved = payload[offset+2] >> 4;
+			pat->programs[n].pid = CONVERT_TO_16(payload[offset+2], payload[offset+3]) & 0x1fff;
+		}
 	}
 
 	pat_create_directory(pat, priv);
 
-	if (current_pat) {
-		fsutils_migrate_children(current_pat->dentry, pat->dentry);
-		fsutils_dispose_tree(current_pat->dentry);
-		hashtable_del(priv->psi_tables, current_pat->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, pat->dentry->inode, pat, (hashtable_free_function_t) pat_free);
+	psi_replace_table(current_pat, pat, (hashtable_free_function_t) pat_free, priv);
 
 	return 0;
 }
+
+int pat_parse(const struct ts_header *header, const char *payload, uint32_t payload_len, 
+		struct demuxfs_data *priv)
+{
+	return psi_assemble(header, payload, payload_len, pat_parse_sections, priv);
+}
@@ -31,7 +31,6 @@
 #include "byteops.h"
 #include "buffer.h"
 #include "fifo.h"
-#include "hash.h"
 #include "ts.h"
 #include "tables/psi.h"
 #include "tables/pes.h"
@@ -81,9 +80,9 @@ static struct dentry *pes_get_dentry(const struct ts_header *header,
 {
 	struct dentry *slink, *dentry = NULL;
 	char pathname[PATH_MAX];
-	ino_t key = header->pid << 1 | (strcmp(fifo_name, FS_ES_FIFO_NAME) == 0 ? 0 : 1);
+	struct dentry **cache = &priv->pid_contexts[header->pid].fifo_dentry[strcmp(fifo_name, FS_ES_FIFO_NAME) == 0 ? 0 : 1];
 
-	dentry = hashtable_get(priv->pes_tables, key);
+	dentry = *cache;
 	if (! dentry) {
 		sprintf(pathname, "/%s/%#x", FS_STREAMS_NAME, header->pid);
 		slink = fsutils_get_dentry(priv->root, pathname);
@@ -98,7 +97,7 @@ static struct dentry *pes_get_dentry(const struct ts_header *header,
 			dprintf("couldn't get a dentry for '%s'", pathname);
 			return NULL;
 		}
-		hashtable_add(priv->pes_tables, key, dentry, NULL);
+		*cache = dentry;
 	}
 	return dentry;
 }
@@ -46,14 +46,6 @@ struct formatted_descriptor {
 	char *stream_type_identifier;
 };
 
-static void pmt_check_header(struct pmt_table *pmt)
-{
-	if (pmt->section_number != 0)
-		TS_WARNING("section_number != 0");
-	if (pmt->last_section_number != 0)
-		TS_WARNING("last_section_number != 0");
-}
-
 void pmt_free(struct pmt_table *pmt)
 {
 	if (pmt->dentry && pmt->dentry->name)
@@ -189,21 +181,21 @@ static void pmt_populate_stream_dir(struct pmt_stream *stream, const char *descr
 		stream_type_is_mpe(stream->stream_type_identifier) ||
 		stream_type_is_object_carousel(stream->stream_type_identifier)) {
 		/* Assign this PID to the DSM-CC parser */
-		if (! hashtable_get(priv->psi_parsers, stream->elementary_stream_pid))
-			hashtable_add(priv->psi_parsers, stream->elementary_stream_pid, dsmcc_parse, NULL);
+		if (! priv->pid_contexts[stream->elementary_stream_pid].psi_parser)
+			ts_set_psi_parser(stream->elementary_stream_pid, dsmcc_parse, priv);
 	} else if (stream_type_is_audio(stream->stream_type_identifier)) {
 		/* Assign this to the PES audio parser */
-		if (! hashtable_get(priv->pes_parsers, stream->elementary_stream_pid))
-			hashtable_add(priv->pes_parsers, stream->elementary_stream_pid, pes_parse_audio, NULL);
+		if (! priv->pid_contexts[stream->elementary_stream_pid].pes_parser)
+			ts_set_pes_parser(stream->elementary_stream_pid, pes_parse_audio, priv);
 	} else if (stream_type_is_video(stream->stream_type_identifier)) {
 		/* Assign this to the PES video parser */
-		if (! hashtable_get(priv->pes_parsers, stream->elementary_stream_pid))
-			hashtable_add(priv->pes_parsers, stream->elementary_stream_pid, pes_parse_video, NULL);
-	} else if (! hashtable_get(priv->pes_parsers, stream->elementary_stream_pid)) {
+		if (! priv->pid_contexts[stream->elementary_stream_pid].pes_parser)
+			ts_set_pes_parser(stream->elementary_stream_pid, pes_parse_video, priv);
+	} else if (! priv->pid_contexts[stream->elementary_stream_pid].pes_parser) {
 		/* Assign this to the PES generic parser */
 		TS_INFO("Will parse pid %#x / stream_type %#x using a generic PES parser", 
 				stream->elementary_stream_pid, stream->stream_type_identifier);
-		hashtable_add(priv->psi_parsers, stream->elementary_stream_pid, pes_parse_other, NULL);
+		ts_set_psi_parser(stream->elementary_stream_pid, pes_parse_other, priv);
 	}
 }
 
@@ -225,7 +217,7 @@ static void pmt_create_directory(const struct ts_header *header, struct pmt_tabl
 	pmt_populate(pmt, *version_dentry, priv);
 }
 
-int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+static int pmt_parse_sections(const struct ts_header *header, const struct psi_section_set *set,
 		struct demuxfs_data *priv)
 {
 	struct pmt_table *current_pmt = NULL;
@@ -236,12 +228,12 @@ int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	assert(pmt->dentry);
 
 	/* Copy data up to the first loop entry */
-	int ret = psi_parse((struct psi_common_header *) pmt, payload, payload_len);
+	const char *payload = set->payload[0];
+	int ret = psi_parse((struct psi_common_header *) pmt, payload, set->payload_len[0]);
 	if (ret < 0) {
 		pmt_free(pmt);
 		return 0;
 	}
-	pmt_check_header(pmt);
 	
 	/* Set hash key and check if there's already one version of this table in the hash */
 	pmt->dentry->inode = TS_PACKET_HASH_KEY(header, pmt);
@@ -253,8 +245,8 @@ int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		return 0;
 	}
 	
-	TS_INFO("PMT parser: pid=%#x, table_id=%#x, current_pmt=%p, pmt->version_number=%#x, len=%d", 
-			header->pid, pmt->table_id, current_pmt, pmt->version_number, payload_len);
+	TS_INFO("PMT parser: pid=%#x, table_id=%#x, current_pmt=%p, pmt->version_number=%#x, sections=%d", 
+			header->pid, pmt->table_id, current_pmt, pmt->version_number, set->count);
 
 	/* Parse PMT specific bits */
 	struct dentry *version_dentry;
@@ -265,47 +257,53 @@ int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	pmt->num_descriptors = descriptors_count(&payload[12], pmt->program_information_length);
 	pmt_create_directory(header, pmt, &version_dentry, priv);
 
-	uint32_t descriptors_len = descriptors_parse(&payload[12], pmt->num_descriptors, 
-			version_dentry, priv);
+	descriptors_parse(&payload[12], pmt->num_descriptors, version_dentry, priv);
 
-	uint32_t offset = 12 + descriptors_len;
 	pmt->num_programs = 0;
-	while (offset < 3 + pmt->section_length - sizeof(pmt->crc)) {
-		struct pmt_stream stream;
-		stream.stream_type_identifier = payload[offset];
-		stream.reserved_1 = (payload[offset+1] >> 5) & 0x7;
-		stream.elementary_stream_pid = CONVERT_TO_16(payload[offset+1], payload[offset+2]) & 0x1fff;
-		stream.reserved_2 = (payload[offset+3] >> 4) & 0x0f; 
-		stream.es_information_length = CONVERT_TO_16(payload[offset+3], payload[offset+4]) & 0x0fff;
+	for (uint16_t s=0; s<set->count; ++s) {
+		/* Each section lists its own elementary streams after the program descriptors */
+		payload = set->payload[s];
+		uint16_t section_length = CONVERT_TO_16(payload[1], payload[2]) & 0x0fff;
+		uint32_t offset = 12 + (CONVERT_TO_16(payload[10], payload[11]) & 0x0fff);
+		while (offset < 3 + section_length - sizeof(pmt->crc)) {
+			struct pmt_stream stream;
+			stream.stream_type_identifier = payload[offset];
+			stream.reserved_1 = (payload[offset+1] >> 5) & 0x7;
+			stream.elementary_stream_pid = CONVERT_TO_16(payload[offset+1], payload[offset+2]) & 0x1fff;
+			stream.reserved_2 = (payload[offset+3] >> 4) & 0x0f; 
+			stream.es_information_length = CONVERT_TO_16(payload[offset+3], payload[offset+4]) & 0x0fff;
 
-		uint32_t es_i = 0;
-		if (! stream.es_information_length) {
-				struct dentry *subdir = NULL;
-				pmt_populate_stream_dir(&stream, NULL, version_dentry, &subdir, priv);
-		} else {
-			while (es_i < stream.es_information_length) {
-				struct dentry *subdir = NULL;
-				const char *descriptor_info = &payload[offset+5+es_i];
-				pmt_populate_stream_dir(&stream, descriptor_info, version_dentry, &subdir, priv);
+			uint32_t es_i = 0;
+			if (! stream.es_information_length) {
+					struct dentry *subdir = NULL;
+					pmt_populate_stream_dir(&stream, NULL, version_dentry, &subdir, priv);
+			} else {
+				while (es_i < stream.es_information_length) {
+					struct dentry *subdir = NULL;
+					const char *descriptor_info = &payload[offset+5+es_i];
+					pmt_populate_stream_dir(&stream, descriptor_info, version_dentry, &subdir, priv);
 
-				priv->shared_data = (void *) &stream;
-				es_i += descriptors_parse(descriptor_info, 1, subdir, priv);
-				priv->shared_data = NULL;
+					descriptors_set_shared_data(&stream);
+					es_i += descriptors_parse(descriptor_info, 1, subdir, priv);
+					descriptors_set_shared_data(NULL);
+				}
 			}
-		}
 
-		offset += 5 + stream.es_information_length;
-		pmt->num_programs++;
+			offset += 5 + stream.es_information_length;
+			pmt->num_programs++;
+		}
 	}
-	offset = 12 + pmt->program_information_length;
 
-	if (current_pmt) {
-		fsutils_migrate_children(current_pmt->dentry, pmt->dentry);
-		hashtable_del(priv->psi_tables, current_pmt->dentry->inode);
-		/* Invalidate all items from the PES hash table */
-		hashtable_invalidate_contents(priv->pes_tables);
-	}
-	hashtable_add(priv->psi_tables, pmt->dentry->inode, pmt, (hashtable_free_function_t) pmt_free);
+	if (current_pmt)
+		/* Invalidate the FIFO dentries cached by the PES parser */
+		ts_invalidate_fifo_dentries(priv);
+	psi_replace_table(current_pmt, pmt, (hashtable_free_function_t) pmt_free, priv);
 
 	return 0;
 }
+
+int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return psi_assemble(header, payload, payload_len, pmt_parse_sections, priv);
+}
@@ -29,6 +29,7 @@
 #include "demuxfs.h"
 #include "fsutils.h"
 #include "xattr.h"
+#include "hash.h"
 #include "ts.h"
 #include "byteops.h"
 #include "tables/psi.h"
@@ -50,6 +51,27 @@ void psi_populate(void **table, struct dentry *parent)
 	CREATE_FILE_NUMBER(dir, header, last_section_number);
 }
 
+/**
+ * psi_replace_table: stores @table in the tables hash in place of @current, the version
+ * it supersedes, if any, after moving the files of @current over to it. Both versions
+ * may share the table dentry, which then stays with @table when @current is freed.
+ */
+void psi_replace_table(void *current, void *table, void (*free_function)(void *),
+		struct demuxfs_data *priv)
+{
+	struct psi_common_header *old = (struct psi_common_header *) current;
+	struct psi_common_header *new = (struct psi_common_header *) table;
+
+	if (old) {
+		if (old->dentry == new->dentry)
+			old->dentry = NULL;
+		else
+			fsutils_migrate_children(old->dentry, new->dentry);
+		hashtable_del(priv->psi_tables, new->dentry->inode);
+	}
+	hashtable_add(priv->psi_tables, new->dentry->inode, table, free_function);
+}
+
 void psi_dump_header(struct psi_common_header *header)
 {
 	dprintf("table_id=%#x\nsection_syntax_indicator=%d\nsection_length=%d\n"
@@ -103,3 +125,104 @@ int psi_parse(struct psi_common_header *header, const char * payload, uint32_t p
 	return 0;
 }
 
+
+/**
+ * psi_section_set_release: drops the copies of the sections gathered so far.
+ */
+static void psi_section_set_release(struct psi_section_set *set)
+{
+	int i;
+	for (i=0; i<set->count; ++i) {
+		free(set->payload[i]);
+		set->payload[i] = NULL;
+		set->payload_len[i] = 0;
+	}
+	set->received = 0;
+}
+
+void psi_section_set_free(struct psi_section_set *set)
+{
+	psi_section_set_release(set);
+	free(set);
+}
+
+/**
+ * psi_assemble: gathers the sections 0..last_section_number of a sub-table
+ * version and hands them over to @parse_function once all of them are in.
+ * Sections of versions which have already been parsed are dropped.
+ * @return the value returned by @parse_function, or 0 while sections are missing.
+ */
+int psi_assemble(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		psi_section_set_parse_function_t parse_function, struct demuxfs_data *priv)
+{
+	struct psi_common_header section;
+	struct psi_section_set *set;
+	struct hash_table *sets = priv->psi_section_sets;
+	ino_t key;
+	int ret;
+
+	memset(&section, 0, sizeof(section));
+	ret = psi_parse(&section, payload, payload_len);
+	if (ret < 0)
+		return ret;
+	if (! section.current_next_indicator)
+		return 0;
+	if (section.section_number > section.last_section_number) {
+		TS_WARNING("section_number %d is past last_section_number %d (table_id=%#x)",
+			section.section_number, section.last_section_number, section.table_id);
+		return -EINVAL;
+	}
+
+	key = PSI_SECTION_SET_HASH_KEY(header, &section);
+	set = hashtable_get(sets, key);
+	if (! set) {
+		set = (struct psi_section_set *) calloc(1, sizeof(struct psi_section_set));
+		assert(set);
+		hashtable_add(sets, key, set, (hashtable_free_function_t) psi_section_set_free);
+	} else if (set->version_number == section.version_number &&
+		set->count == section.last_section_number + 1) {
+		if (set->parsed || set->payload[section.section_number])
+			/* Nothing new to us */
+			return 0;
+	} else {
+		/* A new version (or a different layout) of the sub-table begins */
+		if (set->received && ! set->parsed)
+			/* Copies of the sections thrown away here must not be taken for repeats */
+			ts_invalidate_sections(header, set->table_id, set->identifier, set->count, priv);
+		psi_section_set_release(set);
+		set->count = 0;
+	}
+
+	if (set->received == 0) {
+		set->table_id = section.table_id;
+		set->identifier = section.identifier;
+		set->version_number = section.version_number;
+		set->count = section.last_section_number + 1;
+		set->parsed = false;
+		clock_gettime(CLOCK_MONOTONIC, &set->first_seen);
+	}
+
+	set->payload[section.section_number] = malloc(payload_len);
+	assert(set->payload[section.section_number]);
+	memcpy(set->payload[section.section_number], payload, payload_len);
+	set->payload_len[section.section_number] = payload_len;
+	if (++set->received < set->count)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &set->completed);
+	if (set->count > 1)
+		dprintf("table_id %#x, identifier %#x, version %d: %d sections assembled in %ld ms",
+			set->table_id, set->identifier, set->version_number, set->count,
+			(set->completed.tv_sec - set->first_seen.tv_sec) * 1000 +
+			(set->completed.tv_nsec - set->first_seen.tv_nsec) / 1000000);
+
+	ret = parse_function(header, set, priv);
+
+	/* The parser keeps what it needs: let go of the sections */
+	psi_section_set_release(set);
+	set->parsed = ret >= 0;
+	if (ret < 0)
+		/* The section cache has seen them all, yet they must be gathered again */
+		ts_invalidate_sections(header, set->table_id, set->identifier, set->count, priv);
+	return ret;
+}
@@ -24,9 +24,47 @@ struct psi_common_header {
 	PSI_HEADER();
 } __attribute__((__packed__));
 
+/* A sub-table is made of up to 256 sections */
+#define PSI_MAX_SECTIONS 256
+
+/* Sets of sections are keyed by table_id_extension, PID and table_id */
+#define PSI_SECTION_SET_HASH_KEY(ts_header,psi_header) \
+	(((ino_t) ((struct psi_common_header *)(psi_header))->identifier << 24) | \
+	 TS_PACKET_HASH_KEY(ts_header, psi_header))
+
+/**
+ * Sections of one version of a sub-table, as gathered by psi_assemble()
+ */
+struct psi_section_set {
+	uint8_t table_id;
+	uint16_t identifier;
+	uint8_t version_number;
+	/* Number of sections in this version (last_section_number + 1) */
+	uint16_t count;
+	uint16_t received;
+	/* The table parser has already consumed this version */
+	bool parsed;
+	/* When the first section came in and when the last missing one did */
+	struct timespec first_seen;
+	struct timespec completed;
+	/* Copies of the sections, ordered by section_number */
+	char *payload[PSI_MAX_SECTIONS];
+	uint32_t payload_len[PSI_MAX_SECTIONS];
+};
+
+struct ts_header;
+struct demuxfs_data;
+typedef int (*psi_section_set_parse_function_t)(const struct ts_header *header,
+		const struct psi_section_set *set, struct demuxfs_data *priv);
+
 /* Function prototypes */
 void psi_populate(void **table, struct dentry *parent);
 int psi_parse(struct psi_common_header *header, const char *payload, uint32_t payload_len);
 void psi_dump_header(struct psi_common_header *header);
+int psi_assemble(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		psi_section_set_parse_function_t parse_function, struct demuxfs_data *priv);
+void psi_section_set_free(struct psi_section_set *set);
+void psi_replace_table(void *current, void *table, void (*free_function)(void *),
+		struct demuxfs_data *priv);
 
 #endif /* __psi_h */
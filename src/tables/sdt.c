@@ -41,14 +41,6 @@
 #include "tables/pes.h"
 #include "tables/pat.h"
 
-static void sdt_check_header(struct sdt_table *sdt)
-{
-	if (sdt->section_number != 0)
-		TS_WARNING("section_number != 0");
-	if (sdt->last_section_number != 0)
-		TS_WARNING("last_section_number != 0");
-}
-
 void sdt_free(struct sdt_table *sdt)
 {
 	if (sdt->dentry && sdt->dentry->name)
@@ -78,7 +70,7 @@ static void sdt_create_directory(const struct ts_header *header, struct sdt_tabl
 	//sdt_populate(sdt, *version_dentry, priv);
 }
 
-int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+static int sdt_parse_sections(const struct ts_header *header, const struct psi_section_set *set,
 		struct demuxfs_data *priv)
 {
 	struct sdt_table *current_sdt = NULL;
@@ -89,12 +81,11 @@ int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	assert(sdt->dentry);
 
 	/* Copy data up to the first loop entry */
-	int ret = psi_parse((struct psi_common_header *) sdt, payload, payload_len);
+	int ret = psi_parse((struct psi_common_header *) sdt, set->payload[0], set->payload_len[0]);
 	if (ret < 0) {
 		sdt_free(sdt);
 		return ret;
 	}
-	sdt_check_header(sdt);
 	
 	/* Set hash key and check if there's already one version of this table in the hash */
 	sdt->dentry->inode = TS_PACKET_HASH_KEY(header, sdt);
@@ -105,67 +96,78 @@ int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		sdt_free(sdt);
 		return 0;
 	}
+
+	/* Count the services announced by all sections before touching the filesystem */
+	uint32_t crc;
+	uint32_t j, i, s;
+	for (s=0; s<set->count; ++s) {
+		uint32_t payload_len = set->payload_len[s];
+		const char *payload = set->payload[s];
+		for (i=11; i < payload_len-sizeof(crc); ) {
+			uint16_t descriptor_loop_length = CONVERT_TO_16(payload[i+3], payload[i+4]) & 0x0FFF;
+			i += 5 + descriptor_loop_length;
+			if (i > payload_len - 4) {
+				TS_WARNING("descriptor_loop_length exceeds table size");
+				sdt_free(sdt);
+				return -EINVAL;
+			}
+			sdt->_number_of_services++;
+		}
+	}
 	
-	TS_INFO("SDT parser: pid=%#x, table_id=%#x, current_sdt=%p, sdt->version_number=%#x, len=%d", 
-			header->pid, sdt->table_id, current_sdt, sdt->version_number, payload_len);
+	TS_INFO("SDT parser: pid=%#x, table_id=%#x, current_sdt=%p, sdt->version_number=%#x, sections=%d", 
+			header->pid, sdt->table_id, current_sdt, sdt->version_number, set->count);
 
 	/* Parse SDT specific bits */
 	struct dentry *version_dentry = NULL;
 	sdt_create_directory(header, sdt, &version_dentry, priv);
 
-	sdt->original_network_id = CONVERT_TO_16(payload[8], payload[9]);
-	sdt->reserved_future_use = payload[10];
+	sdt->original_network_id = CONVERT_TO_16(set->payload[0][8], set->payload[0][9]);
+	sdt->reserved_future_use = set->payload[0][10];
 	CREATE_FILE_NUMBER(version_dentry, sdt, original_network_id);
-	
-	uint32_t crc;
-	uint32_t j, i = 11;
-	while (i < payload_len-sizeof(crc)) {
-		uint16_t descriptor_loop_length = CONVERT_TO_16(payload[i+3], payload[i+4]) & 0x0FFF;
-		i += 5 + descriptor_loop_length;
-		if (i > payload_len - 4) {
-			TS_WARNING("descriptor_loop_length exceeds table size");
-			sdt_free(sdt);
-			return -EINVAL;
-		}
-		sdt->_number_of_services++;
-	}
 
 	sdt->_services = calloc(sdt->_number_of_services, sizeof(struct sdt_service_info));
-	for (j=0, i=11; j < sdt->_number_of_services; ++j) {
-		struct sdt_service_info *si = &sdt->_services[j];
-		struct dentry *service_dentry = CREATE_DIRECTORY(version_dentry, "Service_%02d", j+1);
-
-		si->service_id = CONVERT_TO_16(payload[i], payload[i+1]);
-		si->reserved_future_use = (payload[i+2] >> 2) & 0x3f;
-		si->eit_schedule_flag = (payload[i+2] >> 1) & 0x01;
-		si->eit_present_following_flag = payload[i+2] & 0x01;
-		si->running_status = (payload[i+3] >> 5) & 0x07;
-		si->free_ca_mode = (payload[i+3] >> 4) & 0x01;
-		si->descriptors_loop_length = CONVERT_TO_16(payload[i+3], payload[i+4]) & 0x0fff;
-		CREATE_FILE_NUMBER(service_dentry, si, service_id);
-		CREATE_FILE_NUMBER(service_dentry, si, eit_schedule_flag);
-		CREATE_FILE_NUMBER(service_dentry, si, eit_present_following_flag);
-		CREATE_FILE_NUMBER(service_dentry, si, running_status);
-		CREATE_FILE_NUMBER(service_dentry, si, free_ca_mode);
-		CREATE_FILE_NUMBER(service_dentry, si, descriptors_loop_length);
-
-		if (! pat_announces_service(si->service_id, priv))
-			TS_WARNING("service_id %#x not declared by the PAT", si->service_id);
-
-		uint32_t n = 0;
-		while (n < si->descriptors_loop_length) {
-			uint8_t descriptor_length = payload[i+5+n+1];
-			descriptors_parse(&payload[i+5+n], 1, service_dentry, priv);
-			n += 2 + descriptor_length;
+	for (j=0, s=0; s<set->count; ++s) {
+		uint32_t payload_len = set->payload_len[s];
+		const char *payload = set->payload[s];
+		for (i=11; i < payload_len-sizeof(crc); ++j) {
+			struct sdt_service_info *si = &sdt->_services[j];
+			struct dentry *service_dentry = CREATE_DIRECTORY(version_dentry, "Service_%02d", j+1);
+
+			si->service_id = CONVERT_TO_16(payload[i], payload[i+1]);
+			si->reserved_future_use = (payload[i+2] >> 2) & 0x3f;
+			si->eit_schedule_flag = (payload[i+2] >> 1) & 0x01;
+			si->eit_present_following_flag = payload[i+2] & 0x01;
+			si->running_status = (payload[i+3] >> 5) & 0x07;
+			si->free_ca_mode = (payload[i+3] >> 4) & 0x01;
+			si->descriptors_loop_length = CONVERT_TO_16(payload[i+3], payload[i+4]) & 0x0fff;
+			CREATE_FILE_NUMBER(service_dentry, si, service_id);
+			CREATE_FILE_NUMBER(service_dentry, si, eit_schedule_flag);
+			CREATE_FILE_NUMBER(service_dentry, si, eit_present_following_flag);
+			CREATE_FILE_NUMBER(service_dentry, si, running_status);
+			CREATE_FILE_NUMBER(service_dentry, si, free_ca_mode);
+			CREATE_FILE_NUMBER(service_dentry, si, descriptors_loop_length);
+
+			if (! pat_announces_service(si->service_id, priv))
+				TS_WARNING("service_id %#x not declared by the PAT", si->service_id);
+
+			uint32_t n = 0;
+			while (n < si->descriptors_loop_length) {
+				uint8_t descriptor_length = payload[i+5+n+1];
+				descriptors_parse(&payload[i+5+n], 1, service_dentry, priv);
+				n += 2 + descriptor_length;
+			}
+			i += 5 + si->descriptors_loop_length;
 		}
-		i += 5 + si->descriptors_loop_length;
 	}
 
-	if (current_sdt) {
-		fsutils_migrate_children(current_sdt->dentry, sdt->dentry);
-		hashtable_del(priv->psi_tables, current_sdt->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, sdt->dentry->inode, sdt, (hashtable_free_function_t) sdt_free);
+	psi_replace_table(current_sdt, sdt, (hashtable_free_function_t) sdt_free, priv);
 
 	return 0;
 }
+
+int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return psi_assemble(header, payload, payload_len, sdt_parse_sections, priv);
+}
@@ -212,11 +212,7 @@ int sdtt_parse(const struct ts_header *header, const char *payload, uint32_t pay
 		descriptors_parse(&payload[index], c->_num_descriptors, subdir, priv);
 	}
 
-	if (current_sdtt) {
-		fsutils_migrate_children(current_sdtt->dentry, sdtt->dentry);
-		hashtable_del(priv->psi_tables, current_sdtt->dentry->inode);
-	}
-	hashtable_add(priv->psi_tables, sdtt->dentry->inode, sdtt, (hashtable_free_function_t) sdtt_free);
+	psi_replace_table(current_sdtt, sdtt, (hashtable_free_function_t) sdtt_free, priv);
 
 	return 0;
 }
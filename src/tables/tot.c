@@ -38,6 +38,7 @@
 #include "component_tag.h"
 #include "tables/psi.h"
 #include "tables/tot.h"
+#include "tables/epg.h"
 #include "tables/pes.h"
 #include "tables/pat.h"
 
@@ -163,6 +164,7 @@ int tot_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	
 	/* Parse TOT specific bits */
 	tot->_utc3_time = CONVERT_TO_40(payload[3], payload[4], payload[5], payload[6], payload[7]) & 0xffffffffff;
+	epg_set_stream_time(epg_convert_time(tot->_utc3_time));
 	tot->reserved_4 = payload[8] >> 4;
 	tot->descriptors_loop_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
 	num_descriptors = descriptors_count(&payload[10], tot->descriptors_loop_length);
@@ -30,10 +30,10 @@
 #include "demuxfs.h"
 #include "buffer.h"
 #include "byteops.h"
-#include "hash.h"
 #include "ts.h"
 #include "crc32.h"
 #include "fsutils.h"
+#include "ring.h"
 
 /* PSI tables */
 #include "tables/psi.h"
@@ -46,12 +46,99 @@
 #include "tables/tot.h"
 #include "tables/eit.h"
 
-struct packet_parser {
-	uint8_t table_id;
-	int32_t pid;
+/**
+ * Parsers of the well-known tables, indexed by table_id. Tables which may only
+ * be carried on specific PIDs list them in @pid; -1 means any PID. Parsers which
+ * have @unlocked set are invoked without the parser mutex, and take it themselves
+ * once their section is decoded.
+ */
+struct table_dispatch {
 	parse_function_t parser;
+	int32_t pid[2];
+	bool unlocked;
+};
+
+#define ANY_PID(parser)           { parser, { -1, -1 }, false }
+#define ANY_PID_UNLOCKED(parser)  { parser, { -1, -1 }, true }
+#define ON_PID(parser,pid)        { parser, { pid, pid }, false }
+#define ON_PIDS(parser,p1,p2)     { parser, { p1, p2 }, false }
+
+static const struct table_dispatch ts_table_dispatch[256] = {
+	[TS_PAT_TABLE_ID]                        = ON_PID(pat_parse, TS_PAT_PID),
+	[TS_PMT_TABLE_ID]                        = ANY_PID(pmt_parse),
+	[TS_NIT_TABLE_ID]                        = ON_PID(nit_parse, TS_NIT_PID),
+	[TS_SDT_TABLE_ID]                        = ON_PID(sdt_parse, TS_SDT_PID),
+	[TS_TOT_TABLE_ID]                        = ANY_PID(tot_parse),
+	[TS_SDTT_TABLE_ID]                       = ON_PIDS(sdtt_parse, TS_SDTT1_PID, TS_SDTT2_PID),
+//	[TS_CDT_TABLE_ID]                        = ON_PID(cdt_parse, TS_CDT_PID),
+//	[TS_TDT_TABLE_ID]                        = ANY_PID(tdt_parse),
+	[TS_H_EIT_P_F_TABLE_ID]                  = ANY_PID_UNLOCKED(eit_parse),
+	[TS_H_EIT_SCHEDULE_1_BASIC_TABLE_ID ...
+	 TS_H_EIT_SCHEDULE_EXTENDED_8_TABLE_ID]  = ANY_PID_UNLOCKED(eit_parse),
 };
 
+/* PIDs which carry PSI sections regardless of the PAT and PMT contents */
+static const uint16_t ts_psi_pids[] = {
+	TS_PAT_PID, TS_CAT_PID, TS_NIT_PID, TS_SDT_PID /* or TS_BAT_PID */,
+	TS_H_EIT_PID, TS_M_EIT_PID, TS_L_EIT_PID, TS_RST_PID, TS_TDT_PID,
+	TS_DCT_PID, TS_DIT_PID, TS_SIT_PID, TS_PCAT_PID, TS_SDTT1_PID,
+	TS_SDTT2_PID, TS_BIT_PID, TS_NBIT_PID /* or TS_LDT_PID */, TS_CDT_PID,
+};
+
+/**
+ * ts_create_pid_contexts: allocates the per-PID contexts and flags the
+ * well-known PSI PIDs. Every other PID is ignored until a parser is assigned
+ * to it with ts_set_psi_parser() or ts_set_pes_parser().
+ */
+struct pid_context *ts_create_pid_contexts(void)
+{
+	struct pid_context *contexts = calloc(TS_MAX_PIDS, sizeof(struct pid_context));
+	int i;
+
+	assert(contexts);
+	for (i=0; i<sizeof(ts_psi_pids)/sizeof(ts_psi_pids[0]); ++i)
+		contexts[ts_psi_pids[i]].flags |= PID_CARRIES_PSI;
+	contexts[TS_PAT_PID].flags |= PID_ASSIGNS_PIDS;
+	return contexts;
+}
+
+void ts_destroy_pid_contexts(struct pid_context *contexts)
+{
+	int i;
+	for (i=0; i<TS_MAX_PIDS; ++i) {
+		if (contexts[i].buffer)
+			buffer_destroy(contexts[i].buffer);
+		free(contexts[i].section_cache);
+	}
+	free(contexts);
+}
+
+void ts_set_psi_parser(uint16_t pid, parse_function_t parser, struct demuxfs_data *priv)
+{
+	struct pid_context *ctx = &priv->pid_contexts[pid & 0x1fff];
+	/* PSI workers look the parser up before deciding whether to take the parser mutex */
+	__atomic_store_n(&ctx->psi_parser, parser, __ATOMIC_RELEASE);
+	/* The ingest and parser threads read the flags while PSI workers may be setting them */
+	__atomic_or_fetch(&ctx->flags, PID_CARRIES_PSI | (parser == pmt_parse ? PID_ASSIGNS_PIDS : 0), __ATOMIC_RELEASE);
+}
+
+void ts_set_pes_parser(uint16_t pid, parse_function_t parser, struct demuxfs_data *priv)
+{
+	struct pid_context *ctx = &priv->pid_contexts[pid & 0x1fff];
+	__atomic_store_n(&ctx->pes_parser, parser, __ATOMIC_RELEASE);
+	__atomic_or_fetch(&ctx->flags, PID_CARRIES_PES, __ATOMIC_RELEASE);
+}
+
+/**
+ * ts_invalidate_fifo_dentries: forgets the cached FIFO dentries of all PIDs.
+ */
+void ts_invalidate_fifo_dentries(struct demuxfs_data *priv)
+{
+	int i;
+	for (i=0; i<TS_MAX_PIDS; ++i)
+		priv->pid_contexts[i].fifo_dentry[0] = priv->pid_contexts[i].fifo_dentry[1] = NULL;
+}
+
 void ts_dump_header(const struct ts_header *header)
 {
 	fprintf(stdout, "--- ts header ---\n");
@@ -72,99 +159,83 @@ void ts_dump_payload(const char *payload, int len)
 	fprintf(stdout, "table_id=%#x\nsize=%#x (%d)\n", payload[0], size, size);
 }
 
-static bool ts_is_psi_packet(uint16_t pid, struct demuxfs_data *priv)
+/**
+ * ts_get_psi_parser: looks up the parser of @table_id on @pid. @unlocked tells
+ * whether it must be invoked without the parser mutex.
+ */
+static parse_function_t ts_get_psi_parser(const struct pid_context *ctx, uint16_t pid, uint8_t table_id,
+	bool *unlocked)
 {
-	parse_function_t parse_function;
+	const struct table_dispatch *dispatch = &ts_table_dispatch[table_id];
+	parse_function_t parser = __atomic_load_n(&ctx->psi_parser, __ATOMIC_ACQUIRE);
 
-	switch (pid) {
-		case TS_PAT_PID:
-		case TS_CAT_PID:
-		case TS_NIT_PID:
-		case TS_SDT_PID: /* or TS_BAT_PID */
-		case TS_H_EIT_PID:
-		case TS_M_EIT_PID:
-		case TS_L_EIT_PID:
-		case TS_RST_PID:
-		case TS_TDT_PID:
-		case TS_DCT_PID:
-		case TS_DIT_PID:
-		case TS_SIT_PID:
-		case TS_PCAT_PID:
-		case TS_SDTT1_PID:
-		case TS_SDTT2_PID:
-		case TS_BIT_PID:
-		case TS_NBIT_PID: /* or TS_LDT_PID */
-		case TS_CDT_PID:
-		case TS_NULL_PID:
-			return true;
-		default:
-			parse_function = (parse_function_t) hashtable_get(priv->psi_parsers, pid);
-			return parse_function ? true : false;
+	*unlocked = false;
+	if (parser)
+		return parser;
+	if (dispatch->parser && (dispatch->pid[0] == -1 || dispatch->pid[0] == pid || dispatch->pid[1] == pid)) {
+		*unlocked = dispatch->unlocked;
+		return dispatch->parser;
 	}
+	return NULL;
 }
 
-static bool ts_is_pes_packet(uint16_t pid, struct demuxfs_data *priv)
+/**
+ * ts_section_cache_slot: finds the entry of the repeated section cache which
+ * belongs to the table_id, table_id_extension and section_number of @data.
+ * @return the entry, or NULL if the section must always reach its parser.
+ */
+static struct section_cache_entry *ts_section_cache_slot(struct pid_context *ctx, const char *data,
+	uint32_t len, uint32_t *key)
 {
-	parse_function_t parse_function;
-	parse_function = (parse_function_t) hashtable_get(priv->pes_parsers, pid);
-	return parse_function ? true : false;
+	uint8_t table_id = data[0];
+
+	/* Only the long form of the sections carries table_id_extension and section_number */
+	if (! (data[1] & 0x80) || len < 12)
+		return NULL;
+
+	/*
+	 * The DII and DSI parsers act on repeated tables too, as the DDB blocks
+	 * they refer to may have arrived in the meantime. DDB blocks are only
+	 * stored once a DII announces their module, so a repeat may be needed.
+	 */
+	if (table_id == TS_DII_TABLE_ID || table_id == TS_DDB_TABLE_ID)
+		return NULL;
+
+	if (! ctx->section_cache) {
+		ctx->section_cache = calloc(SECTION_CACHE_SIZE, sizeof(struct section_cache_entry));
+		if (! ctx->section_cache)
+			return NULL;
+	}
+
+	*key = SECTION_CACHE_KEY(table_id, CONVERT_TO_16(data[3], data[4]), data[6]);
+	return &ctx->section_cache[SECTION_CACHE_INDEX(*key)];
 }
 
-static parse_function_t ts_get_psi_parser(const struct ts_header *header, uint8_t table_id,
-		struct demuxfs_data *priv)
+/**
+ * ts_invalidate_sections: forgets the sections 0 to @count-1 of a sub-table carried on
+ * the PID of @header, so that their next copies reach the parser again. Must be called
+ * from the thread which parses that PID.
+ */
+void ts_invalidate_sections(const struct ts_header *header, uint8_t table_id, uint16_t identifier,
+		uint16_t count, struct demuxfs_data *priv)
 {
-	uint16_t i, pid = header->pid;
-	parse_function_t parse_function;
-	struct packet_parser parser[] = {
-		{ TS_PAT_TABLE_ID,               TS_PAT_PID, pat_parse },
-		{ TS_PMT_TABLE_ID,                       -1, pmt_parse },
-		{ TS_NIT_TABLE_ID,               TS_NIT_PID, nit_parse },
-		{ TS_SDT_TABLE_ID,               TS_SDT_PID, sdt_parse },
-		{ TS_TOT_TABLE_ID,                       -1, tot_parse },
-		{ TS_SDTT_TABLE_ID,            TS_SDTT1_PID, sdtt_parse },
-		{ TS_SDTT_TABLE_ID,            TS_SDTT2_PID, sdtt_parse },
-//		{ TS_CDT_TABLE_ID,               TS_CDT_PID, cdt_parse },
-//		{ TS_TDT_TABLE_ID,                       -1, tdt_parse },
-		{ TS_L_EIT_TABLE_ID,                     -1, eit_parse },
-		{ TS_M_EIT_TABLE_ID,                     -1, eit_parse },
-		{ TS_H_EIT_P_F_TABLE_ID,                 -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_1_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_2_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_3_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_4_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_5_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_6_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_7_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_8_BASIC_TABLE_ID,    -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_1_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_2_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_3_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_4_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_5_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_6_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_7_TABLE_ID, -1, eit_parse },
-		{ TS_H_EIT_SCHEDULE_EXTENDED_8_TABLE_ID, -1, eit_parse },
-		{ 0, 0, NULL }
-	};
-
-	parse_function = (parse_function_t) hashtable_get(priv->psi_parsers, pid);
-	if (parse_function)
-		return parse_function;
-
-	for (i=0; parser[i].parser != NULL; ++i)
-		if (table_id == parser[i].table_id && (parser[i].pid == -1 || parser[i].pid == pid))
-			return parser[i].parser;
-
-	if ((pid == TS_NULL_PID) && (header->payload_unit_start_indicator != 0))
-		TS_WARNING("NULL packet has payload_unit_start_indicator != 0");
-
-    return NULL;
+	struct pid_context *ctx = &priv->pid_contexts[header->pid];
+
+	if (! ctx->section_cache)
+		return;
+	for (uint16_t i=0; i<count; ++i) {
+		uint32_t key = SECTION_CACHE_KEY(table_id, identifier, i);
+		struct section_cache_entry *slot = &ctx->section_cache[SECTION_CACHE_INDEX(key)];
+		if (slot->key == key)
+			slot->valid = false;
+	}
 }
 
-static bool continuity_counter_is_ok(const struct ts_header *header, struct buffer *buffer, bool psi,
+static bool continuity_counter_is_ok(const struct ts_header *header, struct pid_context *ctx, bool psi,
 	struct demuxfs_data *priv)
 {
-	uint8_t last_cc = buffer->continuity_counter;
+	struct buffer *buffer = ctx->buffer;
+	uint8_t last_cc = ctx->continuity_counter;
 	uint8_t this_cc = header->continuity_counter;
 	bool buf_empty = buffer_get_current_size(buffer) == 0;
 
@@ -187,9 +258,60 @@ static bool continuity_counter_is_ok(const struct ts_header *header, struct buff
 }
 
 /**
- * ts_parse_packet - Parse a transport stream packet. Called by the backend's process() function.
+ * ts_parse_section: runs the PSI parser of a complete section, unless it's a
+ * repeat of the last copy of the same section carried on this PID.
  */
-int ts_parse_packet(const struct ts_header *header, const char *payload, struct demuxfs_data *priv)
+static int ts_parse_section(const struct ts_header *header, struct pid_context *ctx, const char *data,
+	uint32_t len, struct demuxfs_data *priv)
+{
+	parse_function_t parse_function;
+	struct section_cache_entry *slot;
+	uint8_t table_id = data[0];
+	uint32_t key = 0, crc;
+	bool crc_ok, unlocked;
+	int ret = 0;
+
+	/*
+	 * Tables are retransmitted over and over again, and their parsers
+	 * only find out that nothing changed after allocating and decoding
+	 * them. Sections whose CRC_32 field matches the one of the last
+	 * copy that passed the CRC check and its parser are dropped right away.
+	 */
+	crc = CONVERT_TO_32(data[len-4], data[len-3], data[len-2], data[len-1]);
+	slot = ts_section_cache_slot(ctx, data, len, &key);
+	if (slot)
+		__atomic_fetch_add(&priv->section_cache_lookups, 1, __ATOMIC_RELAXED);
+	if (slot && slot->valid && slot->key == key && slot->crc32 == crc) {
+		__atomic_fetch_add(&priv->section_cache_hits, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	crc_ok = crc32_check(data, len);
+	if (! crc_ok && priv->options.verbose_mask & CRC_ERROR)
+		TS_WARNING("CRC error on PID %d(%#x), table_id %d(%#x)", 
+			header->pid, header->pid, table_id, table_id);
+	else if ((parse_function = ts_get_psi_parser(ctx, header->pid, table_id, &unlocked))) {
+		/* Parsers share the dentry tree and the PSI tables, and may assign parsers to other PIDs */
+		if (! unlocked)
+			pthread_mutex_lock(&priv->parser_mutex);
+		/* Invoke the PSI parser for this packet */
+		ret = parse_function(header, data, len, priv);
+		if (! unlocked)
+			pthread_mutex_unlock(&priv->parser_mutex);
+	}
+	if (slot && crc_ok && ret >= 0) {
+		slot->key = key;
+		slot->crc32 = crc;
+		slot->valid = true;
+	}
+	return ret;
+}
+
+/**
+ * ts_parse_payload: parses the payload of a packet of a PID which has been assigned a parser.
+ */
+static int ts_parse_payload(const struct ts_header *header, const char *payload, struct pid_context *ctx,
+	struct demuxfs_data *priv)
 {
 	int ret = 0;
 	uint8_t pointer_field = 0;
@@ -197,11 +319,7 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 	const char *payload_end;
 	const char *payload_start = payload;
 	parse_function_t parse_function;
-		
-	if (header->sync_byte != TS_SYNC_BYTE) {
-		TS_WARNING("sync_byte != %#x (%#x)", TS_SYNC_BYTE, header->sync_byte);
-		return -EBADMSG;
-	}
+	uint8_t flags = __atomic_load_n(&ctx->flags, __ATOMIC_ACQUIRE);
 
 	if (header->adaptation_field == 0x00) {
 		/* ITU-T Rec. H.222.0 decoders shall discard this packet */
@@ -230,12 +348,11 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 		
 	struct buffer *buffer = NULL;
 
-	if (ts_is_psi_packet(header->pid, priv)) {
+	if (flags & PID_CARRIES_PSI) {
 		const char *start = payload_start;
 		const char *end = payload_end;
 		bool is_new_packet = false;
 		bool pusi = header->payload_unit_start_indicator;
-		uint8_t table_id;
 
 		if (pusi) {
 			/* The first byte of the payload carries the pointer_field */
@@ -257,14 +374,17 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 		}
 
 		while (start <= payload_end) {
-			buffer = hashtable_get(priv->packet_buffer, header->pid);
+			bool whole_section = is_new_packet && section_length > 0 &&
+				(start + section_length + 2) <= payload_end;
+
+			buffer = ctx->buffer;
 			if (! buffer && is_new_packet) {
 				buffer = buffer_create(header->pid, section_length + 3, false);
 				if (! buffer)
 					return 0;
-				buffer->continuity_counter = header->continuity_counter;
-				hashtable_add(priv->packet_buffer, header->pid, buffer, NULL);
-			} else if (buffer && ! continuity_counter_is_ok(header, buffer, true, priv)) {
+				ctx->continuity_counter = header->continuity_counter;
+				ctx->buffer = buffer;
+			} else if (buffer && ! continuity_counter_is_ok(header, ctx, true, priv)) {
 				return 0;
 			} else if (buffer && buffer->current_size == 0 && ! is_new_packet) {
 				/*
@@ -284,17 +404,19 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 			if (is_new_packet && IS_STUFFING_PACKET(start))
 				buffer = NULL;
 
-			if (buffer) {
+			if (whole_section && ! IS_STUFFING_PACKET(start)) {
+				/*
+				 * The section starts and ends in this packet: hand the payload
+				 * to the parser as is and leave the buffer for sections which
+				 * span several packets.
+				 */
+				if (buffer)
+					buffer_reset_size(buffer);
+				ts_parse_section(header, ctx, start, section_length + 3, priv);
+			} else if (buffer) {
 				int ret = buffer_append(buffer, start, end - start + 1);
 				if (ret >= 0 && buffer_contains_full_psi_section(buffer)) {
-					table_id = buffer->data[0];
-					if (! crc32_check(buffer->data, buffer->current_size) && 
-						priv->options.verbose_mask & CRC_ERROR)
-						TS_WARNING("CRC error on PID %d(%#x), table_id %d(%#x)", 
-							header->pid, header->pid, table_id, table_id);
-					else if ((parse_function = ts_get_psi_parser(header, table_id, priv)))
-						/* Invoke the PSI parser for this packet */
-						ret = parse_function(header, buffer->data, buffer->current_size, priv);
+					ts_parse_section(header, ctx, buffer->data, buffer->current_size, priv);
 					buffer_reset_size(buffer);
 				}
 			}
@@ -322,40 +444,211 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 			pusi = false;
 			is_new_packet = true;
 		}
-	} else if (ts_is_pes_packet(header->pid, priv)) {
+	} else if (flags & PID_CARRIES_PES) {
 		bool pusi = header->payload_unit_start_indicator;
-		parse_function = (parse_function_t) hashtable_get(priv->pes_parsers, header->pid);
+		parse_function = __atomic_load_n(&ctx->pes_parser, __ATOMIC_ACQUIRE);
 
 		if ((pusi && payload_end - payload_start <= 6) || ! parse_function)
 			return 0;
 		else if (pusi) {
 			uint16_t size = CONVERT_TO_16(payload_start[4], payload_start[5]);
-			buffer = hashtable_get(priv->packet_buffer, header->pid);
+			buffer = ctx->buffer;
 			if (! buffer) {
 				buffer = buffer_create(header->pid, size, true);
 				if (! buffer)
 					return 0;
-				hashtable_add(priv->packet_buffer, header->pid, buffer, NULL);
+				ctx->buffer = buffer;
 			}
 			buffer_reset_size(buffer);
 			buffer_append(buffer, payload_start, payload_end - payload_start + 1);
 		} else {
-			buffer = hashtable_get(priv->packet_buffer, header->pid);
+			buffer = ctx->buffer;
 			if (! buffer)
 				return 0;
-			if (! continuity_counter_is_ok(header, buffer, false, priv))
+			if (! continuity_counter_is_ok(header, ctx, false, priv))
 				return 0;
 			if (buffer_get_current_size(buffer) == 0 && !buffer_is_unbounded(buffer))
 				return 0;
 			buffer_append(buffer, payload_start, payload_end - payload_start + 1);
 		}
 		if (buffer_contains_full_pes_section(buffer)) {
-			/* Invoke the PES parser for this packet */
+			/* Invoke the PES parser for this packet. It looks up its FIFOs in the dentry tree. */
+			pthread_mutex_lock(&priv->parser_mutex);
 			ret = parse_function(header, buffer->data, buffer->current_size, priv);
+			pthread_mutex_unlock(&priv->parser_mutex);
 			buffer_reset_size(buffer);
 		}
 	}
 	if (buffer)
-		buffer->continuity_counter = header->continuity_counter;
+		ctx->continuity_counter = header->continuity_counter;
 	return ret;
 }
+
+/**
+ * Sections of a given PID are always handled by the same PSI worker, which
+ * keeps them in order. Workers of different PIDs reassemble sections, check
+ * their CRCs and look them up in the section cache in parallel. The table
+ * parsers themselves still run one at a time under the parser mutex, since
+ * they decode straight into the shared dentry tree and PSI tables.
+ * @batch: slot of @ring being filled by the parser thread, if any
+ */
+struct psi_worker {
+	pthread_t thread;
+	struct ts_ring *ring;
+	struct ts_batch *batch;
+	struct demuxfs_data *priv;
+};
+
+/* Batches of packets queued to each PSI worker, and how many packets they hold */
+#define PSI_WORKER_RING_SIZE  64
+#define PSI_WORKER_BATCH_SIZE 32
+
+/* How long the parser thread and PSI workers sleep while waiting for each other */
+#define PSI_WORKER_POLL_USEC  1000
+
+static void *ts_psi_worker_thread(void *userdata)
+{
+	struct psi_worker *worker = (struct psi_worker *) userdata;
+	struct demuxfs_data *priv = worker->priv;
+	struct ts_batch *batch;
+	int i;
+
+	while (true) {
+		batch = ring_get_used_slot(worker->ring);
+		if (! batch) {
+			if (ring_is_drained(worker->ring))
+				break;
+			usleep(PSI_WORKER_POLL_USEC);
+			continue;
+		}
+		for (i=0; i<batch->count; ++i) {
+			struct ts_packet *packet = &batch->packets[i];
+			ts_parse_payload(&packet->header, packet->payload, &priv->pid_contexts[packet->header.pid], priv);
+		}
+		ring_release(worker->ring);
+	}
+	return NULL;
+}
+
+/**
+ * ts_queue_psi_packet: hands a packet over to the PSI worker of its PID.
+ */
+static int ts_queue_psi_packet(const struct ts_header *header, const char *payload, struct demuxfs_data *priv)
+{
+	struct psi_worker *worker = &priv->psi_workers[header->pid % priv->psi_worker_count];
+	struct ts_packet *packet;
+
+	while (! worker->batch) {
+		worker->batch = ring_get_free_slot(worker->ring);
+		if (worker->batch)
+			worker->batch->count = 0;
+		else
+			usleep(PSI_WORKER_POLL_USEC);
+	}
+
+	/* The payload starts right after the 4-byte packet header */
+	packet = &worker->batch->packets[worker->batch->count++];
+	packet->header = *header;
+	memcpy(packet->data, payload - 4, priv->options.packet_size);
+	packet->payload = &packet->data[4];
+
+	if (worker->batch->count == worker->ring->batch_size) {
+		ring_publish(worker->ring);
+		worker->batch = NULL;
+	}
+	return 0;
+}
+
+/**
+ * ts_flush_psi_workers: hands the packets queued so far over to the PSI workers.
+ */
+void ts_flush_psi_workers(struct demuxfs_data *priv)
+{
+	int i;
+
+	for (i=0; i<priv->psi_worker_count; ++i) {
+		struct psi_worker *worker = &priv->psi_workers[i];
+		if (worker->batch && worker->batch->count) {
+			ring_publish(worker->ring);
+			worker->batch = NULL;
+		}
+	}
+}
+
+/**
+ * ts_start_psi_workers: starts @count threads which parse PSI sections on
+ * behalf of ts_parse_packet(). Only the thread which calls ts_parse_packet() may
+ * start, flush and stop the workers.
+ * @return 0 on success or a negative errno value on errors.
+ */
+int ts_start_psi_workers(int count, struct demuxfs_data *priv)
+{
+	struct psi_worker *workers;
+	int i, err;
+
+	workers = (struct psi_worker *) calloc(count, sizeof(struct psi_worker));
+	if (! workers)
+		return -ENOMEM;
+
+	for (i=0; i<count; ++i) {
+		workers[i].priv = priv;
+		workers[i].ring = ring_create(PSI_WORKER_RING_SIZE, PSI_WORKER_BATCH_SIZE);
+		err = workers[i].ring ? pthread_create(&workers[i].thread, NULL, ts_psi_worker_thread, &workers[i]) : ENOMEM;
+		if (err) {
+			ring_destroy(workers[i].ring);
+			priv->psi_workers = workers;
+			priv->psi_worker_count = i;
+			ts_stop_psi_workers(priv);
+			return -err;
+		}
+	}
+	priv->psi_workers = workers;
+	priv->psi_worker_count = count;
+	return 0;
+}
+
+/**
+ * ts_stop_psi_workers: waits for the PSI workers to parse the packets queued to them and stops them.
+ */
+void ts_stop_psi_workers(struct demuxfs_data *priv)
+{
+	int i;
+
+	ts_flush_psi_workers(priv);
+	for (i=0; i<priv->psi_worker_count; ++i)
+		ring_set_eof(priv->psi_workers[i].ring);
+	for (i=0; i<priv->psi_worker_count; ++i) {
+		pthread_join(priv->psi_workers[i].thread, NULL);
+		ring_destroy(priv->psi_workers[i].ring);
+	}
+	free(priv->psi_workers);
+	priv->psi_workers = NULL;
+	priv->psi_worker_count = 0;
+}
+
+/**
+ * ts_parse_packet - Parse a transport stream packet. Called by the backend's process() function.
+ */
+int ts_parse_packet(const struct ts_header *header, const char *payload, struct demuxfs_data *priv)
+{
+	struct pid_context *ctx = &priv->pid_contexts[header->pid];
+	uint8_t flags;
+
+	if (header->sync_byte != TS_SYNC_BYTE) {
+		TS_WARNING("sync_byte != %#x (%#x)", TS_SYNC_BYTE, header->sync_byte);
+		return -EBADMSG;
+	}
+
+	flags = __atomic_load_n(&ctx->flags, __ATOMIC_ACQUIRE);
+	if (! flags)
+		/* NULL packets and PIDs which no parser has been assigned to */
+		return 0;
+
+	/*
+	 * The PAT and PMTs are parsed right away: otherwise the packets of the PIDs
+	 * they announce would be discarded until the PSI workers get to them.
+	 */
+	if (priv->psi_worker_count && (flags & PID_CARRIES_PSI) && ! (flags & PID_ASSIGNS_PIDS))
+		return ts_queue_psi_packet(header, payload, priv);
+	return ts_parse_payload(header, payload, ctx, priv);
+}
@@ -110,4 +110,55 @@ void ts_dump_psi_header(struct psi_common_header *header);
 typedef int (*parse_function_t)(const struct ts_header *header, const char *payload, uint32_t payload_len, 
 		struct demuxfs_data *priv);
 
+/* Number of PIDs addressable by the 13-bit PID field */
+#define TS_MAX_PIDS 8192
+
+/* Flags of struct pid_context */
+#define PID_CARRIES_PSI 0x01
+#define PID_CARRIES_PES 0x02
+#define PID_ASSIGNS_PIDS 0x04 /* PAT and PMTs, which must be parsed before the PIDs they announce */
+
+/* Entries of the per-PID cache of repeated sections */
+#define SECTION_CACHE_BITS 10
+#define SECTION_CACHE_SIZE (1 << SECTION_CACHE_BITS)
+#define SECTION_CACHE_KEY(table_id,identifier,section_number) \
+	(((uint32_t) (table_id) << 24) | ((uint32_t) (identifier) << 8) | ((section_number) & 0xff))
+#define SECTION_CACHE_INDEX(key) \
+	((((key) ^ ((key) >> 13)) * 0x9e3779b1U) >> (32 - SECTION_CACHE_BITS))
+
+/**
+ * CRC_32 of the last section parsed with a given table_id, table_id_extension
+ * and section_number, all packed in @key.
+ */
+struct section_cache_entry {
+	uint32_t key;
+	uint32_t crc32;
+	bool valid;
+};
+
+/**
+ * Per-PID parsing state. ts_parse_packet() indexes an array of TS_MAX_PIDS
+ * of these with the packet's PID, so the hot fields come first.
+ */
+struct pid_context {
+	uint8_t flags;                  /**< PID_CARRIES_PSI, PID_CARRIES_PES, PID_ASSIGNS_PIDS; 0 to ignore the PID */
+	uint8_t continuity_counter;     /**< Counter of the last packet appended to @buffer */
+	struct buffer *buffer;          /**< Incomplete sections or PES packets, which cannot be parsed yet */
+	parse_function_t psi_parser;    /**< Parser assigned by the PAT or PMT, NULL to dispatch on table_id */
+	parse_function_t pes_parser;    /**< PES parser assigned by the PMT */
+	struct dentry *fifo_dentry[2];  /**< ES and PES FIFO dentries, cached by the PES parser */
+	struct section_cache_entry *section_cache; /**< SECTION_CACHE_SIZE entries, allocated on demand */
+};
+
+struct pid_context *ts_create_pid_contexts(void);
+void ts_destroy_pid_contexts(struct pid_context *contexts);
+void ts_set_psi_parser(uint16_t pid, parse_function_t parser, struct demuxfs_data *priv);
+void ts_set_pes_parser(uint16_t pid, parse_function_t parser, struct demuxfs_data *priv);
+void ts_invalidate_fifo_dentries(struct demuxfs_data *priv);
+void ts_invalidate_sections(const struct ts_header *header, uint8_t table_id, uint16_t identifier,
+		uint16_t count, struct demuxfs_data *priv);
+int ts_start_psi_workers(int count, struct demuxfs_data *priv);
+void ts_stop_psi_workers(struct demuxfs_data *priv);
+void ts_flush_psi_workers(struct demuxfs_data *priv);
+
 #endif /* __ts_h */
@@ -0,0 +1,234 @@
+#ifndef __tssync_h
+#define __tssync_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "ts.h"
+#include "backend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_SYNC_SCAN_X86
+#endif
+
+/* How many sync bytes must line up at the packet stride to consider the stream aligned */
+#define TS_RESYNC_PACKETS 5
+
+/* Bytes pulled from the input at a time while looking for the sync byte */
+#define TS_RESYNC_CHUNK   (TS_RESYNC_PACKETS * TS_MAX_PACKET_SIZE * 4)
+
+/* Room for a whole batch of packets handed back to the resync buffer, plus a chunk */
+#define TS_RESYNC_WINDOW  65536
+
+/*
+ * The scanners below are included by the backends, which don't link against
+ * libdemuxfs. They look for the first offset @i in @buf such that the bytes at
+ * @i, @i+@stride, ..., @i+(@count-1)*@stride all hold the sync byte.
+ */
+
+static inline ssize_t ts_sync_scan_scalar(const uint8_t *buf, size_t len, size_t stride, int count, size_t start)
+{
+	size_t i, span = stride * (count-1);
+	int j;
+
+	for (i=start; i+span < len; ++i) {
+		if (buf[i] != TS_SYNC_BYTE)
+			continue;
+		for (j=1; j<count && buf[i+j*stride] == TS_SYNC_BYTE; ++j)
+			;
+		if (j == count)
+			return i;
+	}
+	return -1;
+}
+
+#ifdef TS_SYNC_SCAN_X86
+__attribute__((target("sse2")))
+static inline ssize_t ts_sync_scan_sse2(const uint8_t *buf, size_t len, size_t stride, int count)
+{
+	const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+	size_t i, span = stride * (count-1);
+	__m128i hits;
+	int j, mask;
+
+	for (i=0; i+span+16 <= len; i+=16) {
+		/* Most 16-byte blocks don't hold a single sync byte: bail out early on those */
+		hits = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &buf[i]), sync);
+		mask = _mm_movemask_epi8(hits);
+		for (j=1; mask && j<count; ++j) {
+			hits = _mm_and_si128(hits, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &buf[i+j*stride]), sync));
+			mask = _mm_movemask_epi8(hits);
+		}
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return ts_sync_scan_scalar(buf, len, stride, count, i);
+}
+
+__attribute__((target("avx2")))
+static inline ssize_t ts_sync_scan_avx2(const uint8_t *buf, size_t len, size_t stride, int count)
+{
+	const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+	size_t i, span = stride * (count-1);
+	__m256i hits;
+	uint32_t mask;
+	int j;
+
+	for (i=0; i+span+32 <= len; i+=32) {
+		hits = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &buf[i]), sync);
+		mask = _mm256_movemask_epi8(hits);
+		for (j=1; mask && j<count; ++j) {
+			hits = _mm256_and_si256(hits, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &buf[i+j*stride]), sync));
+			mask = _mm256_movemask_epi8(hits);
+		}
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return ts_sync_scan_scalar(buf, len, stride, count, i);
+}
+#endif /* TS_SYNC_SCAN_X86 */
+
+/**
+ * ts_sync_scan: returns the offset of the first packet in @buf which is followed
+ * by @count-1 other sync bytes at the @stride packet size, or -1 if none is found.
+ */
+static inline ssize_t ts_sync_scan(const char *buf, size_t len, size_t stride, int count)
+{
+#ifdef TS_SYNC_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return ts_sync_scan_avx2((const uint8_t *) buf, len, stride, count);
+	if (__builtin_cpu_supports("sse2"))
+		return ts_sync_scan_sse2((const uint8_t *) buf, len, stride, count);
+#endif
+	return ts_sync_scan_scalar((const uint8_t *) buf, len, stride, count, 0);
+}
+
+/**
+ * ts_sync_scan_tail: looks for aligned packets in the last bytes of the input,
+ * which may be too short to hold @TS_RESYNC_PACKETS of them. Returns the offset
+ * of the first sync byte which begins a whole packet and whose following packets,
+ * up to the end of @buf, begin with the sync byte too, or -1 if none is found.
+ */
+static inline ssize_t ts_sync_scan_tail(const char *buf, size_t len, size_t stride)
+{
+	size_t i, j;
+
+	for (i=0; i+stride <= len; ++i) {
+		if (buf[i] != TS_SYNC_BYTE)
+			continue;
+		for (j=i+stride; j<len && buf[j] == TS_SYNC_BYTE; j+=stride)
+			;
+		if (j >= len)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Resynchronization state for stream backends. Bytes which were already read
+ * from the input but not yet handed out as packets are kept in @data.
+ * @pos: first pending byte in @data
+ * @len: end of the pending bytes in @data
+ * @discarded: statistics: bytes thrown away while looking for the sync byte
+ */
+struct ts_resync {
+	char data[TS_RESYNC_WINDOW];
+	size_t pos;
+	size_t len;
+	uint64_t discarded;
+};
+
+/* Reads up to @len bytes from the input. Returns 0 on EOF or a negative errno value on errors. */
+typedef ssize_t (*ts_resync_read_t)(void *handle, char *buf, size_t len);
+
+static inline size_t ts_resync_pending(struct ts_resync *r)
+{
+	return r->len - r->pos;
+}
+
+/**
+ * ts_resync_drain: moves up to @len pending bytes to @dst.
+ * @return the number of bytes copied.
+ */
+static inline size_t ts_resync_drain(struct ts_resync *r, char *dst, size_t len)
+{
+	size_t n = ts_resync_pending(r);
+	if (n > len)
+		n = len;
+	memcpy(dst, &r->data[r->pos], n);
+	r->pos += n;
+	if (r->pos == r->len)
+		r->pos = r->len = 0;
+	return n;
+}
+
+/**
+ * ts_resync_unread: puts @len bytes back in front of the pending ones.
+ */
+static inline void ts_resync_unread(struct ts_resync *r, const char *src, size_t len)
+{
+	size_t pending = ts_resync_pending(r);
+
+	assert(pending + len <= sizeof(r->data));
+	if (r->pos < len) {
+		memmove(&r->data[len], &r->data[r->pos], pending);
+		r->pos = len;
+		r->len = len + pending;
+	}
+	r->pos -= len;
+	memcpy(&r->data[r->pos], src, len);
+}
+
+/**
+ * ts_resync_stream: skips pending bytes, pulling more from the input with @read_fn,
+ * until they start with @TS_RESYNC_PACKETS sync bytes at the @stride packet size,
+ * or with fewer of them if that's all that is left before the end of the input.
+ * Callers put the damaged packet back with ts_resync_unread() before calling this.
+ * @return 0 on success, -ENODATA if the input ended or a negative errno value on errors.
+ */
+static inline int ts_resync_stream(struct ts_resync *r, size_t stride, ts_resync_read_t read_fn, void *handle)
+{
+	size_t span = stride * (TS_RESYNC_PACKETS-1), skipped = 0, keep;
+	ssize_t offset, n;
+
+	while (true) {
+		offset = ts_sync_scan(&r->data[r->pos], ts_resync_pending(r), stride, TS_RESYNC_PACKETS);
+		if (offset >= 0) {
+			r->pos += offset;
+			skipped += offset;
+			break;
+		}
+
+		/* Only the last @span bytes may still begin an aligned packet */
+		keep = ts_resync_pending(r) > span ? span : ts_resync_pending(r);
+		skipped += ts_resync_pending(r) - keep;
+		memmove(r->data, &r->data[r->len - keep], keep);
+		r->pos = 0;
+		r->len = keep;
+
+		n = read_fn(handle, &r->data[r->len], TS_RESYNC_CHUNK);
+		if (n == 0 && (offset = ts_sync_scan_tail(r->data, r->len, stride)) >= 0) {
+			/* The input ended, but its last packets line up */
+			r->pos = offset;
+			skipped += offset;
+			break;
+		} else if (n <= 0) {
+			skipped += r->len;
+			r->pos = r->len = 0;
+			r->discarded += skipped;
+			TS_WARNING("lost sync, discarded %zu bytes before the end of the input", skipped);
+			return n < 0 ? n : -ENODATA;
+		}
+		r->len += n;
+	}
+
+	r->discarded += skipped;
+	TS_WARNING("lost sync, discarded %zu bytes", skipped);
+	return 0;
+}
+
+#endif /* __tssync_h */